@@ -23,13 +23,21 @@
   And comment the opposite. Then compile:
 
   For posix systems (linux etc):
-  compile with: cc -o basic basic.c -Wall
+  compile with: cc -o basic basic.c -Wall -lpthread
  
   For Arduino Due: 
   rename basic.c to basic.ino
   Use the Arduino IDE to compile and
   upload this program.
 
+  To use basic from your own C/C++ program (posix only), also
+  uncomment #define library. There is no main() then - see
+  tinybasic.h for the calls and examples/host.c for a sample:
+  cc -O2 -I. -o host examples/host.c basic.c -lpthread
+  Interpreters made with tb_share run the same program without 
+  copying it: the text and a line number index are shared and 
+  a private copy is only made when one of them changes it.
+
    ------------------------------ 
   To run on a posix (linux) machine::
   basic [filename] where filename is an optional basic 
@@ -40,6 +48,26 @@
   will start with an Ok> prompt and place you in the editor 
   mode with an empty file.
 
+  basic --batch dir [threads] runs every .bas file in dir at 
+  the same time, one thread per core unless threads is given. 
+  Each program gets its own variables and arrays. PRINT output 
+  goes to name.out in dir and INPUT reads name.in if there is 
+  one. EXIT ends just that program. A line per program (status 
+  end/stop/ok/error, time, thread) and a total are printed; 
+  the exit code is 1 if any program failed. The programs can 
+  pass values with SEND/RECV; a program waiting on one that 
+  hasn't started yet waits with it, so give a pipeline at 
+  least as many threads as it has programs.
+
+  basic --serve socket program [workers] loads program once and 
+  forks workers (one per core) that wait on the unix socket, so 
+  a job never waits for basic to start. Each connection is one 
+  run: send a line of variable settings (a=1 b=-2, or an empty 
+  line), then any lines for INPUT, and read the PRINT output 
+  until the worker closes. Variables and arrays are cleared 
+  between jobs. SIGINT/SIGTERM stop the workers and remove the 
+  socket. ie: printf "a=6 b=7\n" | nc -U /tmp/basic.sock
+
    ----------------
   On an Arduino Due: 
   load the program using the IDE and plug in a usb 
@@ -80,13 +108,34 @@
   END
   EXIT
   SLEEP [0-9] (integer seconds) (NOTE:posix only)
-  DELAY [0-9/a-z] (value is in msec)
+  DELAY [0-9/a-z] (value is in msec)  only this task waits, others run
   FOR [a-z]=[a-z/0-9/expr] TO [a-z/0-9/expr] STEP [+-][0-9/a-z/expr]
   NEXT [a-z]
+  PFOR [a-z]=[expr] TO [expr] STEP [expr]  FOR split over threads (posix)
   CLEAR
   DIM (0-9/a-z/[expr])  NOTE: Array NOT cleared at start
+  DIM SPARSE [expr]  hash backed @(), expr is the value of unset elements
+  DIM [a-z](expr[,expr[,expr]])  named array a()-z(), cleared to 0
   FILEOPEN [a-z/0-9][Rr/Ww]
   FILECLOSE
+  FILL @(expr..expr) [expr]
+  COPY @(expr..expr) @(expr)
+  ADD/SUB/MUL @(expr..expr) [expr/@(expr)]
+  MASK @(expr..expr) [=#<>][expr] @(expr)
+  SORT @(expr..expr)
+  PUT expr,expr
+  DEL expr
+  ATOMIC ADD/XCHG @(expr),expr  ATOMIC CAS @(expr),expr,expr
+  SPAWN [line number][,a-z]  start a task at line, its number in a-z
+  YIELD
+  WAIT [expr]  wait for task expr, or with no expr every other task
+  SEND expr,expr  put a value on a channel (waits while it's full)
+  RECV expr,[a-z]  take the next value off a channel (waits for one)
+  ON TIMER expr GOSUB [line number]  run line every expr msec
+  ON TIMER OFF  ON TIMER 0 GOSUB [line number]  stop all/one timer
+  ON EVENT expr GOSUB [line number]  run line when channel expr has a value
+  ON EVENT expr OFF
+  IDLE  sleep until the next ON TIMER/EVENT handler is due
 
   --- Arduino Specific Statements ---
   PINSET [0-9/a-z]
@@ -126,6 +175,16 @@
   Functions:
   ABS(x) w/x = [a-z]	absolute value of variable a-z
   RANDOM()				random number between 0 and 2^32/2 -1
+  SUM(a,b)				sum of @(a) thru @(b)
+  MIN(a,b)				smallest of @(a) thru @(b)
+  MAX(a,b)				largest of @(a) thru @(b)
+  COUNT(a,b,n)			number of @(a) thru @(b) equal to n
+  SEARCH(a,b,n)			index of n in sorted @(a) thru @(b), -1 if not found
+  GET(k)				value stored by PUT k, 0 if none
+  HAS(k)				1 if PUT k was done (and no DEL k), else 0
+  XADD(i,n)			add n to @(i) atomically, return the old value
+  XCHG(i,n)			set @(i) to n atomically, return the old value
+  CAS(i,a,b)			if @(i)=a set it to b (atomically) and return 1, else 0
 
   Functions return a numeric integer value 
   ------------------------------------------------------------------------
@@ -142,6 +201,15 @@
   array. nn is the decimal size of the array, maximum size is 
   ARRAYMAX integers. On the Arduino, that's 4*ARRAYMAX 
   (see #define ARRAYMAX below). 
+  'dim sparse' makes @() a hash table instead: any index from 
+  0 thru 2^31-2 can be used and only assigned elements take 
+  memory (SPARSEMAX elements max).
+
+  There are also 26 named arrays a() thru z() with up to 
+  MAXDIMS dimensions (dim a(100,200),b(10)). They are kept 
+  seperate from the variables a-z, are stored in row-major 
+  order and are cleared when dimensioned. Use them anywhere 
+  a variable can be used: let a(i,j)=a(i,j-1)+b(3)
 
   Text variables are a$ - z$ and are MAXLINE characters 
   long (#define in line ~ 310). Text vars are used in LET, 
@@ -163,6 +231,34 @@
   			If linenumber is given then no variables are cleared. The 
 			basic program starts running from the given line.
 
+  run [linenumber] &	Run the program in the background and come straight
+			back to the Ok> prompt (INPUT there reads nothing).
+			Editing the program meanwhile doesn't change the
+			running copy. When it ends the prompt says so.
+			On the Arduino it runs while the prompt waits for
+			a key (2 at a time), on posix on a thread (8).
+
+  jobs			List the background programs and how they ended.
+
+  kill n		Stop background program n (or forget it if done).
+
+  peek [n] [var]	Show variable a-z or a$-z$ of background program n
+			(the first one if no n) while it runs. With no var
+			all the variables that are not 0 are shown.
+
+  profile [n]		Run the program timing each line, then show the n
+			(10) lines it spent the most time in (runs, ms,
+			ns a run, % of the time) and the GOSUB targets by
+			time in them: incl counts the GOSUBs they make,
+			excl does not. (posix only)
+
+  sample [file]		Run the program while a SIGPROF timer looks at it
+			about every msec of cpu time, then write the stacks
+			it saw (GOSUB targets and the line running) to file
+			(basic.folded) as folded stacks for flamegraph.pl.
+			Only the main task is followed, not SPAWNed ones.
+			Cheaper than profile in tight loops. (posix only)
+
   list			Display the basic program in memory.
 
   cls                   Clear the display
@@ -187,7 +283,50 @@
 
   exit			Exit the basic interpreter.
 
-  trace			Toggle program tracing ON/OFF.
+  trace			Toggle program tracing ON/OFF. While it is on each
+			line run is kept (time, line, statement, task) in
+			a ring of the last 65536 (256 on the Arduino),
+			nothing is printed. Turning it on starts afresh.
+
+  tracedump [n]		Show the last n (20) lines traced, also after the
+			program stopped on an error.
+
+  tracedump file	Write the trace to file for examples/tracedec.c,
+			which prints it on any machine. (posix only)
+
+  stats			Show the counters basic keeps as it runs: lines run
+			by statement, eval calls, line number lookups and
+			lines looked at, deepest GOSUB, @() reads/writes,
+			file bytes read/written and bytes printed. run
+			starts them from 0.
+
+  stats json [file]	The same as JSON, to file if given. With the
+			environment variable BASICSTATS=file the JSON is
+			written there when basic exits. (posix only)
+
+  metrics [path|off]	Serve the counters of the prompt and of each run &
+			job in Prometheus text format on Unix socket path,
+			from a side thread, with rates over the last second.
+			Scrape with curl --unix-socket path http://x/metrics.
+			metrics alone shows the path, metrics off stops.
+			BASICMETRICS=path starts it at startup. (posix only)
+
+  cover [on|off]	cover on starts noting which lines run (one bit a
+			line, cheap enough to leave on), over any number
+			of runs. cover shows how many have run and lists
+			the ones that have not, cover off stops.
+  cover lcov file	Merge them into lcov tracefile file for genhtml.
+			DA counts the dumps that ran the line. With
+			BASICCOVER=file cover is on from the start and
+			merged into file when basic exits. (posix only)
+
+  latency [on|off]	Show how long INPUT, FILEREAD, FILEWRITE and
+			DELAY/SLEEP took, from starting until the line went
+			on: count, mean, p50, p99 and max in msec. They
+			are kept in log-linear histograms (buckets 12%
+			wide, 25% on arduino) cleared by run. latency on
+			also shows them each time a program ends; stats
+			json has them too, in usec.
 
   dump			Show a hex memory dump of the basic file.
 
@@ -309,6 +448,7 @@
 /* how are we coding this? (choose posix/arduino) */
 //#define posix               // build for posix/linux
 #define arduino               // build for arduino
+//#define library             // posix only: no main(), a host calls tb_*() (tinybasic.h)
 #define MAXLINE 80            // max chars in a line
 #define SDCARDCS 53           // chip select for the SD card
 /* !!!!!!!!!! NOTE NOTE NOTE NOTE NOTE !!!!!!!!!!! */
@@ -321,9 +461,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #ifdef posix
 #include <unistd.h> 	// for posix sleep()
+#include <pthread.h>	// batch runner thread pool
+#include <dirent.h>		// batch runner directory scan
+#include <time.h>		// batch runner timing
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>	// sample: setitimer SIGPROF
+#include <sched.h>		// sched_yield: tasks waiting on other threads
+#include <poll.h>		// INPUT: is there a line to read
+#include <fcntl.h>		// INPUT: look in stdio's buffer without blocking
+#include <sys/socket.h>	// server mode: unix socket
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__AVX2__)
+#include <immintrin.h>	// AVX2 kernels for fill/copy/add/sub/mul/mask
+#elif defined(__SSE2__)
+#include <emmintrin.h>	// SSE2 kernels for fill/copy/add/sub/mul/mask
+#endif
+#endif
+
+#ifdef library
+#include "tinybasic.h"	// host interface
 #endif
 
 #ifdef arduino
@@ -349,20 +511,80 @@ uint8_t fram_data = 0;
 #ifdef posix
 #define BUFSIZE 65536		// ram buffer memory for bigger computers
 #define ARRAYMAX 65536      // max size of @() array (4 bytes/element)
+#define SPARSEMAX 1048576   // max entries in a dim sparse @() array (8 bytes/entry)
+#define MAPMAX 1048576      // max keys in the put/get hash map (8 bytes/key)
+#define PFORMAX 64          // most threads one PFOR loop is split over
+#define PFORMIN 256         // iterations per thread worth starting one for
+#define MAXJOBS 8           // run & background jobs
+#define TRACESIZE 65536     // trace records kept (8 bytes each, power of 2)
+#define HISTSUB 8           // latency histograms: buckets per doubling (power of 2)
+#define HISTBUCKETS 240     // (33 - log2 HISTSUB) * HISTSUB: up to 2^32 usec
 // NOTE: on a posix machine, these are really unlimited due to VM
 #endif
 
 #ifdef arduino
 #define BUFSIZE 32768		// ram buffer memory (arduino) for basic statements (appx 23 bytes/line)
 #define ARRAYMAX 12032      // max size of @() array (4 bytes/element)
+#define SPARSEMAX 2048      // max entries in a dim sparse @() array (8 bytes/entry)
+#define MAPMAX 1024         // max keys in the put/get hash map (8 bytes/key)
 // NOTE: If you need more program size, adjust array size down so that you have 1024 bytes on top
 // 16384 + (12032 * 4) + 1024 = 65536  (every byte of buffer = 4 bytes of array)
 #define MAXRAND 2147483647	// 2^31-1
+#define MAXJOBS 2           // run & background jobs
+#define TRACESIZE 256       // trace records kept (8 bytes each, power of 2)
+#define HISTSUB 4           // latency histograms: buckets per doubling (power of 2)
+#define HISTBUCKETS 124     // (33 - log2 HISTSUB) * HISTSUB: up to 2^32 usec
+#define JOBSLICE 20         // lines a job runs each time the prompt waits for a key
 
 #endif
 
 #define MAXLINENUMBER 32767     // increase if you need to
+#define COVERBYTES (MAXLINENUMBER/8+1)  // cover: a bit for every line number
 #define MAXRETURNSTACKPOS 10    // basic: max stack depth
+#ifdef arduino
+#define MAXTASKS 4              // main program + 3 SPAWNed tasks
+#else
+#define MAXTASKS 16             // main program + 15 SPAWNed tasks
+#endif
+#ifdef arduino
+#define MAXCHANNELS 4           // SEND/RECV channels 0-3
+#define CHANSIZE 32             // values a channel holds (power of 2)
+#else
+#define MAXCHANNELS 16          // SEND/RECV channels 0-15
+#define CHANSIZE 1024           // values a channel holds (power of 2)
+#endif
+#ifdef arduino
+#define MAXTIMERS 4             // ON TIMER handlers
+#else
+#define MAXTIMERS 16            // ON TIMER handlers
+#endif
+#define IDLEMAX 100             // longest IDLE sleep (msec): ^C and kill still get seen
+#define SAMPLEUS 1000           // sample: usec of cpu time between samples
+#define SAMPLESTACKS 4096       // sample: different stacks it can count (power of 2)
+#define MAXDIMS 3               // max dimensions of a named array a()-z()
+#define VEC_FILL 1              // whole array statements (parse_vector)
+#define VEC_COPY 2
+#define VEC_ADD 3
+#define VEC_SUB 4
+#define VEC_MUL 5
+#define VEC_MASK 6
+#define RED_SUM 1               // reduction functions (reduce)
+#define RED_MIN 2
+#define RED_MAX 3
+#define RED_COUNT 4
+#define RED_SEARCH 5            // search(a,b,n) shares the range code
+#define ATOM_ADD 1              // atomic @() updates (atomicop)
+#define ATOM_XCHG 2
+#define ATOM_CAS 3
+#define NKEYWORDS 43            // entries in keywords[] (trace, stats)
+#define LATINPUT 0              // latency histograms, one per kind of wait
+#define LATFILEREAD 1
+#define LATFILEWRITE 2
+#define LATDELAY 3              // DELAY and SLEEP
+#define NLATENCY 4
+#define RADIXMIN 64             // sort: below this many use introsort
+#define HASHINIT 16             // starting slots in a hash table (power of 2)
+#define HASHEMPTY INT_MIN       // key value marking an unused hash slot
 #define HEADER "\r\nTiny+ Basic    (C) 2020 Kurt Theis"
 
 /* define routine return values */
@@ -370,6 +592,12 @@ uint8_t fram_data = 0;
 #define ERROR_RETURN -2		// basic returned an error
 #define END_RETURN -3		// basic encountered END
 #define STOP_RETURN -4		// basic encountered STOP
+#define CALL_RETURN -5		// RETURN back to the host (tb_call)
+#define YIELD_RETURN -6		// task gives the other tasks a turn (YIELD)
+#define BLOCK_RETURN -7		// task can't go on yet: run the line again later
+#define TASK_RETURN -8		// spawned task is finished
+#define LOOP_RETURN -9		// PFOR worker got to the end of its share
+#define SLICE_RETURN -10	// arduino run &: slice used up, carry on at ctx->resume
 
 /* define error messages */
 #define ERR1    "syntax error\r\n"
@@ -422,7 +650,286 @@ uint8_t fram_data = 0;
 #define ERR48   "index to array must be a variable in line "
 #define ERR49   "logical eval error in line "
 #define ERR50   "directory error "
+#define ERR51   "too many tasks in line "
+#define ERR52   "all tasks waiting in line "
+#define ERR53   "bad channel in line "
+#define ERR54   "pfor failed in line "
+#define ERR55   "pfor without next in line "
+#define ERR56   "too many jobs\r\n"
+#define ERR57   "no such job\r\n"
+#define ERR58   "too many timers in line "
+#define ERR59   "channel deadlock in line "
+
+
+
+/* hash table (open addressing, linear probing) used by DIM SPARSE and PUT/GET */
+struct hashslot {
+	int key;		// HASHEMPTY if slot unused
+	int val;
+};
+struct hashtable {
+	struct hashslot *slot;
+	unsigned int size;		// slots allocated (power of 2)
+	unsigned int count;		// slots in use
+	unsigned int max;		// most entries allowed
+	int haveempty;			// HASHEMPTY itself is a key (kept out of the slots)
+	int emptyval;			// and its value
+};
+
+/* named array a()-z(), elements stored contiguously in row-major order */
+struct namedarray {
+	int *data;				// elements, last index varies fastest
+	int dims;				// number of dimensions, 0 if not dimensioned
+	int size[MAXDIMS];		// extent of each dimension
+	int stride[MAXDIMS];	// elements between successive indexes of each dimension
+	int total;				// number of elements
+};
+
+/* program image: the text of a basic program and its line index. */
+/* Contexts running the same program share one image (refs counts */
+/* them) and never write to it. A context about to change its     */
+/* program calls progwrite() first and gets its own copy if the   */
+/* image is shared, so only variables and stacks are per context. */
+struct lineindex {
+	int line;				// line number
+	int addr;				// start of the line in text
+	int next;				// start of the line after it
+};
+struct program {
+	unsigned char *text;	// BUFSIZE bytes of program lines
+	int refs;				// contexts using this image
+	struct lineindex *index;	// built on the first jump, dropped by an edit
+	int lines;				// entries in index
+	int sorted;				// line numbers ascending: binary search the index
+};
+
+/* a basic task (SPAWN). The running task's stacks live in the context; */
+/* the others are kept here until the scheduler switches back to them.  */
+struct task {
+	int live;				// 0 = free slot
+	int pos;				// address it carries on from
+	unsigned int foraddr;	// its for/next state
+	unsigned char forvar;
+	int tovar;
+	int forstep;
+	int return_stack[MAXRETURNSTACKPOS];	// its gosub stack
+	int return_stack_position;
+	int inputskip;			// INPUT it was blocked in: where to pick up
+	long long wake;			// DELAY/SLEEP it is in: clockms() to go on at
+	long long since;		// and traceus() when it first tried (latency)
+};
+
+/* ON TIMER handler: timers are kept as a min-heap on due */
+struct ontimer {
+	long long due;			// clockms() when it runs next
+	int period;				// msec between runs
+	int addr;				// handler line
+};
+
+/* ON EVENT handler: runs while its channel has a value to RECV */
+struct onevent {
+	int chan;
+	int addr;				// handler line
+};
+
+/* SEND/RECV channel: a bounded ring of integers. Programs on one   */
+/* thread use it single producer/single consumer (head and tail are */
+/* each written by one side only). When contexts on several threads */
+/* share the channels (batch, library) it is multi producer/multi   */
+/* consumer: each slot has a turn number (Vyukov's bounded queue),  */
+/* kept as turn - slot so that all zeroes is an empty channel.      */
+struct channel {
+	unsigned int head;		// next value to RECV
+	#ifdef posix
+	char pad1[60];			// head and tail on their own cache lines
+	#endif
+	unsigned int tail;		// next free slot to SEND into
+	#ifdef posix
+	char pad2[60];
+	unsigned int turn[CHANSIZE];	// mpmc only
+	#endif
+	int val[CHANSIZE];
+};
+
+/* log-linear histogram of usec: values below 2*HISTSUB have a bucket */
+/* each, above that every doubling is split into HISTSUB buckets, so   */
+/* a bucket is never more than 1/HISTSUB (posix 12%) wide.             */
+struct histogram {
+	unsigned int bucket[HISTBUCKETS];
+	long long count;
+	long long total;		// usec, for the mean
+	long long max;
+};
+
+/* interpreter counters for the stats command, always on. run clears them. */
+struct stats {
+	long long statements[NKEYWORDS];	// lines run, by keywords[] number
+	long long evals;			// eval() calls
+	long long lookups;			// line number lookups (GOTO, GOSUB, ...)
+	long long lookupsteps;		// lines they looked at
+	int maxdepth;				// deepest the GOSUB stack got
+	long long arrayreads;		// @() reads and writes
+	long long arraywrites;
+	long long fileread;			// FILEREAD/FILEWRITE bytes
+	long long filewritten;
+	long long printed;			// bytes of PRINT (and messages)
+	int line;					// line running now (metrics)
+	struct histogram latency[NLATENCY];	// usec INPUT, FILEREAD, ... took (latency)
+};
+
+/* trace record: one per line run while trace is on. A tracedump */
+/* file is these after a header, see examples/tracedec.c.       */
+struct tracerec {
+	unsigned int us;		// usec since trace went on (wraps after 71 min)
+	unsigned short line;	// line number
+	unsigned char kind;		// statement: keywords[] index
+	unsigned char task;		// task that ran it, 0 = main
+};
+
+/* profile: time and counts per line, kept by the line's address */
+struct profline {
+	long long count;		// times the line ran
+	long long ns;			// time spent running it
+	long long calls;		// GOSUBs (and handlers) to it
+	long long incl;			// ns from those GOSUBs to their RETURNs
+	long long excl;			// the same less the GOSUBs it made
+};
+struct profframe {			// a GOSUB the profiler is timing
+	int addr;				// its target line
+	long long start;		// when it was made
+	long long child;		// ns spent in the GOSUBs it made
+};
+struct samplestack {		// sample: a stack seen, and how often
+	int n;					// frames in it, 0 = free slot
+	int addr[MAXRETURNSTACKPOS+1];	// GOSUB targets, then the line running
+	long long count;
+};
+struct profile {
+	struct profline *lines;	// one per byte of program text
+	struct profframe frames[MAXRETURNSTACKPOS];
+	int depth;				// frames open
+	int last;				// line running now, -1 before the first
+	long long t;			// when it started
+
+	int sample;				// sample command: no timing, SIGPROF looks at:
+	volatile int cur;		// the line running now
+	volatile int targets[MAXRETURNSTACKPOS];	// the GOSUBs it is in
+	volatile int ntargets;
+	struct samplestack *stacks;	// hash table of the stacks seen
+	long long samples;		// SIGPROFs counted
+	long long lost;			// and the ones with no room in stacks
+};
+
+/* interpreter context: everything one basic program owns. Every routine */
+/* that touches program state takes it, so one process can run many.   */
+struct context {
+	struct program *prog;		// program image, maybe shared with other contexts
+	unsigned char *buffer;		// basic program text (prog->text)
+	unsigned int position;		// end of the program in buffer
+	unsigned int maxline;		// highest line number
+	int error;					// when a routine fails, error gets set
+	int trace;					// enables trace in parse()
+	struct tracerec *tracebuf;	// trace ring, TRACESIZE records
+	long long tracenext;		// records written since trace went on
+	long long tracestart;		// traceus() when it went on
+	struct stats stats;			// counters for the stats command
+	unsigned char *cover;		// cover command: bit per line number run, else NULL
+	char printmessage[MAXLINE+(MAXLINE/2)];		// universal print routine
+	int arraymax;				// max size of array, assigned in DIM
+
+	unsigned int foraddr;		// loop address for/next 
+	unsigned char forvar;		// hold var name for/next
+	int tovar;					// final number for/next
+	int forstep;				// hold step size
+	int pfor;					// PFOR worker: its NEXT ends the share, not the loop
+
+	int return_stack[MAXRETURNSTACKPOS];	// return stack for gosubs
+	int return_stack_position;
+	int inputskip;				// resume a blocked INPUT at line+inputskip
+	long long wake;				// in DELAY/SLEEP until clockms() gets here
+	long long since;			// blocked in INPUT/DELAY since traceus() was this
+	int latencyend;				// latency on: show them when a run ends
+
+	struct task tasks[MAXTASKS];	// tasks[0] is the main program
+	int curtask;				// task running now
+	int livetasks;				// tasks not finished (main included)
+	int blocked;				// BLOCK_RETURNs in a row: all tasks stuck?
+
+	struct ontimer timers[MAXTIMERS];	// ON TIMER, timers[0] is due first
+	int ntimers;
+	struct onevent events[MAXCHANNELS];	// ON EVENT, one per channel at most
+	int nevents;
+	int nextevent;				// events[] looked at first: take turns
+	int onbusy;					// a handler is running: no other one starts
+	int ontask;					// in this task
+	int ondepth;				// until its gosub stack is below this
+	long long onwake, onsince;	// the DELAY/INPUT it cut into, back when it's done
+	int oninputskip;
+
+	int intvar[26];				// integer variables a-z
+	int *intarray;				// array for DIM and @(n)
+	struct hashtable sparse;	// hash table storage for DIM SPARSE
+	int sparsemode;				// set when @() is hash backed (DIM SPARSE)
+	int sparsedefault;			// value of an @(n) never assigned
+	struct hashtable hashmap;	// PUT k,v / GET(k) / HAS(k) / DEL k
+	struct context *maps;		// whose sparse and hashmap to use: itself, or the PFOR caller's
+	struct namedarray arrays[26];	// named arrays a() - z() (seperate from variables a-z)
+	char textvar[26][80];		// text variables a$ - z$
+
+	int background;				// run &: INPUT reads nothing, the prompt has the keyboard
+	#ifdef posix
+	FILE *diskfile;				// used for fileopen/close etc
+	FILE *out;					// PRINT and messages go here, NULL = stdout
+	FILE *in;					// INPUT reads from here, NULL = stdin
+	int hosted;					// run for a host/batch: EXIT ends the program, not the process
+	int killed;					// kill from the prompt: stop at the next line
+	int chanwaits;				// counted in chanstuck
+	unsigned int chanseen;		// chanmoves when it was
+	struct profile *prof;		// profile command running, else NULL
+	char source[32];			// file the program was loaded from (cover lcov)
+	#endif
+	#ifdef arduino
+	int slice;					// run &: lines left in this turn (0 = not a job)
+	int resume;					// run &: where the next turn starts
+	#endif
+};
+
+/* a run & background job. On posix it has a thread of its own, on the */
+/* arduino it runs JOBSLICE lines at a time while the prompt waits.   */
+struct job {
+	struct context *ctx;		// NULL = free slot
+	char cmd[MAXLINE];			// the run command it was started with
+	int done;					// run() has returned
+	int res;					// and what it returned
+	int reported;				// prompt has said it finished
+	#ifdef posix
+	pthread_t tid;
+	#endif
+};
+
 
+#ifdef posix
+/* metrics socket: what its thread last saw, see metricscmd */
+struct metricsample {		// one program, as the last look saw it
+	int live;
+	int running;			// jobs: still going
+	int line;				// line it was running
+	long long statements;	// lines run
+	long long fileread;		// file bytes
+	long long filewritten;
+	long long memory;		// bytes of program, arrays and maps
+	double rate[3];			// per second: statements, fileread, filewritten
+};
+struct metricserver {
+	int fd;					// listening socket, -1 = not serving
+	char path[108];
+	int stop;				// metrics off: thread, finish up
+	pthread_t tid;
+	struct context *ctx;	// the prompt's interpreter
+	struct metricsample last[MAXJOBS+1];	// the prompt, then jobs[]
+	double lasttime;		// when last was taken
+};
+#endif
 
 
 /* ******************** */
@@ -433,53 +940,201 @@ uint8_t fram_data = 0;
 extern void run80(void);
 
 
+/* interpreter context */
+struct context *ctxnew(void);
+struct context *ctxshare(struct context *);
+void ctxfree(struct context *);
+struct program *prognew(void);
+void progfree(struct program *);
+int progwrite(struct context *);
+int progindex(struct context *);
+
 /* editor routines */
-void list(char[]);
-int getmaxlinenum(void);
-int isline(int);
-void fileload(char *);
-void filesave(char *);
-void flist(char *);
-void dir(char*);
-int run(char *);
+void list(struct context *,char[]);
+int getmaxlinenum(struct context *);
+int isline(struct context *,int);
+void fileload(struct context *,char *);
+int readprogram(struct context *,const char *);
+int batch(char *,int);
+int serve(char *,char *,int);
+void filesave(struct context *,char *);
+void flist(struct context *,char *);
+void dir(struct context *,char*);
+int run(struct context *,char *);
+int execute(struct context *,int);
+int executelines(struct context *,int);
+void chanunstuck(struct context *);
+void runclear(struct context *);
+void taskclear(struct context *);
+int taskswitch(struct context *,int,int);
+int parse_spawn(struct context *,char[]);
+int parse_wait(struct context *,char[]);
+int inputwait(struct context *);
+#ifdef posix
+int inputready(FILE *);
+#endif
+int taskstuck(struct context *);
+long long tasksleep(struct context *);
+void eventwait(struct context *);
+int parse_delay(struct context *,int);
+int parse_chan(struct context *,char[]);
+int chansend(struct channel *,int);
+int chanrecv(struct channel *,int *);
+int chanready(struct channel *);
+long long clockms(void);
+int parse_on(struct context *,char[]);
+int parse_idle(struct context *);
+int onpoll(struct context *,int);
+void timerup(struct context *,int);
+void timerdown(struct context *,int);
+void timerremove(struct context *,int);
 void tokenize(char[]);
 void linetolower(char *);
-void filedelete(char *);
+void filedelete(struct context *,char *);
 void showmem();
+void prout(struct context *,char[MAXLINE+(MAXLINE/2)]);
+void jobstart(struct context *,char *);
+const char *jobstatus(struct job *);
+void jobcheck(struct context *);
+void jobslist(struct context *);
+void jobkill(struct context *,char *);
+void jobpeek(struct context *,char *);
+void jobfree(struct job *);
+void jobstep(void);
+long long clockns(void);
+void profline(struct context *,int);
+int profnext(struct context *,int,long long,int);
+void profreport(struct context *,int);
+void profile(struct context *,char *);
+int keywordid(const char *);
+long long traceus(void);
+int traceon(struct context *);
+void tracerecord(struct context *,int,int);
+void tracedump(struct context *,char *);
+void statsshow(struct context *,char *);
+void statsjson(struct context *,FILE *);
+void statsexit(struct context *);
+void statsadd(struct stats *,struct stats *);
+int coverlines(struct context *,int *);
+void covershow(struct context *,char *);
+int coverlcov(struct context *,const char *);
+void coverexit(struct context *);
+void histrecord(struct histogram *,long long);
+long long histvalue(struct histogram *,int);
+int latency(struct context *,int,long long,int);
+void latencyshow(struct context *,char *);
+long long ctxmemory(struct context *);
+void metricstake(void);
+int metricstext(char *,int);
+void *metricsthread(void *);
+void metricscmd(struct context *,char *);
+void metricsstop(void);
+void samplesignal(int);
+void sample(struct context *,char *);
 
 
 /* basic subroutines */
-int parse(char *);
-int setlinenumber(char[],int);
-int parse_print(char[]);
-int parse_input(char[]);
-int eval(char *);
-int parse_let(char[]);
-int evallogic(char *);
-int parse_if(char[]);
-int parse_for(char[]);
-int parse_next(char[]);
+int parse(struct context *,char *);
+int setlinenumber(struct context *,char[],int);
+int parse_print(struct context *,char[]);
+int parse_input(struct context *,char[]);
+int eval(struct context *,char *);
+int parse_let(struct context *,char[]);
+int evallogic(struct context *,char *);
+int parse_if(struct context *,char[]);
+int parse_for(struct context *,char[]);
+int parse_next(struct context *,char[]);
+int parse_pfor(struct context *,char[]);
+int pforbody(struct context *,int,char,int *);
 int isoperand(char);
-int domath(int,char,int);
+int domath(struct context *,int,char,int);
 int dueanalog(int);
-int fileopen(char[],char[]);
-int fileclose(void);
-int fileread(char[]);
-int filewrite(char[]);
+int *hashfind(struct hashtable *,int);
+int hashput(struct context *,struct hashtable *,int,int);
+int hashdel(struct hashtable *,int);
+int parse_map(struct context *,char[]);
+int mapfunc(struct context *,char **);
+int parse_atomic(struct context *,char[]);
+int atomfunc(struct context *,char **);
+int atomicop(struct context *,int,int,int,int);
+int iscall(char *);
+int callvalue(struct context *,char **);
+void hashfree(struct hashtable *);
+int arrayget(struct context *,int);
+int arrayput(struct context *,int,int);
+void arrayfree(struct context *);
+int dimnamed(struct context *,char *);
+int arrayoffset(struct context *,char **,struct namedarray *);
+int namedget(struct context *,char **);
+int getargs(struct context *,char **,int[],int);
+int reduce(struct context *,char **);
+int sparsereduce(struct context *,int,int,int,int);
+int parse_sort(struct context *,char[]);
+int sparsesort(struct context *,int,int);
+void sortints(int *,int);
+void sortradix(int *,int *,int);
+void sortintro(int *,int,int);
+void sortheap(int *,int);
+void siftdown(int *,int,int);
+int vecsearch(struct context *,int,int,int);
+int vecsum(const int *,int);
+int vecminmax(const int *,int,int);
+int veccount(const int *,int,int);
+char *skipexpr(char *);
+int parse_vector(struct context *,char[]);
+int arrayrange(struct context *,char *,int *,int *);
+int arraystart(struct context *,char *,int);
+int vecslow(struct context *,int,int,int,int,int,char,int);
+void vecfill(int *,int,int);
+void vecadd(int *,int,int);
+void vecmul(int *,int,int);
+void vecaddarray(int *,const int *,int,int);
+void vecmularray(int *,const int *,int);
+void vecmask(int *,const int *,int,char,int);
+int fileopen(struct context *,char[],char[]);
+int fileclose(struct context *);
+int fileread(struct context *,char[]);
+int filewrite(struct context *,char[]);
 
 
 
 /* **************** */
 /* global variables */
 /* **************** */
+/* everything a running basic program owns lives in struct context */
+
+#ifdef posix
+volatile sig_atomic_t servestop = 0;	// server mode: set by SIGINT/SIGTERM
+#endif
+
+/* SEND/RECV channels belong to the process, so that programs */
+/* running side by side (batch, library) can talk to each other */
+struct channel channels[MAXCHANNELS];
 #ifdef posix
-FILE *diskfile;		// used for fileopen/close etc
+int pforcores = 0;		// PFOR worker threads, looked up on first use
 #endif
 
+#ifndef library
+struct job jobs[MAXJOBS];	// run & from the prompt
+#ifdef posix
+struct metricserver metrics = {.fd = -1};		// metrics socket, fd -1 = off
+pthread_mutex_t jobslock = PTHREAD_MUTEX_INITIALIZER;	// jobs[].ctx while metrics reads it
+#endif
+#endif
+#ifdef library
+int chanshared = 1;		// host threads may share channels: mpmc
+#else
+int chanshared = 0;		// set by batch when programs run on several threads
+#endif
+#ifdef posix
+int chanrunning = 0;		// shared channels: programs in execute()
+int chanstuck = 0;			// and how many of them have every task waiting
+unsigned int chanmoves = 0;	// SEND/RECVs that went through (deadlock: none since)
+#endif
 
 #ifdef arduino
 File root;          // used in dir
-File sdFile;        // used in save, load
+File sdFile;        // used in save, load and fileopen (one SD card, one program)
 
 
 // used in showmem()
@@ -495,32 +1150,6 @@ SdFat sd;
 */
 #endif
 
-unsigned char *buffer;
-unsigned int position;
-unsigned int maxline;
-int error=0;		// when a routine fails, error gets set
-int DEBUG = 0;		// enables trace in parse()
-char printmessage[MAXLINE+(MAXLINE/2)];		// universal print routine
-int arraymax = 0;	// max size of array, assigned in DIM
-
-unsigned int foraddr=0;		// loop address for/next 
-unsigned char forvar;		// hold var name for/next
-int tovar=0;		// final number for/next
-int forstep=0;		// hold step size
-
-/* define storage for return stack for gosubs */
-int return_stack[MAXRETURNSTACKPOS]={-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};  // 10 deep
-int return_stack_position = 0;
-
-/* define storage for integer variables a-z */
-int intvar[26]={0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-
-/* define array for DIM and @(n) */
-int* intarray = (int*)NULL;
-
-/* define text variables (this uses 2K ram - could be done better) */
-char textvar[26][80] = {};
-
 
 
 
@@ -581,6 +1210,7 @@ void sgets(char *line) {
                 return;
             }
         }
+        else jobstep();     // nothing typed: give run & jobs a turn
     }
 }
 #endif
@@ -628,13 +1258,155 @@ void setup() {
 
 
 
+/* ************************************************* */
+/* ctxnew - a fresh interpreter: empty program, vars */
+/* cleared. Returns NULL if there is no memory.       */
+/* ************************************************* */
+struct context *ctxnew(void) {
+	struct context *ctx;
+
+	ctx = (struct context *)calloc(1,sizeof(struct context));
+	if (ctx == NULL) return NULL;
+
+	/* basic program is stored in ram */
+	ctx->prog = prognew();
+	if (ctx->prog == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->buffer = ctx->prog->text;
+	for (int n=0; n<MAXRETURNSTACKPOS; n++)
+		ctx->return_stack[n] = -1;
+	ctx->sparse.max = SPARSEMAX;
+	ctx->hashmap.max = MAPMAX;
+	ctx->maps = ctx;
+	taskclear(ctx);
+	return ctx;
+}
+
+/* ctxshare - a fresh interpreter running the same program as from. */
+/* No copy is made: both use one image until either edits it.       */
+/* from must not be running while this is done.                     */
+struct context *ctxshare(struct context *from) {
+	struct context *ctx;
+
+	ctx = (struct context *)calloc(1,sizeof(struct context));
+	if (ctx == NULL) return NULL;
+	if (from->prog->index == NULL) progindex(from);	// index it while it is still ours
+	__atomic_add_fetch(&from->prog->refs,1,__ATOMIC_ACQ_REL);
+	ctx->prog = from->prog;
+	ctx->buffer = from->buffer;
+	ctx->position = from->position;
+	ctx->maxline = from->maxline;
+	for (int n=0; n<MAXRETURNSTACKPOS; n++)
+		ctx->return_stack[n] = -1;
+	ctx->sparse.max = SPARSEMAX;
+	ctx->hashmap.max = MAPMAX;
+	ctx->maps = ctx;
+	taskclear(ctx);
+	#ifdef posix
+	ctx->hosted = from->hosted;
+	#endif
+	return ctx;
+}
+
+/* ctxfree - release everything ctxnew and the program allocated */
+void ctxfree(struct context *ctx) {
+	if (ctx == NULL) return;
+	arrayfree(ctx);
+	hashfree(&ctx->hashmap);
+	free(ctx->tracebuf);
+	free(ctx->cover);
+	#ifdef posix
+	if (ctx->diskfile) fclose(ctx->diskfile);
+	#endif
+	progfree(ctx->prog);
+	free(ctx);
+}
+
+
+/* ******************************************** */
+/* program images (shared, copy-on-write text) */
+/* ******************************************** */
+struct program *prognew(void) {
+	struct program *prog;
+
+	prog = (struct program *)calloc(1,sizeof(struct program));
+	if (prog == NULL) return NULL;
+	prog->text = (unsigned char *)calloc(BUFSIZE,1);
+	if (prog->text == NULL) {
+		free(prog);
+		return NULL;
+	}
+	prog->refs = 1;
+	return prog;
+}
+
+// drop one reference, free the image with the last one
+void progfree(struct program *prog) {
+	if (prog == NULL) return;
+	if (__atomic_sub_fetch(&prog->refs,1,__ATOMIC_ACQ_REL) > 0) return;
+	free(prog->index);
+	free(prog->text);
+	free(prog);
+}
+
+// call before changing ctx->buffer: copy a shared image, drop the index
+int progwrite(struct context *ctx) {
+	struct program *prog = ctx->prog;
+
+	if (__atomic_load_n(&prog->refs,__ATOMIC_ACQUIRE) > 1) {
+		prog = prognew();
+		if (prog == NULL) {
+			prout(ctx,ERR4);    // out of memory
+			return ERROR_RETURN;
+		}
+		memcpy(prog->text,ctx->prog->text,BUFSIZE);
+		progfree(ctx->prog);
+		ctx->prog = prog;
+		ctx->buffer = prog->text;
+		return NORMAL_RETURN;
+	}
+	free(prog->index);		// the lines are about to move
+	prog->index = NULL;
+	prog->lines = 0;
+	return NORMAL_RETURN;
+}
+
+// build the line number -> address table used by goto, gosub, for etc
+int progindex(struct context *ctx) {
+	struct program *prog = ctx->prog;
+	unsigned int n;
+	int count = 0, start = 0;
+
+	for (n=0; n<ctx->position; n++)
+		if (ctx->buffer[n] == '\n') count++;
+	prog->index = (struct lineindex *)malloc((count+1) * sizeof(struct lineindex));
+	if (prog->index == NULL) return ERROR_RETURN;	// setlinenumber will scan instead
+	prog->lines = 0;
+	prog->sorted = 1;
+	for (n=0; n<ctx->position; n++) {
+		if (ctx->buffer[n] != '\n') continue;
+		prog->index[prog->lines].line = atoi((char *)ctx->buffer+start);
+		prog->index[prog->lines].addr = start;
+		prog->index[prog->lines].next = n+1;
+		if (prog->lines > 0 && prog->index[prog->lines].line <= prog->index[prog->lines-1].line)
+			prog->sorted = 0;
+		prog->lines++;
+		start = n+1;
+	}
+	return NORMAL_RETURN;
+}
+
+
 /* ***** */
 /* PROUT */
 /* ***** */
-/* printout - send string to stdout/serialout */
-void prout(char message[MAXLINE+(MAXLINE/2)]) {
+/* printout - send string to stdout/serialout (or the context's out file) */
+void prout(struct context *ctx, char message[MAXLINE+(MAXLINE/2)]) {
+	if (ctx) ctx->stats.printed += strlen(message);
     #ifdef posix
-	printf("%s",message);
+	fputs(message,(ctx && ctx->out) ? ctx->out : stdout);
     #endif
 
     #ifdef arduino 
@@ -646,2040 +1418,5894 @@ void prout(char message[MAXLINE+(MAXLINE/2)]) {
 
 
 
-/* **************** */
-/*    main/loop     */
-/* **************** */
 #ifdef posix
-int main(int argc, char **argv) {
-#endif
+/* ************************************************************ */
+/* batch runner: basic --batch dir [threads]                     */
+/* Runs every .bas file in dir at once on a pool of threads,     */
+/* each in its own context. PRINT output goes to dir/name.out,   */
+/* INPUT reads dir/name.in if there is one. Prints a summary     */
+/* with each job's status and wall time.                         */
+/* ************************************************************ */
+struct batchjob {
+	char name[256];			// file name in the batch directory
+	int status;				// END_RETURN, STOP_RETURN, NORMAL_RETURN (no end), ERROR_RETURN
+	int thread;				// which thread ran it
+	double msecs;			// wall time
+};
+
+/* each thread owns a deque of job numbers. The owner takes from the
+   back, idle threads steal from the front, so the lock is only
+   contended when somebody runs dry. */
+struct batchqueue {
+	pthread_mutex_t lock;
+	int head, tail;			// jobs head..tail-1 not started yet
+};
+
+struct batchpool {
+	struct batchjob *jobs;
+	struct batchqueue *queue;
+	int threads;
+	char *dir;
+};
+
+struct batcharg {
+	struct batchpool *pool;
+	int self;
+};
+
+double batchclock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
 
-#ifdef arduino
-void loop() {
-#endif
+int batchname(const char *name) {		// *.bas or *.BAS
+	int len = strlen(name);
+	return (len > 4 && strcasecmp(name+len-4,".bas") == 0);
+}
 
-int pos=0;
-int n;
-char line[MAXLINE]={}, linenum[32]={};
-char *p;
+int batchcompare(const void *a, const void *b) {
+	return strcmp(((const struct batchjob *)a)->name,((const struct batchjob *)b)->name);
+}
 
-basicLoop:  // when external programs exit, jump back here to restart things
+/* next job for thread self: its own newest, else the oldest of another's */
+int batchtake(struct batchpool *pool, int self) {
+	struct batchqueue *q;
+	int job = -1;
+
+	for (int n=0; n<pool->threads && job < 0; n++) {
+		q = &pool->queue[(self+n) % pool->threads];
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail)
+			job = (n == 0) ? --q->tail : q->head++;
+		pthread_mutex_unlock(&q->lock);
+	}
+	return job;		// -1: nothing left anywhere
+}
 
-	/* basic program is stored in ram */
-	buffer = (unsigned char *)malloc(BUFSIZE);
-	if (buffer == NULL) {
-		prout("out of memory");
-        #ifdef posix
+void batchrun(struct batchpool *pool, struct batchjob *job) {
+	struct context *ctx;
+	char path[600];
+	int len = strlen(job->name) - 4;	// without .bas
+	double start = batchclock();
+
+	job->status = ERROR_RETURN;
+	ctx = ctxnew();
+	if (ctx == NULL) return;
+	ctx->hosted = 1;
+	sprintf(path,"%s/%.*s.out",pool->dir,len,job->name);
+	ctx->out = fopen(path,"w");
+	sprintf(path,"%s/%.*s.in",pool->dir,len,job->name);
+	ctx->in = fopen(path,"r");
+	if (ctx->in == NULL) ctx->in = fopen("/dev/null","r");	// never the shared stdin
+	sprintf(path,"%s/%s",pool->dir,job->name);
+	if (ctx->out != NULL && ctx->in != NULL && readprogram(ctx,path) == NORMAL_RETURN)
+		job->status = run(ctx,(char *)"run");
+	if (ctx->out) fclose(ctx->out);
+	if (ctx->in) fclose(ctx->in);
+	ctxfree(ctx);
+	job->msecs = batchclock() - start;
+}
+
+void *batchthread(void *arg) {
+	struct batcharg *a = (struct batcharg *)arg;
+	int job;
+
+	while ((job = batchtake(a->pool,a->self)) >= 0) {
+		a->pool->jobs[job].thread = a->self;
+		batchrun(a->pool,&a->pool->jobs[job]);
+	}
+	return NULL;
+}
+
+int batch(char *dir, int threads) {
+	struct batchpool pool;
+	struct batcharg *args;
+	pthread_t *tid;
+	struct dirent *entry;
+	DIR *dp;
+	int njobs = 0, maxjobs = 64, failed = 0, per;
+	double start, busy = 0;
+	const char *status;
+
+	if (threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+	pool.dir = dir;
+	pool.threads = threads;
+	pool.jobs = (struct batchjob *)malloc(maxjobs * sizeof(struct batchjob));
+	dp = opendir(dir);
+	if (dp == NULL || pool.jobs == NULL) {
+		prout(NULL,ERR50);   // directory error
+		prout(NULL,dir);
+		prout(NULL,"\n");
+		if (dp) closedir(dp);
+		free(pool.jobs);
 		return 1;
-        #endif
-        
-        #ifdef arduino
-        while(1);   // wait for reset
-        #endif
+	}
+	while ((entry = readdir(dp)) != NULL) {
+		if (!batchname(entry->d_name)) continue;
+		if (njobs == maxjobs) {
+			struct batchjob *more = (struct batchjob *)realloc(pool.jobs,2 * maxjobs * sizeof(struct batchjob));
+			if (more == NULL) break;
+			pool.jobs = more;
+			maxjobs *= 2;
+		}
+		memset(&pool.jobs[njobs],0,sizeof(struct batchjob));
+		snprintf(pool.jobs[njobs].name,sizeof(pool.jobs[njobs].name),"%s",entry->d_name);
+		njobs++;
+	}
+	closedir(dp);
+	qsort(pool.jobs,njobs,sizeof(struct batchjob),batchcompare);
+	if (threads > njobs && njobs > 0) threads = pool.threads = njobs;
+
+	/* deal the jobs out in even runs, stealing evens out the rest */
+	pool.queue = (struct batchqueue *)malloc(threads * sizeof(struct batchqueue));
+	args = (struct batcharg *)malloc(threads * sizeof(struct batcharg));
+	tid = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	if (pool.queue == NULL || args == NULL || tid == NULL) {
+		prout(NULL,ERR4);   // out of memory
+		prout(NULL,"\n");
+		free(pool.queue); free(args); free(tid); free(pool.jobs);
+		return 1;
+	}
+	per = njobs / threads;
+	for (int n=0; n<threads; n++) {
+		pthread_mutex_init(&pool.queue[n].lock,NULL);
+		pool.queue[n].head = n * per;
+		pool.queue[n].tail = (n == threads-1) ? njobs : (n+1) * per;
 	}
 
-    // clear the buffer before start
-    memset(buffer,0,BUFSIZE);
-	position = 0;   // set start position
-	maxline = 0;    // highest line number
+	chanshared = (threads > 1);		// programs may SEND/RECV across threads
+	start = batchclock();
+	for (int n=0; n<threads; n++) {
+		args[n].pool = &pool;
+		args[n].self = n;
+		if (pthread_create(&tid[n],NULL,batchthread,&args[n]) != 0)
+			batchthread(&args[n]);		// no thread: do it ourselves
+		else continue;
+		tid[n] = 0;
+	}
+	for (int n=0; n<threads; n++)
+		if (tid[n]) pthread_join(tid[n],NULL);
+
+	/* summary */
+	for (int n=0; n<njobs; n++) {
+		struct batchjob *j = &pool.jobs[n];
+		switch (j->status) {
+			case END_RETURN: status = "end"; break;
+			case STOP_RETURN: status = "stop"; break;
+			case NORMAL_RETURN: status = "ok"; break;
+			default: status = "error"; failed++; break;
+		}
+		printf("%-24s %-6s %10.3f ms  thread %d\n",j->name,status,j->msecs,j->thread);
+		busy += j->msecs;
+	}
+	printf("%d jobs, %d failed, %d threads, %.3f ms wall, %.3f ms busy\n",
+		njobs,failed,threads,batchclock()-start,busy);
 
-	
-	sprintf(printmessage,"%s\r\n",HEADER);
-	prout(printmessage);
-	sprintf(printmessage,"%d Bytes Free\r\n",BUFSIZE-position);
-	prout(printmessage);
+	for (int n=0; n<threads; n++)
+		pthread_mutex_destroy(&pool.queue[n].lock);
+	free(pool.queue); free(args); free(tid); free(pool.jobs);
+	return failed ? 1 : 0;
+}
 
-    #ifdef posix
-	/* test command line: if argv[1] = program name, load & run it */
-	if (argc == 2) {
-		char temp[strlen(argv[1])+5];
-		strcpy(temp,"load ");
-		strcat(temp,argv[1]);
-		fileload(temp);		// format of the load command requires 'load' before filename
-		/* run it */
-		run("x");			// x is dummy, not used
-	}   // at end jump to editor
-    #endif
 
+/* ************************************************************ */
+/* server: basic --serve socket program [workers]                */
+/* Loads the program once, then forks workers that each hold a   */
+/* ready context and take jobs from a unix socket, so a caller   */
+/* never waits for startup. A job is one connection: the client  */
+/* sends a line of variable settings (a=1 b=-2, can be empty)    */
+/* and then any lines for INPUT. The program runs with those     */
+/* variables and its PRINT output is sent back, then the worker  */
+/* closes the connection and waits for the next one.             */
+/* ************************************************************ */
+void servestopper(int sig) {
+	(void)sig;
+	servestop = 1;
+}
 
-/***********************************/
-/*       Main Command Loop         */
-/***********************************/
-	while (1) {
+// set a-z from "a=1 b=-2 ..."
+void servevars(struct context *ctx, char *line) {
+	char *p = line;
 
-		/* show prompt, get a line or command */
-		memset(line,0,MAXLINE);
-		maxline = getmaxlinenum();
-        prout(PROMPT);
-        
-        #ifdef posix
-		fgets(line,MAXLINE,stdin);
-        #endif
+	while (*p != '\0' && *p != '\n') {
+		while (*p == ' ' || *p == ',') p++;
+		if (*p >= 'a' && *p <= 'z' && *(p+1) == '=')
+			ctx->intvar[*p-'a'] = atoi(p+2);
+		while (*p != '\0' && *p != '\n' && *p != ' ' && *p != ',') p++;
+	}
+}
 
-        #ifdef arduino
-		sgets(line);
-        #endif
+void serveworker(struct context *ctx, int listenfd) {
+	char line[MAXLINE];
+	int conn, outfd;
 
-		if (line[0] == '\n') continue;
-		line[strlen(line)] = '\0';
+	while (1) {
+		conn = accept(listenfd,NULL,NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			_exit(1);
+		}
+		ctx->in = fdopen(conn,"r");
+		outfd = dup(conn);
+		ctx->out = (outfd >= 0) ? fdopen(outfd,"w") : NULL;
+		if (ctx->in != NULL && ctx->out != NULL) {
+			runclear(ctx);
+			if (fgets(line,MAXLINE,ctx->in) != NULL)
+				servevars(ctx,line);
+			execute(ctx,0);
+		}
+		if (ctx->out == NULL && outfd >= 0) close(outfd);	// fdopen failed: the dup is still ours
+		if (ctx->in == NULL) close(conn);
+		if (ctx->in) fclose(ctx->in);
+		if (ctx->out) fclose(ctx->out);		// sends the output
+		ctx->in = ctx->out = NULL;
+	}
+}
 
+pid_t servefork(struct context *ctx, int listenfd) {
+	pid_t pid = fork();
 
+	if (pid == 0) {
+		signal(SIGINT,SIG_DFL);
+		signal(SIGTERM,SIG_DFL);
+		signal(SIGPIPE,SIG_IGN);	// a client that hangs up early is not fatal
+		serveworker(ctx,listenfd);
+	}
+	return pid;
+}
 
-        #ifdef posix
-		/* exit - exit out of this program */
-		if (strncmp(line,"exit",4)==0) {
-			if (intarray != NULL)
-				free(intarray);		// free up the array ram
-			free(buffer);			// and program memory
-			return 0;
-		}
-        #endif
+int serve(char *sockpath, char *program, int workers) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct context *ctx;
+	pid_t *pid, dead;
+	int fd, n, status;
+
+	if (workers < 1) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) workers = 1;
+
+	/* load and check the program once; every worker inherits it */
+	ctx = ctxnew();
+	pid = (pid_t *)calloc(workers,sizeof(pid_t));
+	if (ctx == NULL || pid == NULL) {
+		prout(NULL,ERR4);   // out of memory
+		prout(NULL,"\n");
+		return 1;
+	}
+	ctx->hosted = 1;
+	if (readprogram(ctx,program) != NORMAL_RETURN) return 1;
+	ctx->maxline = getmaxlinenum(ctx);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		prout(ctx,"socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path,sockpath);
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	unlink(sockpath);
+	if (fd < 0 || bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0 || listen(fd,SOMAXCONN) < 0) {
+		perror(sockpath);
+		return 1;
+	}
 
-		/* trace - trace program flow */
-		if (strncmp(line,"trace",4)==0) {
-			DEBUG = abs(DEBUG-1);
-			if (DEBUG) {
-				sprintf(printmessage,"Trace ON\r\n");
-				prout(printmessage);
-			}
-			else {
-				sprintf(printmessage,"Trace OFF\r\n");
-				prout(printmessage);
-			}
-			continue;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = servestopper;		// no SA_RESTART: wait() must return
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+
+	for (n=0; n<workers; n++)
+		pid[n] = servefork(ctx,fd);
+	printf("serving %s on %s, %d workers\n",program,sockpath,workers);
+	fflush(stdout);
+
+	/* replace any worker that dies until told to stop */
+	while (!servestop) {
+		dead = wait(&status);
+		if (dead < 0) {
+			if (errno == EINTR) continue;
+			break;
 		}
+		for (n=0; n<workers; n++)
+			if (pid[n] == dead && !servestop) pid[n] = servefork(ctx,fd);
+	}
 
-        /* clear the display */
-        if (strncmp(line,"cls",3)==0) {
-            #ifdef arduino
-            Serial.println(F("\e[H\e[J"));
-            #endif
-            continue;
-        }
+	for (n=0; n<workers; n++)
+		if (pid[n] > 0) kill(pid[n],SIGTERM);
+	while (wait(&status) > 0);
+	close(fd);
+	unlink(sockpath);
+	free(pid);
+	ctxfree(ctx);
+	return 0;
+}
+#endif
 
-        #ifdef arduino
-        /* jump to line editor */
-        if (strncmp(line,"edit",4)==0) {
-            ledit();
-            continue;
-        }
-        #endif
-        
-		/* list - display basic listing in buffer */
-		if (strncmp(line,"list",4)==0) {
-			list(line);
-			continue;
-		}
 
 
-        /* slist - send listing to serial 1 (if arduino) */
-        #ifdef arduino
-        if (strncmp(line,"slist",5)==0) {
-            list(line);
-            continue;
-        }
-        #endif
-        
-		/* new - clear the buffers, reset pointers */
-		if (strncmp(line,"new",3)==0) {
-			position=0;
-			memset(buffer,0,BUFSIZE);
-            if (intarray != NULL)
-                free(intarray);     // clear DIM memory
-            for (int i=0; i<26; i++)
-                intvar[i]=0;      // clear vars a-z
-            intarray=(int*)NULL;
-            arraymax=0;
-			maxline=0;
-			continue;
-		}
+#ifndef library
+/* ************************************************************ */
+/* run & jobs: the program runs in the background as a context  */
+/* of its own (sharing the program text, so editing at the      */
+/* prompt doesn't disturb it) while the prompt stays usable.    */
+/* jobs lists them, kill n stops one, peek n var looks inside.  */
+/* ************************************************************ */
+#ifdef posix
+void *jobthread(void *arg) {
+	struct job *job = (struct job *)arg;
+	int res = run(job->ctx,job->cmd);
+	job->res = res;
+	__atomic_store_n(&job->done,1,__ATOMIC_RELEASE);
+	return NULL;
+}
+#endif
 
-		/* dump - hex dump of program listing (used in debugging the editor) */
-		if (strncmp(line,"dump",4)==0) {
-			int addr = 0;
-			while (addr < position) {
-				sprintf(printmessage,"%04X  ",addr);
-				prout(printmessage);
-				for (n=0; n<16; n++) {
-					sprintf(printmessage,"%02X ",buffer[addr+n]);
-					prout(printmessage);
-				}
-				prout("  ");
-				for (n=0; n<16; n++) {
-					sprintf(printmessage,"%c",isprint(buffer[addr+n])?buffer[addr+n]:'.');
-					prout(printmessage);
-				}
-				prout("\r\n");
-				addr += 16;
-			}
-			prout("\r\n");
-			continue;
-		}
+void jobstart(struct context *ctx, char *line) {
+	struct job *job = NULL;
+	int n;
 
-		/* mem/size - show free memory */
-		if ((strncmp(line,"mem",3)==0) || (strncmp(line,"size",4)==0)) {
-			sprintf(printmessage,"Basic Program Storage: %d bytes free\r\n",BUFSIZE-position);
-			prout(printmessage);
-            showmem();
-			continue;
-		}
+	for (n=0; n<MAXJOBS && job == NULL; n++)	// a free slot, or a finished job already reported
+		if (jobs[n].ctx == NULL || (jobs[n].reported && jobs[n].done)) job = &jobs[n];
+	if (job == NULL) {
+		prout(ctx,ERR56);   // too many jobs
+		return;
+	}
+	jobfree(job);
+	#ifdef posix
+	pthread_mutex_lock(&jobslock);
+	#endif
+	job->ctx = ctxshare(ctx);
+	#ifdef posix
+	pthread_mutex_unlock(&jobslock);
+	#endif
+	if (job->ctx == NULL) {
+		prout(ctx,ERR4);    // out of memory
+		prout(ctx,"\r\n");
+		return;
+	}
+	job->ctx->background = 1;
+	strncpy(job->cmd,line,MAXLINE-1);
+	*strchr(job->cmd,'&') = '\0';		// run() reads a line number, not the &
+	job->done = job->reported = 0;
+	sprintf(ctx->printmessage,"[%d] started\r\n",(int)(job-jobs)+1);
+	prout(ctx,ctx->printmessage);
+
+	#ifdef posix
+	job->ctx->hosted = 1;		// EXIT ends the job, not basic
+	if (!chanshared) {			// channels are now used from two threads
+		memset(channels,0,sizeof(channels));
+		chanshared = 1;
+	}
+	if (pthread_create(&job->tid,NULL,jobthread,job) != 0) {
+		prout(ctx,ERR4);    // out of memory
+		prout(ctx,"\r\n");
+		pthread_mutex_lock(&jobslock);
+		ctxfree(job->ctx);
+		job->ctx = NULL;
+		pthread_mutex_unlock(&jobslock);
+	}
+	#endif
 
+	#ifdef arduino
+	job->ctx->slice = JOBSLICE;
+	job->res = run(job->ctx,job->cmd);		// first turn
+	if (job->res != SLICE_RETURN) job->done = 1;
+	#endif
+}
 
-		/* load - load file to buffer */
-		if (strncmp(line,"load",4)==0) {
-			fileload(line);
-			continue;
-		}
+// how a job ended, for jobs and the finished message
+const char *jobstatus(struct job *job) {
+	#ifdef posix
+	if (!__atomic_load_n(&job->done,__ATOMIC_ACQUIRE)) return "running";
+	if (job->ctx->killed) return "killed";
+	#else
+	if (!job->done) return "running";
+	#endif
+	if (job->res == END_RETURN) return "end";
+	if (job->res == STOP_RETURN) return "stop";
+	if (job->res == ERROR_RETURN) return "error";
+	return "done";		// ran off the last line
+}
 
-		/* save - save buffer to file */
-		if (strncmp(line,"save",4)==0) {
-			filesave(line);
+// at the prompt: say once which jobs have finished since last time
+void jobcheck(struct context *ctx) {
+	int running = 0;
+
+	for (int n=0; n<MAXJOBS; n++) {
+		if (jobs[n].ctx == NULL) continue;
+		if (strcmp(jobstatus(&jobs[n]),"running")==0) {
+			running = 1;
 			continue;
 		}
+		if (jobs[n].reported) continue;
+		jobs[n].reported = 1;
+		sprintf(ctx->printmessage,"[%d] %s\r\n",n+1,jobstatus(&jobs[n]));
+		prout(ctx,ctx->printmessage);
+	}
+	if (!running) chanshared = 0;	// last job is over: channels are the prompt's alone again
+}
 
-		/* flist - display file contents */
-		if (strncmp(line,"flist",5)==0) {
-			flist(line);
-			continue;
-		}
-
-		/* dir - show directory */
-		if (strncmp(line,"dir",3)==0) {
-            prout("\r\n");
-			dir(line);
-			continue;
-		}
-
-        /* delete - delete a file from the file system */
-        if (strncmp(line,"delete",6)==0) {
-            filedelete(line);
-            continue;
-        }
-
-		/* run - run the basic program */
-		if (strncmp(line,"run",3)==0) {
-			if (position==0) {
-				prout(ERR5);    // empty buffer
-				continue;
-			}
-			run(line);
-            memset(line,0,MAXLINE);
-            #ifdef arduino
-            /* clear any chars in buffer caused by ctrl-c */
-            if (Serial.available())
-                while(Serial.available());
-            #endif
-			prout("\r\n");	// in case print terminated with ;
-			continue;
-		}
-
-        #ifdef dueMini
-        if (strncmp(line,"i80",3)==0) { // 8080 emulator
-            // free up used memory
-            free(buffer);
-            position = 0;
-            i80();      // jump to 8080 emulator
-            // restore memory, reset pointers
-            goto basicLoop;
-        }
-        #endif
-
+void jobslist(struct context *ctx) {
+	for (int n=0; n<MAXJOBS; n++) {
+		if (jobs[n].ctx == NULL) continue;
+		if (strcmp(jobstatus(&jobs[n]),"running")!=0) jobs[n].reported = 1;	// seen it here
+		sprintf(ctx->printmessage,"[%d] %-8s %s\r\n",n+1,jobstatus(&jobs[n]),jobs[n].cmd);
+		prout(ctx,ctx->printmessage);
+	}
+}
 
-		/* if the 1st character of a line isn't a number, show an error */
-		if (!(isdigit(line[0]))) {
-			prout(ERR1);    // syntax
-			continue;
-		}
+// kill n: stop job n if it is running, then free it
+void jobkill(struct context *ctx, char *line) {
+	char cmd[8]={}, num[12]={};
+	int n;
 
-		/* ********************** */
-		/* end of command testing */
-		/* ********************** */
-		
-		/* first char IS a line number - save in memory */
+	sscanf(line,"%7s %11s",cmd,num);
+	n = atoi(num) - 1;
+	if (n < 0 || n >= MAXJOBS || jobs[n].ctx == NULL) {
+		prout(ctx,ERR57);   // no such job
+		return;
+	}
+	jobfree(&jobs[n]);
+	sprintf(ctx->printmessage,"[%d] killed\r\n",n+1);
+	prout(ctx,ctx->printmessage);
+}
 
-		/* test line number count */
-		sscanf(line,"%s ",linenum);
-		if (atoi(linenum) < 1 || atoi(linenum) > MAXLINENUMBER) {
-			prout(ERR6);    // line # out of range
-			continue;
-		}
-        /* look for bad trailing chars in line number */
-        if (!(isdigit(linenum[strlen(linenum)-1]))) {
-                prout(ERR3);    // bad char in line #
-                continue;
-        }
+// stop the job if it is still going and give back its memory
+void jobfree(struct job *job) {
+	if (job->ctx == NULL) return;
+	#ifdef posix
+	__atomic_store_n(&job->ctx->killed,1,__ATOMIC_RELAXED);	// execute() stops at its next line
+	pthread_join(job->tid,NULL);
+	pthread_mutex_lock(&jobslock);
+	#endif
+	ctxfree(job->ctx);
+	job->ctx = NULL;
+	#ifdef posix
+	pthread_mutex_unlock(&jobslock);
+	#endif
+}
 
-		/* 
-		 * Memory savings when converting to tokens is only 18%, 
-		 * hardly worth the added code. With 16K ram you get about
-		 * 744 lines of basic code. Quite a lot for a controller.
-		 */
-		//tokenize(line);
-       
-		linetolower(line);  // all but quoted and inside () lower case
+// peek [n] [var]: a-z or a$-z$ of job n (the first job if no n),
+// every variable that isn't 0 if no var. Values are read while the
+// job runs, so they are whatever it had a moment ago.
+void jobpeek(struct context *ctx, char *line) {
+	char cmd[8]={}, a[12]={}, b[12]={};
+	char *var = a;
+	struct context *job;
+	int n = -1, shown = 0;
+
+	sscanf(line,"%7s %11s %11s",cmd,a,b);
+	if (isdigit(a[0])) {	// a job number
+		n = atoi(a) - 1;
+		var = b;
+	}
+	else
+		for (int i=0; i<MAXJOBS && n < 0; i++)
+			if (jobs[i].ctx != NULL) n = i;
+	if (n < 0 || n >= MAXJOBS || jobs[n].ctx == NULL) {
+		prout(ctx,ERR57);   // no such job
+		return;
+	}
+	job = jobs[n].ctx;
+	if (var[0] >= 'a' && var[0] <= 'z' && var[1] == '$') {
+		sprintf(ctx->printmessage,"%c$ = \"%.*s\"\r\n",var[0],MAXLINE-1,job->textvar[var[0]-'a']);
+		prout(ctx,ctx->printmessage);
+		return;
+	}
+	if (var[0] >= 'a' && var[0] <= 'z') {
+		sprintf(ctx->printmessage,"%c = %d\r\n",var[0],__atomic_load_n(&job->intvar[var[0]-'a'],__ATOMIC_RELAXED));
+		prout(ctx,ctx->printmessage);
+		return;
+	}
+	for (int i=0; i<26; i++) {
+		int v = __atomic_load_n(&job->intvar[i],__ATOMIC_RELAXED);
+		if (v == 0) continue;
+		sprintf(ctx->printmessage,"%c = %d\r\n",'a'+i,v);
+		prout(ctx,ctx->printmessage);
+		shown++;
+	}
+	if (!shown) prout(ctx,"all 0\r\n");
+}
 
-		/* room to add the line? */
-		if (strlen(line) + position > BUFSIZE-1) {
-			prout(ERR4);    // out of memory
-            continue;
-        }
+#ifdef arduino
+// called while the prompt waits for a key: a turn for each job
+void jobstep(void) {
+	for (int n=0; n<MAXJOBS; n++) {
+		struct job *job = &jobs[n];
+		if (job->ctx == NULL || job->done) continue;
+		job->ctx->slice = JOBSLICE;
+		job->res = execute(job->ctx,job->ctx->resume);
+		if (job->res != SLICE_RETURN) job->done = 1;
+	}
+}
+#endif
 
+#ifdef posix
+/* ************************************************************ */
+/* metrics [socket/off]: serve the counters of the prompt's     */
+/* program and the run & jobs in Prometheus text format on a    */
+/* unix socket. A thread of its own looks at them once a second */
+/* (for the per second rates) and answers, so a running program */
+/* never waits on it. Like peek the numbers are read while the  */
+/* programs run. A request that starts with GET gets an HTTP    */
+/* reply (curl --unix-socket), anything else (nc -U) the text.  */
+/* ************************************************************ */
+/* ctxmemory - bytes a program has: text, @(), named arrays, maps. */
+/* It is running: read each field once, like jobpeek does.         */
+long long ctxmemory(struct context *c) {
+	long long bytes = sizeof(struct context) + __atomic_load_n(&c->position,__ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&c->intarray,__ATOMIC_RELAXED) && !__atomic_load_n(&c->sparsemode,__ATOMIC_RELAXED))
+		bytes += (long long)__atomic_load_n(&c->arraymax,__ATOMIC_RELAXED) * sizeof(int);
+	bytes += ((long long)__atomic_load_n(&c->sparse.size,__ATOMIC_RELAXED)
+		+ __atomic_load_n(&c->hashmap.size,__ATOMIC_RELAXED)) * sizeof(struct hashslot);
+	for (int n=0; n<26; n++)
+		bytes += (long long)__atomic_load_n(&c->arrays[n].total,__ATOMIC_RELAXED) * sizeof(int);
+	return bytes;
+}
 
+/* metricstake - look at every program, work out the rates since last time */
+void metricstake(void) {
+	struct metricsample now[MAXJOBS+1], *m;
+	struct context *c;
+	double t = batchclock(), dt = (t - metrics.lasttime) / 1000.0;
+	long long *v, *was;
+	int n, i;
+
+	memset(now,0,sizeof(now));
+	pthread_mutex_lock(&jobslock);
+	for (n=0; n<=MAXJOBS; n++) {
+		c = (n == 0) ? metrics.ctx : jobs[n-1].ctx;
+		if (c == NULL) continue;
+		m = &now[n];
+		m->live = 1;
+		m->running = (n == 0) ? 0 : !__atomic_load_n(&jobs[n-1].done,__ATOMIC_ACQUIRE);
+		m->line = __atomic_load_n(&c->stats.line,__ATOMIC_RELAXED);
+		for (i=0; i<NKEYWORDS; i++) m->statements += __atomic_load_n(&c->stats.statements[i],__ATOMIC_RELAXED);
+		m->fileread = __atomic_load_n(&c->stats.fileread,__ATOMIC_RELAXED);
+		m->filewritten = __atomic_load_n(&c->stats.filewritten,__ATOMIC_RELAXED);
+		m->memory = ctxmemory(c);
+	}
+	pthread_mutex_unlock(&jobslock);
 
-		/* *********************************************** */
-		/* if line number > maxline, append line to buffer */
-		/* *********************************************** */
-		if (atoi(linenum) > maxline) {
-						
-			/* test if line is blank (don't insert blank lines) */
-            int FLAG=0;
-			for (int n=strlen(linenum); n<strlen(line); n++) 
-                if (!(isspace(line[n]))) FLAG=1;
-            if (!FLAG) continue;
+	for (n=0; n<=MAXJOBS; n++) {
+		v = &now[n].statements;
+		was = &metrics.last[n].statements;
+		for (i=0; i<3; i++)		// a counter that went back is a new run
+			now[n].rate[i] = (dt > 0 && v[i] >= was[i]) ? (v[i] - was[i]) / dt : 0;
+	}
+	memcpy(metrics.last,now,sizeof(now));
+	metrics.lasttime = t;
+}
 
-			p=line;
-			while (*p != '\0') {
-				buffer[position++] = *p++;
+/* metricstext - the last look in Prometheus text format, into buf. */
+/* If buf fills up it stops, and ends at the last whole line.       */
+int metricstext(char *buf, int size) {
+	static const char *family[][3] = {
+		{"tinybasic_statements_total","counter","Lines run since the program was started."},
+		{"tinybasic_statements_per_second","gauge","Lines run a second, over the last second."},
+		{"tinybasic_line","gauge","Line the program was running."},
+		{"tinybasic_running","gauge","1 while a run & job is still going."},
+		{"tinybasic_file_read_bytes_total","counter","FILEREAD bytes."},
+		{"tinybasic_file_read_bytes_per_second","gauge","FILEREAD bytes a second."},
+		{"tinybasic_file_written_bytes_total","counter","FILEWRITE bytes."},
+		{"tinybasic_file_written_bytes_per_second","gauge","FILEWRITE bytes a second."},
+		{"tinybasic_memory_bytes","gauge","Program text, arrays and maps in memory."}};
+	struct metricsample *m;
+	char job[8];
+	double v = 0;
+	long pages = 0, rss = 0;
+	int len = 0, f, n;
+	FILE *fp;
+
+	for (f=0; f<9 && len < size; f++) {
+		len += snprintf(buf+len,size-len,"# HELP %s %s\n# TYPE %s %s\n",
+			family[f][0],family[f][2],family[f][0],family[f][1]);
+		for (n=0; n<=MAXJOBS && len < size; n++) {
+			m = &metrics.last[n];
+			if (!m->live || (f == 3 && n == 0)) continue;
+			switch (f) {
+				case 0: v = m->statements; break;
+				case 1: v = m->rate[0]; break;
+				case 2: v = m->line; break;
+				case 3: v = m->running; break;
+				case 4: v = m->fileread; break;
+				case 5: v = m->rate[1]; break;
+				case 6: v = m->filewritten; break;
+				case 7: v = m->rate[2]; break;
+				case 8: v = m->memory; break;
 			}
-			if (position >= BUFSIZE-1) {
-				prout(ERR4);    // out of memory
-			}
-			maxline = getmaxlinenum();
-			continue;
+			if (n == 0) strcpy(job,"prompt");
+			else sprintf(job,"%d",n);
+			len += snprintf(buf+len,size-len,"%s{job=\"%s\"} %.17g\n",family[f][0],job,v);
 		}
-	
-
-
-		/* ********************************************************* */
-		/* if line number == existing line number, delete or replace */
-		/* ********************************************************* */
-		if ((pos = isline(atoi(linenum))) != -1) {
-			int FLAG=0;
-			/* pos points to start of line to replace */
-			unsigned char *start, *end;
-			end = start = buffer+pos;	// start of line
-			while (*end++ != '\n'); 	// look for \n - end = end of line 
-			
-			/* delete line */
-			while (end-buffer <= position) 
-				*start++ = *end++;
-			position -= (end-start); // line is deleted
-			
-			/* clear the old code above old position */
-			for (n=position+1; n<BUFSIZE; n++) buffer[n]='\0';
-			
-			/* test if entered line is empty (delete) */
-			if (strlen(line)-strlen(linenum) == 1) {
-				maxline = getmaxlinenum();
-				continue;		// line was empty - we're done
-			}
-
-			/* test if line is blank (don't insert blank lines) */
-			for (n=strlen(linenum); n<strlen(line); n++) 
-				if (!(isspace(line[n]))) FLAG=1;
-			if (!FLAG) continue;
+	}
+	fp = fopen("/proc/self/statm","r");		// the whole process (linux)
+	if (fp != NULL) {
+		if (fscanf(fp,"%ld %ld",&pages,&rss) == 2 && len < size)
+			len += snprintf(buf+len,size-len,"# HELP tinybasic_resident_bytes Memory basic has in RAM.\n"
+				"# TYPE tinybasic_resident_bytes gauge\ntinybasic_resident_bytes %ld\n",
+				rss * sysconf(_SC_PAGESIZE));
+		fclose(fp);
+	}
+	if (len >= size) {		// full: snprintf cut the last one short
+		len = size-1;
+		while (len > 0 && buf[len-1] != '\n') len--;
+	}
+	return len;
+}
 
-			/* else shift buffer up by strlen(line) */
-			memmove(&buffer[pos+strlen(line)],&buffer[pos],position-pos);
-			position += strlen(line);
-			
-			/* insert line at pos */
-			for (int i=pos, n=0; i<=pos+(strlen(line)-1); i++)
-				buffer[i] = line[n++];
-			maxline = getmaxlinenum();
-			continue;
+/* metricsthread - answer each connection with the last look, take a new one every second */
+void *metricsthread(void *arg) {
+	char buf[8192], req[256];
+	struct pollfd pfd;
+	const char *head = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+	int fd, len, got;
+
+	(void)arg;
+	metricstake();
+	while (!__atomic_load_n(&metrics.stop,__ATOMIC_ACQUIRE)) {
+		pfd.fd = metrics.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd,1,1000) > 0 && (fd = accept(metrics.fd,NULL,NULL)) >= 0) {
+			pfd.fd = fd;		// give the client a moment to say GET
+			got = (poll(&pfd,1,100) > 0) ? recv(fd,req,sizeof(req)-1,MSG_DONTWAIT) : 0;
+			if (got >= 3 && strncmp(req,"GET",3)==0)
+				send(fd,head,strlen(head),MSG_NOSIGNAL);
+			len = metricstext(buf,sizeof(buf));
+			send(fd,buf,len,MSG_NOSIGNAL);
+			close(fd);
 		}
+		if (batchclock() - metrics.lasttime >= 1000) metricstake();
+	}
+	return NULL;
+}
 
-		/* ***************************************** */
-        /* line# < maxline - insert line into buffer */
-        /* ***************************************** */
-        if (atoi(linenum) < maxline) {
-            int n, i, start=0, end=1;
-            char temp[MAXLINE]={};
-            char LINEN[6];     // hold line number from temp
+/* metrics socket - start serving, metrics off - stop, metrics - say which */
+void metricscmd(struct context *ctx, char *line) {
+	char cmd[10]={}, path[MAXLINE]={};
+	struct sockaddr_un addr;
 
-			/* test if line is blank (don't insert blank lines) */
-            int FLAG=0;
-            for (int n=strlen(linenum); n<strlen(line); n++)
-                if (!(isspace(line[n]))) FLAG=1;
-            if (!FLAG) continue;
+	sscanf(line,"%9s %s",cmd,path);
+	if (path[0] == '\0') {
+		if (metrics.fd < 0) prout(ctx,"metrics off\r\n");
+		else {
+			sprintf(ctx->printmessage,"metrics on %s\r\n",metrics.path);
+			prout(ctx,ctx->printmessage);
+		}
+		return;
+	}
+	metricsstop();
+	if (strcmp(path,"off")==0) return;
 
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		prout(ctx,"socket path too long\r\n");
+		return;
+	}
+	strcpy(addr.sun_path,path);
+	metrics.fd = socket(AF_UNIX,SOCK_STREAM,0);
+	unlink(path);
+	if (metrics.fd < 0 || bind(metrics.fd,(struct sockaddr *)&addr,sizeof(addr)) < 0 ||
+		listen(metrics.fd,SOMAXCONN) < 0) {
+		perror(path);
+		if (metrics.fd >= 0) close(metrics.fd);
+		metrics.fd = -1;
+		return;
+	}
+	strcpy(metrics.path,path);
+	metrics.ctx = ctx;
+	metrics.stop = 0;
+	memset(metrics.last,0,sizeof(metrics.last));
+	metrics.lasttime = batchclock();
+	if (pthread_create(&metrics.tid,NULL,metricsthread,NULL) != 0) {
+		prout(ctx,ERR4);    // out of memory
+		prout(ctx,"\r\n");
+		close(metrics.fd);
+		unlink(path);
+		metrics.fd = -1;
+	}
+}
 
-            loop:   // find line w/line# higher than new line
+/* metricsstop - stop the thread, take the socket away */
+void metricsstop(void) {
+	if (metrics.fd < 0) return;
+	__atomic_store_n(&metrics.stop,1,__ATOMIC_RELEASE);
+	pthread_join(metrics.tid,NULL);		// within a second
+	close(metrics.fd);
+	unlink(metrics.path);
+	metrics.fd = -1;
+}
+#endif
+#endif	// library
+
+/* ************************************************************ */
+/* trace: with trace on every line run puts an 8 byte record    */
+/* (time, line, statement, task) in a ring of the last          */
+/* TRACESIZE, instead of printing it. tracedump [n] shows the   */
+/* last n; tracedump file writes the ring out for the offline   */
+/* decoder in examples/tracedec.c. The ring stays after the     */
+/* program stops, so a failure can be looked at afterwards.     */
+/* ************************************************************ */
+
+/* statement keywords, numbered for the trace records (0 = none) */
+const char *keywords[NKEYWORDS+1] = {"?","let","print","input","if","goto","gosub","return",
+	"for","next","pfor","rem","end","stop","exit","dim","clear","sleep","delay",
+	"fill","copy","add","sub","mul","mask","put","del","sort","atomic",
+	"spawn","yield","wait","send","recv","on","idle","fileopen","fileclose",
+	"fileread","filewrite","pinset","pinclr","error",NULL};
+
+/* keywordid - the keywords[] number of a statement, 0 if unknown */
+int keywordid(const char *keyword) {
+	for (int n=1; keywords[n] != NULL; n++)
+		if (keywords[n][0] == keyword[0] && strcmp(keyword,keywords[n])==0) return n;
+	return 0;
+}
 
-            i = 0;
-            for (n=start; n<position; n++) {
-                if (n >= position) {
-                    //sprintf(printmessage,"error - line not found\r\n");
-					prout(ERR8);    // line not found
-                    continue;
-                }
-                if (buffer[n] == '\n') break;
-                temp[i++] = buffer[n];      // get line from buffer
-            }
-            end = n+1;
-            sscanf(temp,"%s",LINEN);
-            if (atoi(LINEN) > atoi(linenum)) goto loop2;
-            start = end;
-            goto loop;
+/* traceus - usec clock for the trace records */
+long long traceus(void) {
+	#ifdef posix
+	return clockns() / 1000;
+	#endif
+	#ifdef arduino
+	return micros();
+	#endif
+}
 
-            loop2:  // start points to start position of our new line
+/* traceon - start a new trace, 0 if there's no memory for the ring */
+int traceon(struct context *ctx) {
+	if (ctx->tracebuf == NULL)
+		ctx->tracebuf = (struct tracerec *)malloc(TRACESIZE * sizeof(struct tracerec));
+	if (ctx->tracebuf == NULL) return 0;
+	ctx->tracenext = 0;
+	ctx->tracestart = traceus();
+	return 1;
+}
 
-            /* shift up buffer by strlen(line) */
-            memmove(&buffer[start+strlen(line)],&buffer[start],position-start);
-            position += strlen(line);
+/* tracerecord - add a record, over the oldest once the ring is full */
+void tracerecord(struct context *ctx, int line, int kind) {
+	struct tracerec *r = &ctx->tracebuf[ctx->tracenext++ & (TRACESIZE-1)];
 
-            /* insert line at start */
-            for (i=start, n=0; i<=start+(strlen(line)-1); i++)
-                buffer[i] = line[n++];
-            maxline = getmaxlinenum();
-            continue;
-        }
+	r->us = (unsigned int)(traceus() - ctx->tracestart);
+	r->line = line;
+	r->kind = kind;
+	r->task = ctx->curtask;
+}
 
+/* tracedump [n] - show the last n (20) records   */
+/* tracedump file - write the whole ring to file  */
+void tracedump(struct context *ctx, char *line) {
+	char cmd[12]={}, arg[MAXLINE]={};
+	long long first, n, count, show;
+	unsigned long long us = 0;
+	unsigned int prev = 0;
+	struct tracerec *r;
+
+	if (ctx->tracebuf == NULL) {
+		prout(ctx,"no trace\r\n");
+		return;
+	}
+	sscanf(line,"%11s %s",cmd,arg);
+	count = ctx->tracenext < TRACESIZE ? ctx->tracenext : TRACESIZE;
+	first = ctx->tracenext - count;		// oldest record still in the ring
 
-		/* **************************** */
-		/* error - somehow we fell thru */
-		/* **************************** */
+	#ifdef posix
+	if (arg[0] != '\0' && (arg[0] < '0' || arg[0] > '9')) {
+		FILE *fp = fopen(arg,"wb");
+		unsigned int c = count;
+		if (fp == NULL) {
+			prout(ctx,ERR12);   // error creating file
+			prout(ctx,arg);
+			prout(ctx,"\r\n");
+			return;
+		}
+		fputs("TBTRACE1\n",fp);		// magic, the keyword names, the records
+		for (n=0; keywords[n] != NULL; n++)
+			fprintf(fp,"%s\n",keywords[n]);
+		fputs("\n",fp);
+		fwrite(&c,sizeof(c),1,fp);
+		for (n=first; n<ctx->tracenext; n++)
+			fwrite(&ctx->tracebuf[n & (TRACESIZE-1)],sizeof(struct tracerec),1,fp);
+		fclose(fp);
+		sprintf(ctx->printmessage,"%lld records in %s\r\n",count,arg);
+		prout(ctx,ctx->printmessage);
+		return;
+	}
+	#endif
 
-		prout(ERR9);    // line not recognized
-    	// should never see this
-		continue;
+	show = (atoi(arg) > 0) ? atoi(arg) : 20;
+	if (show > count) show = count;
+	sprintf(ctx->printmessage,"%lld lines traced, the last %lld:\r\n",ctx->tracenext,show);
+	prout(ctx,ctx->printmessage);
+	prout(ctx,"        usec  task   line  statement\r\n");
+	for (n=first; n<ctx->tracenext; n++) {
+		r = &ctx->tracebuf[n & (TRACESIZE-1)];
+		us += r->us - prev;		// 32 bit times wrap: add up the steps
+		prev = r->us;
+		if (n < ctx->tracenext - show) continue;
+		sprintf(ctx->printmessage,"%12llu %5d %6d  %s\r\n",us,r->task,r->line,keywords[r->kind]);
+		prout(ctx,ctx->printmessage);
 	}
 }
 
+/* ************************************************************ */
+/* latency: how long INPUT, FILEREAD, FILEWRITE and DELAY/SLEEP */
+/* took, from parse() calling them to the line going on (a     */
+/* blocked task's turns in between count). Each kind has a      */
+/* log-linear histogram in struct stats, so run clears them and */
+/* PFOR adds them up. latency shows count, mean, p50, p99 and   */
+/* max; latency on shows them every time a run ends too.        */
+/* ************************************************************ */
+
+const char *latencies[NLATENCY] = {"input","fileread","filewrite","delay"};
+
+/* histrecord - count v usec into h */
+void histrecord(struct histogram *h, long long v) {
+	int shift = 0;
+
+	if (v < 0) v = 0;
+	if (v > 0xffffffffLL) v = 0xffffffffLL;
+	while ((v >> shift) >= 2*HISTSUB) shift++;
+	h->bucket[shift*HISTSUB + (v >> shift)]++;
+	h->count++;
+	h->total += v;
+	if (v > h->max) h->max = v;
+}
 
+/* histvalue - usec that permille of the counts are at or under: the */
+/* top of the bucket it is in, but never more than the max seen      */
+long long histvalue(struct histogram *h, int permille) {
+	long long want = (h->count * permille + 999) / 1000, seen = 0, v;
+	int b, shift;
+
+	if (h->count == 0) return 0;
+	if (want < 1) want = 1;
+	for (b=0; b<HISTBUCKETS-1; b++) {
+		seen += h->bucket[b];
+		if (seen >= want) break;
+	}
+	shift = (b < 2*HISTSUB) ? 0 : b/HISTSUB - 1;
+	v = ((long long)(b - shift*HISTSUB + 1) << shift) - 1;
+	return (v < h->max) ? v : h->max;
+}
 
+/* latency - parse() ran statement kind from start and got res. A  */
+/* BLOCK_RETURN will be tried again: the time runs from the first. */
+int latency(struct context *ctx, int kind, long long start, int res) {
+	if (res == BLOCK_RETURN) {
+		if (ctx->since == 0) ctx->since = start;
+		return res;
+	}
+	if (ctx->since) {
+		start = ctx->since;
+		ctx->since = 0;
+	}
+	if (res == NORMAL_RETURN) histrecord(&ctx->stats.latency[kind],traceus() - start);
+	return res;
+}
 
+/* latency [on|off] */
+void latencyshow(struct context *ctx, char *line) {
+	char cmd[10]={}, opt[10]={};
+	struct histogram *h;
+	int n;
 
+	sscanf(line,"%9s %9s",cmd,opt);
+	if (strcmp(opt,"on")==0 || strcmp(opt,"off")==0) {
+		ctx->latencyend = (opt[1] == 'n');
+		return;
+	}
+	prout(ctx,"              count     mean ms      p50 ms      p99 ms      max ms\r\n");
+	for (n=0; n<NLATENCY; n++) {
+		h = &ctx->stats.latency[n];
+		sprintf(ctx->printmessage,"%-10s %9lld %11.3f %11.3f %11.3f %11.3f\r\n",latencies[n],h->count,
+			h->count ? h->total / 1000.0 / h->count : 0.0,histvalue(h,500) / 1000.0,
+			histvalue(h,990) / 1000.0,h->max / 1000.0);
+		prout(ctx,ctx->printmessage);
+	}
+}
 
+/* ************************************************************ */
+/* stats: counters the interpreter keeps all the time (struct   */
+/* stats), to find where a program's time could be going.       */
+/* stats shows them, stats json [file] gives them as JSON, and  */
+/* with BASICSTATS=file set they are written there at exit.     */
+/* ************************************************************ */
+
+/* stats [json [file]] */
+void statsshow(struct context *ctx, char *line) {
+	char cmd[10]={}, json[10]={}, name[MAXLINE]={};
+	struct stats st = ctx->stats;		// showing them counts as printing
+	long long total = 0;
+	int n;
+
+	sscanf(line,"%9s %9s %s",cmd,json,name);
+	#ifdef posix
+	if (strcmp(json,"json")==0) {
+		FILE *fp = name[0] ? fopen(name,"w") : stdout;
+		if (fp == NULL) {
+			prout(ctx,ERR12);   // error creating file
+			prout(ctx,name);
+			prout(ctx,"\r\n");
+			return;
+		}
+		if (fp == stdout && ctx->out) fp = ctx->out;
+		statsjson(ctx,fp);
+		if (name[0]) fclose(fp);
+		return;
+	}
+	#endif
 
-
-
-/* ************************************* */
-/* return highest line # found in buffer */
-/* ************************************* */
-int getmaxlinenum(void) {
-    char temp[MAXLINE]={};  // hold line
-    int n,i, maxline = 0;
-    char linenum[10] = {};
-    int start = 0, end = 1;
-
-loop:
-    i = 0;
-    for (n=start; n<position; n++) {
-        if (buffer[n] == '\n') break;
-        temp[i++] = buffer[n];
-    }
-    if (n >= position) {
-		return maxline;
+	for (n=0; n<NKEYWORDS; n++) total += st.statements[n];
+	sprintf(ctx->printmessage,"statements         %12lld\r\n",total);
+	prout(ctx,ctx->printmessage);
+	for (n=0; n<NKEYWORDS; n++) {
+		if (st.statements[n] == 0) continue;
+		sprintf(ctx->printmessage,"  %-16s %12lld\r\n",keywords[n],st.statements[n]);
+		prout(ctx,ctx->printmessage);
 	}
-    end = n+1;
-    // got a line in temp
-    sscanf(temp,"%s",linenum);
-    if (atoi(linenum) > maxline)
-        maxline = atoi(linenum);
-    start = end;
-    goto loop;
+	sprintf(ctx->printmessage,"eval calls         %12lld\r\n",st.evals);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"line lookups       %12lld  %.1f lines looked at each\r\n",
+		st.lookups,st.lookups ? (double)st.lookupsteps/st.lookups : 0.0);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"gosub depth max    %12d\r\n",st.maxdepth);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"array reads        %12lld\r\narray writes       %12lld\r\n",
+		st.arrayreads,st.arraywrites);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"file bytes read    %12lld\r\nfile bytes written %12lld\r\n",
+		st.fileread,st.filewritten);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"bytes printed      %12lld\r\n",st.printed);
+	prout(ctx,ctx->printmessage);
 }
 
+#ifdef posix
+/* statsjson - the counters as one JSON object */
+void statsjson(struct context *ctx, FILE *fp) {
+	struct stats *st = &ctx->stats;
+	int n, first = 1;
+
+	fprintf(fp,"{\"statements\":{");
+	for (n=0; n<NKEYWORDS; n++) {
+		if (st->statements[n] == 0) continue;
+		fprintf(fp,"%s\"%s\":%lld",first ? "" : ",",keywords[n],st->statements[n]);
+		first = 0;
+	}
+	fprintf(fp,"},\"evals\":%lld,\"lookups\":%lld,\"lookupsteps\":%lld,\"maxdepth\":%d,"
+		"\"arrayreads\":%lld,\"arraywrites\":%lld,\"fileread\":%lld,\"filewritten\":%lld,"
+		"\"printed\":%lld,\"latency\":{",st->evals,st->lookups,st->lookupsteps,st->maxdepth,
+		st->arrayreads,st->arraywrites,st->fileread,st->filewritten,st->printed);
+	for (n=0; n<NLATENCY; n++)		// usec
+		fprintf(fp,"%s\"%s\":{\"count\":%lld,\"total\":%lld,\"p50\":%lld,\"p99\":%lld,\"max\":%lld}",
+			n ? "," : "",latencies[n],st->latency[n].count,st->latency[n].total,
+			histvalue(&st->latency[n],500),histvalue(&st->latency[n],990),st->latency[n].max);
+	fprintf(fp,"}}\n");
+}
+#endif
 
-/* *************************** */
-/* return true if line# exists */
-/* *************************** */
-int isline(int line) {
-	unsigned char *p;
-	char temp[MAXLINE]={}, linenum[32]={};
-	int n=0;
-	p = buffer;
-loop:
-	n=0;
-	while (1) {
-		temp[n++] = *p;
-		if (*p++ == '\n') break;
+/* statsadd - add the counters of a PFOR worker into to */
+void statsadd(struct stats *to, struct stats *from) {
+	for (int n=0; n<NKEYWORDS; n++) to->statements[n] += from->statements[n];
+	for (int n=0; n<NLATENCY; n++) {
+		for (int b=0; b<HISTBUCKETS; b++) to->latency[n].bucket[b] += from->latency[n].bucket[b];
+		to->latency[n].count += from->latency[n].count;
+		to->latency[n].total += from->latency[n].total;
+		if (from->latency[n].max > to->latency[n].max) to->latency[n].max = from->latency[n].max;
 	}
-	sscanf(temp,"%s ",linenum);
-	if (atoi(linenum)==line) return (p-buffer)-n;	// start position
-	if (p-buffer >= position-1) return -1;
-	goto loop;
+	to->evals += from->evals;
+	to->lookups += from->lookups;
+	to->lookupsteps += from->lookupsteps;
+	if (from->maxdepth > to->maxdepth) to->maxdepth = from->maxdepth;
+	to->arrayreads += from->arrayreads;
+	to->arraywrites += from->arraywrites;
+	to->fileread += from->fileread;
+	to->filewritten += from->filewritten;
+	to->printed += from->printed;
 }
 
+/* statsexit - basic is exiting: JSON to $BASICSTATS if it's set */
+void statsexit(struct context *ctx) {
+	#ifdef posix
+	char *name = getenv("BASICSTATS");
+	FILE *fp;
+
+	if (name == NULL || name[0] == '\0') return;
+	fp = fopen(name,"w");
+	if (fp == NULL) return;
+	statsjson(ctx,fp);
+	fclose(fp);
+	#endif
+}
 
-
-/* ****************** */
-/*     list/slist     */
-/* ****************** */
-void list(char line[]) {
-char cmd[20]={};
-	unsigned char *p;
-	p=buffer;
-	int cnt=0;
-    sscanf(line,"%s ",cmd); // see what command we're running
-    if (position <1) return;
-	prout("\n\r");
-	while (cnt++ < position) {
-		// list
-        if (strcmp(cmd,"list")==0) {
-            if (*p == '\n') prout("\r");    // force a cr/lf
-		    sprintf(printmessage,"%c",*p++);
-		    prout(printmessage);
-        }
-        #ifdef arduino
-        if (strcmp(cmd,"slist")==0) {
-            if (*p == '\n') Serial1.print("\r");
-            Serial1.print(*p++);
-        }
-        #endif
+/* ************************************************************ */
+/* cover: which lines have run. While cover is on, parse() sets */
+/* the bit of each line it runs in ctx->cover, one or a line,   */
+/* cheap enough to leave on. Bits pile up over runs until cover */
+/* on or off. cover lcov file (and BASICCOVER=file at exit)     */
+/* merges them into an lcov tracefile for genhtml: DA counts    */
+/* how many of the merged dumps ran the line.                   */
+/* ************************************************************ */
+
+/* coverlines - lines in the program; *run gets how many have run */
+int coverlines(struct context *ctx, int *run) {
+	unsigned int pos = 0;
+	int lines = 0, num;
+
+	*run = 0;
+	while (pos < ctx->position) {
+		num = atoi((char *)&ctx->buffer[pos]);
+		if (num > 0 && num <= MAXLINENUMBER) {
+			lines++;
+			if (ctx->cover[num >> 3] & (1 << (num & 7))) (*run)++;
+		}
+		while (pos < ctx->position && ctx->buffer[pos] != '\n') pos++;
+		pos++;
 	}
-	return;
+	return lines;
 }
 
+/* cover [on|off|lcov file] */
+void covershow(struct context *ctx, char *line) {
+	char cmd[10]={}, opt[10]={}, name[MAXLINE]={};
+	unsigned int pos = 0;
+	int lines, run, num, n = 0;
+
+	sscanf(line,"%9s %9s %s",cmd,opt,name);
+	if (strcmp(opt,"on")==0) {
+		if (ctx->cover == NULL) ctx->cover = (unsigned char *)malloc(COVERBYTES);
+		if (ctx->cover == NULL) {
+			prout(ctx,"out of memory\r\n");
+			return;
+		}
+		memset(ctx->cover,0,COVERBYTES);
+		return;
+	}
+	if (strcmp(opt,"off")==0) {
+		free(ctx->cover);
+		ctx->cover = NULL;
+		return;
+	}
+	if (ctx->cover == NULL) {
+		prout(ctx,"cover off\r\n");
+		return;
+	}
+	#ifdef posix
+	if (strcmp(opt,"lcov")==0) {
+		if (name[0] == '\0') prout(ctx,"usage: cover lcov file\r\n");
+		else if (coverlcov(ctx,name) == ERROR_RETURN) {
+			prout(ctx,ERR12);   // error creating file
+			prout(ctx,name);
+			prout(ctx,"\r\n");
+		}
+		return;
+	}
+	#endif
 
+	lines = coverlines(ctx,&run);
+	sprintf(ctx->printmessage,"%d of %d lines run (%d%%)\r\n",run,lines,lines ? run*100/lines : 0);
+	prout(ctx,ctx->printmessage);
+	if (run == lines) return;
+	prout(ctx,"not run:\r\n");
+	while (pos < ctx->position) {
+		num = atoi((char *)&ctx->buffer[pos]);
+		if (num > 0 && num <= MAXLINENUMBER && !(ctx->cover[num >> 3] & (1 << (num & 7)))) {
+			sprintf(ctx->printmessage,"%6d%s",num,(++n % 10) ? "" : "\r\n");
+			prout(ctx,ctx->printmessage);
+		}
+		while (pos < ctx->position && ctx->buffer[pos] != '\n') pos++;
+		pos++;
+	}
+	if (n % 10) prout(ctx,"\r\n");
+}
 
-/* ******************* */
-/* load file to buffer */
-/* ******************* */
-void fileload(char *line) {
-
-	//FILE *infile;
-	char cmd[10]={}, filename[32]={}, ch;
-    sscanf(line,"%s %s ",cmd,filename);
-    if (strlen(filename)==0) {
-		prout(ERR10);   // usage: load fname
-        return;
-    }
-    #ifdef posix
-    FILE *infile;
-    infile = fopen(filename,"r");
-    if (infile == NULL) {
-		prout(ERR16);   // file not found
-        return;
-    }
-	memset(buffer,0,BUFSIZE);
-	position = 0;
-	while (1) {
-		ch = fgetc(infile);
-		if (feof(infile)) break;
-		if (ch != '\0')
-			buffer[position++] = ch;
+#ifdef posix
+/* coverlcov - merge the bits into lcov tracefile name. DA lines  */
+/* are lines of the program file (as load read it), so genhtml    */
+/* can show it. The record for this program adds to the one from  */
+/* earlier dumps, records of other programs are kept as they are. */
+int coverlcov(struct context *ctx, const char *name) {
+	const char *source = ctx->source[0] ? ctx->source : "basic.bas";	// typed in
+	char *old = NULL, *p, *q, *eol, *rec, *sf = NULL, temp[MAXLINE+8];
+	unsigned int pos;
+	int *hits, fl, nl = 1, num, h, lf = 0, lh = 0;
+	long size;
+	FILE *fp;
+
+	/* hits[file line]: -1 not a basic line, else 0/1 from the bitmap */
+	for (pos=0; pos<ctx->position; pos++)
+		if (ctx->buffer[pos] == '\n') nl++;
+	hits = (int *)malloc((nl+1)*sizeof(int));
+	if (hits == NULL) return ERROR_RETURN;
+	for (pos=0, fl=1; pos<ctx->position; fl++) {
+		num = atoi((char *)&ctx->buffer[pos]);
+		hits[fl] = (num > 0 && num <= MAXLINENUMBER) ? (ctx->cover[num >> 3] >> (num & 7)) & 1 : -1;
+		while (pos < ctx->position && ctx->buffer[pos] != '\n') pos++;
+		pos++;
+	}
+	nl = fl - 1;
+
+	/* the file so far, if there is one */
+	fp = fopen(name,"r");
+	if (fp != NULL) {
+		fseek(fp,0,SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		old = (char *)malloc(size+1);
+		if (old == NULL || fread(old,1,size,fp) != (size_t)size) {
+			free(old);
+			free(hits);
+			fclose(fp);
+			return ERROR_RETURN;
+		}
+		old[size] = '\0';
+		fclose(fp);
 	}
-	//position -= 1;	// otherwise we get run errors
-	fclose(infile);
-    #endif
 
-    #ifdef arduino
-    // sdFile defined in globals
-    sdFile = SD.open(filename, FILE_READ);
-    if (sdFile == NULL) {
-        prout(ERR13);      // error reading file
-        return;
-    }
-    memset(buffer,0,BUFSIZE);
-    position = 0;
-    while (sdFile.available()) {
-        ch = sdFile.read();
-        if (ch != '\0')
-            buffer[position++] = ch;
-    }
-    sdFile.close();    
-    #endif
-    
-	return;
+	/* write it all to name.tmp, rename when done */
+	snprintf(temp,sizeof(temp),"%s.tmp",name);
+	fp = fopen(temp,"w");
+	if (fp == NULL) {
+		free(old);
+		free(hits);
+		return ERROR_RETURN;
+	}
+	for (rec=p=old; p && *p; p=eol) {
+		eol = strchr(p,'\n');
+		eol = eol ? eol+1 : p+strlen(p);
+		if (strncmp(p,"SF:",3)==0) sf = p+3;
+		if (strncmp(p,"end_of_record",13)!=0) continue;
+		if (sf && strncmp(sf,source,strlen(source))==0 && sf[strlen(source)] == '\n') {
+			for (q=rec; q<p; q=strchr(q,'\n')+1)	// ours: add its counts in
+				if (sscanf(q,"DA:%d,%d",&fl,&h) == 2 && fl > 0 && fl <= nl && hits[fl] >= 0)
+					hits[fl] += h;
+		} else fwrite(rec,1,eol-rec,fp);			// another program's
+		rec = eol;
+		sf = NULL;
+	}
+	if (rec && *rec) fputs(rec,fp);		// no end_of_record: keep it anyway
+
+	fprintf(fp,"TN:\nSF:%s\n",source);
+	for (fl=1; fl<=nl; fl++) {
+		if (hits[fl] < 0) continue;
+		fprintf(fp,"DA:%d,%d\n",fl,hits[fl]);
+		lf++;
+		if (hits[fl] > 0) lh++;
+	}
+	fprintf(fp,"LF:%d\nLH:%d\nend_of_record\n",lf,lh);
+	free(old);
+	free(hits);
+	if (fclose(fp) != 0 || rename(temp,name) != 0) {
+		unlink(temp);
+		return ERROR_RETURN;
+	}
+	return NORMAL_RETURN;
 }
+#endif
 
+/* coverexit - basic is exiting: merge into $BASICCOVER if it's set */
+void coverexit(struct context *ctx) {
+	#ifdef posix
+	char *name = getenv("BASICCOVER");
 
+	if (name == NULL || name[0] == '\0' || ctx->cover == NULL) return;
+	coverlcov(ctx,name);
+	#endif
+}
 
-/* ******************* */
-/* save buffer to file */
-/* ******************* */
-void filesave(char *line) {
+#ifdef posix
+/* ************************************************************ */
+/* profile [n]: run the program timing every line, then show    */
+/* the n (10) lines it spent the most time in and the GOSUB     */
+/* targets by time from the GOSUB to its RETURN (incl), less    */
+/* the GOSUBs they made themselves (excl). execute() only looks */
+/* at ctx->prof, so with no profile running nothing is timed.   */
+/* ************************************************************ */
+
+/* clockns - a nanosecond clock for the profiler */
+long long clockns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
 
-	char cmd[10]={}, filename[32]={};
-	sscanf(line,"%s %s ",cmd,filename);
-	if (strlen(filename)==0) {
-		prout(ERR11);   // usage: save fname
+/* profline - the line at pos is about to run (pos -1: the run is */
+/* over). The line before it gets the time since it started, and  */
+/* a change in the gosub stack depth opens or closes call frames. */
+/* Frames (and samples) only follow the main task: SPAWNed ones   */
+/* have stacks of their own. execute() calls it for the end of    */
+/* the program too, with no END: that is the run being over as    */
+/* well.                                                          */
+void profline(struct context *ctx, int pos) {
+	struct profile *p = ctx->prof;
+	struct profframe *f;
+	long long now, incl;
+	int depth;
+
+	if (pos >= (int)ctx->position) pos = -1;		// past the last line
+	depth = (pos < 0) ? 0 : ctx->return_stack_position;
+
+	if (p->sample) {		// sample: just say where we are, SIGPROF does the rest
+		if (ctx->curtask == 0) {
+			while (p->ntargets < depth) {	// set the target before it counts
+				p->targets[p->ntargets] = pos;
+				p->ntargets++;
+			}
+			p->ntargets = depth;
+			p->cur = pos;
+		}
+		else if (pos < 0) p->cur = pos;
 		return;
 	}
-    #ifdef posix
-    FILE *outfile;
-	outfile = fopen(filename,"w");
-	if (outfile == NULL) {
-		prout(ERR12);   // error creating file
-		return;
+	now = clockns();
+
+	if (p->last >= 0) p->lines[p->last].ns += now - p->t;
+	if (ctx->curtask == 0 || pos < 0) {
+		while (p->depth > depth) {		// RETURNs
+			f = &p->frames[--p->depth];
+			incl = now - f->start;
+			p->lines[f->addr].incl += incl;
+			p->lines[f->addr].excl += incl - f->child;
+			if (p->depth > 0) p->frames[p->depth-1].child += incl;
+		}
+		while (p->depth < depth) {		// GOSUBs (and ON TIMER/EVENT handlers)
+			f = &p->frames[p->depth++];
+			f->addr = pos;
+			f->start = now;
+			f->child = 0;
+			p->lines[pos].calls++;
+		}
 	}
-	for (int n=0; n<=position; n++)
-		fprintf(outfile,"%c",buffer[n]);
-	fclose(outfile);
-    #endif
-
-    #ifdef arduino
-    //sdFile defined in globals
-    if (SD.exists(filename))
-        SD.remove(filename);
-    sdFile = SD.open(filename, FILE_WRITE);
-    if (sdFile == NULL) {
-        prout(ERR12);   // error creating file
-        return;
-    }
-    for (int n=0; n<=position; n++)
-        sdFile.write(buffer[n]);
-    sdFile.close();
-    #endif
-    
-	return;
+	p->last = pos;
+	if (pos < 0) return;
+	p->lines[pos].count++;
+	p->t = now;
 }
 
+/* profnext - the next row of a report: the address with the most  */
+/* time (incl: in calls to it) after (prev,prevaddr) in most first, */
+/* address order, or -1 when there are no more                      */
+int profnext(struct context *ctx, int incl, long long prev, int prevaddr) {
+	long long v, best = -1;
+	int addr, found = -1;
+
+	for (addr=0; addr<(int)ctx->position; addr++) {
+		v = incl ? ctx->prof->lines[addr].incl : ctx->prof->lines[addr].ns;
+		if (v <= 0 || v > prev || (v == prev && addr <= prevaddr)) continue;
+		if (v > best) {
+			best = v;
+			found = addr;
+		}
+	}
+	return found;
+}
 
+/* profreport - the hot lines and GOSUB targets, top of each */
+void profreport(struct context *ctx, int top) {
+	struct profline *l = ctx->prof->lines;
+	long long runs = 0, total = 0, prev;
+	int n, addr, prevaddr;
 
+	for (addr=0; addr<(int)ctx->position; addr++) {
+		runs += l[addr].count;
+		total += l[addr].ns;
+	}
+	sprintf(ctx->printmessage,"\r\n%lld lines run in %.3f ms\r\n",runs,total/1e6);
+	prout(ctx,ctx->printmessage);
+	if (total == 0) return;
+
+	prout(ctx,"  line        count          ms   ns/run      %\r\n");
+	prev = LLONG_MAX; prevaddr = -1;
+	for (n=0; n<top && (addr = profnext(ctx,0,prev,prevaddr)) >= 0; n++) {
+		sprintf(ctx->printmessage,"%6d %12lld %11.3f %8lld %6.2f\r\n",
+			atoi((char *)ctx->buffer+addr),l[addr].count,l[addr].ns/1e6,
+			l[addr].ns/l[addr].count,100.0*l[addr].ns/total);
+		prout(ctx,ctx->printmessage);
+		prev = l[addr].ns; prevaddr = addr;
+	}
 
+	prev = LLONG_MAX; prevaddr = -1;
+	for (n=0; n<top && (addr = profnext(ctx,1,prev,prevaddr)) >= 0; n++) {
+		if (n == 0) prout(ctx,"\r\n gosub        calls     incl ms     excl ms\r\n");
+		sprintf(ctx->printmessage,"%6d %12lld %11.3f %11.3f\r\n",
+			atoi((char *)ctx->buffer+addr),l[addr].calls,l[addr].incl/1e6,l[addr].excl/1e6);
+		prout(ctx,ctx->printmessage);
+		prev = l[addr].incl; prevaddr = addr;
+	}
+}
 
+/* profile [n] - run with the profiler on, then report the top n */
+void profile(struct context *ctx, char *line) {
+	char cmd[10]={}, count[10]={};
+	struct profile *p;
+	int top = 10;
+
+	sscanf(line,"%9s %9s",cmd,count);
+	if (atoi(count) > 0) top = atoi(count);
+	p = (struct profile *)calloc(1,sizeof(struct profile));
+	if (p != NULL) p->lines = (struct profline *)calloc(ctx->position,sizeof(struct profline));
+	if (p == NULL || p->lines == NULL) {
+		free(p);
+		prout(ctx,"out of memory\r\n");
+		return;
+	}
+	p->last = -1;
+	ctx->prof = p;
+	run(ctx,(char *)"run");
+	profline(ctx,-1);		// the last line's time, close the frames
+	profreport(ctx,top);
+	ctx->prof = NULL;
+	free(p->lines);
+	free(p);
+}
 
-/* ******************************** */
-/* display listing of external file */
-/* ******************************** */
-void flist(char *line) {
-char ch;
+/* ************************************************************ */
+/* sample [file]: run the program while a SIGPROF every msec of */
+/* cpu time counts the stack it is in - the GOSUB targets and   */
+/* the line running - then write them as folded stacks, one     */
+/* "main;gosub 100;line 120 count" per line, for flamegraph.pl. */
+/* The lines are not timed, so tight loops run at full speed.   */
+/* ************************************************************ */
+struct profile *sampling = NULL;	// what SIGPROF looks at
+
+/* samplesignal - SIGPROF: count the stack running now */
+void samplesignal(int sig) {
+	struct profile *p = sampling;
+	struct samplestack *s;
+	int key[MAXRETURNSTACKPOS+1];
+	unsigned int hash = 2166136261u;
+	int n, i, depth;
+
+	(void)sig;
+	if (p == NULL || p->cur < 0) return;
+	depth = p->ntargets;
+	if (depth > MAXRETURNSTACKPOS) depth = MAXRETURNSTACKPOS;
+	for (n=0; n<depth; n++) key[n] = p->targets[n];
+	key[n++] = p->cur;
+	for (i=0; i<n; i++) hash = (hash ^ key[i]) * 16777619u;		// fnv-1a
+	p->samples++;
+	for (i=0; i<SAMPLESTACKS; i++) {
+		s = &p->stacks[(hash+i) & (SAMPLESTACKS-1)];
+		if (s->n == 0) {		// first time this stack is seen
+			memcpy(s->addr,key,n*sizeof(int));
+			s->n = n;
+		}
+		if (s->n == n && memcmp(s->addr,key,n*sizeof(int)) == 0) {
+			s->count++;
+			return;
+		}
+	}
+	p->lost++;
+}
 
-	char cmd[10]={}, filename[32]={};
-	sscanf(line,"%s %s ",cmd,filename);
-	if (strlen(filename)==0) {
-		prout(ERR14);   // usage:flist filename
+/* sample [file] - run with the sampler on, write the folded stacks */
+/* to file (basic.folded)                                           */
+void sample(struct context *ctx, char *line) {
+	char cmd[10]={}, name[MAXLINE]="basic.folded";
+	struct profile *p;
+	struct itimerval it, old;
+	struct sigaction sa, oldsa;
+	struct samplestack *s;
+	FILE *fp;
+	int n, i;
+
+	sscanf(line,"%9s %s",cmd,name);
+	p = (struct profile *)calloc(1,sizeof(struct profile));
+	if (p != NULL) p->stacks = (struct samplestack *)calloc(SAMPLESTACKS,sizeof(struct samplestack));
+	if (p == NULL || p->stacks == NULL) {
+		free(p);
+		prout(ctx,"out of memory\r\n");
 		return;
 	}
-   
-    #ifdef posix
-    FILE *infile;
-	infile = fopen(filename,"r");
-	if (infile == NULL) {
-		prout(ERR13);   // error reading file
-		return;
+	p->sample = 1;
+	p->cur = -1;
+	ctx->prof = p;
+	sampling = p;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = samplesignal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF,&sa,&oldsa);
+	it.it_interval.tv_sec = it.it_value.tv_sec = 0;
+	it.it_interval.tv_usec = it.it_value.tv_usec = SAMPLEUS;
+	setitimer(ITIMER_PROF,&it,&old);
+
+	run(ctx,(char *)"run");
+
+	setitimer(ITIMER_PROF,&old,NULL);
+	sigaction(SIGPROF,&oldsa,NULL);
+	sampling = NULL;
+	ctx->prof = NULL;
+
+	fp = fopen(name,"w");
+	if (fp == NULL) {
+		prout(ctx,ERR12);   // error creating file
+		prout(ctx,name);
+		prout(ctx,"\r\n");
 	}
-	while (1) {
-		ch = fgetc(infile);
-		if (feof(infile)) break;
-		printf("%c",ch);
+	else {
+		for (n=0; n<SAMPLESTACKS; n++) {
+			s = &p->stacks[n];
+			if (s->n == 0) continue;
+			fprintf(fp,"main");
+			for (i=0; i<s->n-1; i++)
+				fprintf(fp,";gosub %d",atoi((char *)ctx->buffer+s->addr[i]));
+			fprintf(fp,";line %d %lld\n",atoi((char *)ctx->buffer+s->addr[i]),s->count);
+		}
+		fclose(fp);
+		sprintf(ctx->printmessage,"\r\n%lld samples (%d usec apart) in %s",p->samples,SAMPLEUS,name);
+		prout(ctx,ctx->printmessage);
+		if (p->lost) {
+			sprintf(ctx->printmessage,", %lld not counted: too many stacks",p->lost);
+			prout(ctx,ctx->printmessage);
+		}
+		prout(ctx,"\r\n");
 	}
-	fclose(infile);
-    #endif
-    
-    #ifdef arduino
-    sdFile = SD.open(filename, FILE_READ);
-    if (sdFile == NULL) {
-        prout(ERR13);   // error reading file
-        return;
-    }
-    while (sdFile.available()) {
-        ch = sdFile.read();
-        if (ch == '\n') Serial.write('\r');
-        Serial.write(ch);    
-    }
-    sdFile.close();    
-    #endif
-
-	return;
+	free(p->stacks);
+	free(p);
 }
+#endif
 
 
+/* **************** */
+/*    main/loop     */
+/* **************** */
+#ifndef library		// a library build leaves the prompt to the host
 
+#ifdef posix
+int main(int argc, char **argv) {
+#endif
 
-/* ************** */
-/* show directory */
-/* ************** */
-void dir(char* line) {
-char cmd[12]={},dirname[20]={};
-sscanf(line,"%s %s ",cmd,dirname);
-    if (strlen(dirname)==0) strcpy(dirname,"/");
-    #ifdef posix
-    #include <dirent.h>
-	struct dirent **namelist;
-	int n=0, i=0;
+#ifdef arduino
+void loop() {
+#endif
 
-	n = scandir(".",&namelist,NULL,alphasort);
-	if (n == -1) {
-		prout(ERR50);   // directory error
-		return;
-	}
+int pos=0;
+int n;
+char line[MAXLINE]={}, linenum[32]={};
+char *p;
+struct context *ctx;	// the one interpreter run from the prompt
 
-	while (n--) {
-		printf("%s\r\n",namelist[i]->d_name);
-		free(namelist[i]);
-		i++;
-	}
-    #endif
-    
-    #ifdef arduino
-    root = SD.open(dirname);	// set to a directory you want to hold files
-    printDirectory(root,0);
+    #ifdef posix
+	/* basic --batch dir [threads]: run every program in dir, then quit */
+	if (argc >= 3 && strcmp(argv[1],"--batch")==0)
+		return batch(argv[2],(argc > 3) ? atoi(argv[3]) : 0);
+	/* basic --serve socket program [workers]: pre-forked job server */
+	if (argc >= 4 && strcmp(argv[1],"--serve")==0)
+		return serve(argv[2],argv[3],(argc > 4) ? atoi(argv[4]) : 0);
     #endif
-	
-	return;
-}
 
-// I pulled this from the SD examples
-#ifdef arduino
-void printDirectory(File dir, int numTabs) {
-  while (true) {
+basicLoop:  // when external programs exit, jump back here to restart things
 
-    File entry =  dir.openNextFile();
-    if (! entry) {
-      // no more files
-      break;
-    }
-    for (uint8_t i = 0; i < numTabs; i++) {
-      Serial.print('\t');
-    }
-    Serial.print(entry.name());
-    if (entry.isDirectory()) {
-      Serial.println("/");
-      printDirectory(entry, numTabs + 1);
-    } else {
-      // files have sizes, directories do not
-      Serial.print(F("\t\t"));
-      Serial.println(entry.size(), DEC);
-    }
-    entry.close();
-  }
-}
-#endif
+	/* program buffer, variables and arrays all start out empty */
+	ctx = ctxnew();
+	if (ctx == NULL) {
+		prout(ctx,"out of memory");
+        #ifdef posix
+		return 1;
+        #endif
+        
+        #ifdef arduino
+        while(1);   // wait for reset
+        #endif
+	}
 
+	
+	sprintf(ctx->printmessage,"%s\r\n",HEADER);
+	prout(ctx,ctx->printmessage);
+	sprintf(ctx->printmessage,"%d Bytes Free\r\n",BUFSIZE-ctx->position);
+	prout(ctx,ctx->printmessage);
 
-/* ************** */
-/*  delete a file */
-/* ************** */
-void filedelete(char *line) {
-char cmd[10]={}, filename[32]={};
-    sscanf(line,"%s %s ",cmd,filename);
-    if (strlen(filename)==0) {
-        prout(ERR15);   // usage delete fname
-        return;
-    }
     #ifdef posix
-    int err = unlink(filename);
-    if (err == -1) perror(filename);
-    #endif
+	/* BASICMETRICS=socket: serve metrics from the start */
+	if (getenv("BASICMETRICS") != NULL && getenv("BASICMETRICS")[0] != '\0') {
+		snprintf(line,MAXLINE,"metrics %s",getenv("BASICMETRICS"));
+		metricscmd(ctx,line);
+	}
 
-    #ifdef arduino
-    if (SD.exists(filename))
-        SD.remove(filename);
-    else
-        Serial.println(ERR16);  // file not found
-    #endif
-    
-    return;
-    
-}
+	/* BASICCOVER=file: cover from the start, merge into file at exit */
+	if (getenv("BASICCOVER") != NULL && getenv("BASICCOVER")[0] != '\0')
+		covershow(ctx,(char *)"cover on");
 
+	/* test command line: if argv[1] = program name, load & run it */
+	if (argc == 2) {
+		char temp[strlen(argv[1])+5];
+		strcpy(temp,"load ");
+		strcat(temp,argv[1]);
+		fileload(ctx,temp);		// format of the load command requires 'load' before filename
+		/* run it */
+		run(ctx,"x");			// x is dummy, not used
+	}   // at end jump to editor
+    #endif
 
-/* ************************** */
-/* convert line to lower case */
-/* ************************** */
-void linetolower(char *line) {
-char temp[strlen(line)+5];		// note: issue w/E being changed to e (2E5 now 2e5)
-int FLAG=1;						// currently not a critical issue.
-	FLAG=1;
-    for (int n=0; n<=strlen(line); n++) {
-        if (line[n] == '"' || line[n] == '(' || line[n] == ')')  // ignore quoted text & parens
-            FLAG=abs(FLAG-1);
-        if (FLAG)
-            temp[n] = tolower(line[n]);
-        else
-            temp[n] = line[n];
-    }
-	strcpy(line,temp);
-	return;
-}
 
+/***********************************/
+/*       Main Command Loop         */
+/***********************************/
+	while (1) {
 
-/* ********************** */
-/*    tokenize the line   */
-/* ********************** */
-void tokenize(char *line) {
-    // unused - not worth the effort
-	return;
-}
+		/* show prompt, get a line or command */
+		memset(line,0,MAXLINE);
+		ctx->maxline = getmaxlinenum(ctx);
+		jobcheck(ctx);		// say which run & jobs have finished
+        prout(ctx,PROMPT);
+        
+        #ifdef posix
+		fgets(line,MAXLINE,stdin);
+        #endif
 
+        #ifdef arduino
+		sgets(line);
+        #endif
 
+		if (line[0] == '\n') continue;
+		line[strlen(line)] = '\0';
 
-/* ************************************ */
-/* this is the actual basic interpreter */
-/* ************************************ */
-int run(char *line) {
 
-char linenum[6]={};
-char basicline[MAXLINE]={}, cmd[6]={};
-int pos=0, n=0; 	// n-local, pos = local position
-int res=0;			// result returned from parse()
 
-    //prout("\r\n");
-    
-	// test integrity of basic file (fixed after bug in load() found)
-	for (n=0; n<position-1; n++) {
-		if (buffer[n] == 0) {
-			sprintf(printmessage,"ERROR in basic file at address %04x\r\n",n);
-			prout(printmessage);
-			sprintf(printmessage,"Basic file is corrupt.\r\n");
-			prout(printmessage);
-			return 1;
+        #ifdef posix
+		/* exit - exit out of this program */
+		if (strncmp(line,"exit",4)==0) {
+			for (n=0; n<MAXJOBS; n++)
+				jobfree(&jobs[n]);	// stop and free any background jobs
+			statsexit(ctx);
+			coverexit(ctx);
+			metricsstop();			// before the jobs and ctx it reads go
+			ctxfree(ctx);			// free up the array ram and program memory
+			return 0;
 		}
-	}
-
-	// test how we got here: run <cr> starts at position 0 and clear all 
-	// variables before starting.
-	// run <line number> does not clear the vars and starts running
-	// at <line number>.
-	
-	sscanf(line,"%s %s ",cmd,linenum);
-	if (atoi(linenum) == 0) {
-
-
-	// clear the gosub stack
-	return_stack_position = 0;
-	for (n=0; n<10; n++)
-		return_stack[n] = -1;
+        #endif
 
-	// clear all integer variables
-	for (unsigned char ch='a'; ch <= 'z'; ch++)
-            intvar[ch-'a']=0;
+        #ifdef posix
+		/* metrics [socket/off] - serve the counters for Prometheus */
+		if (strncmp(line,"metrics",7)==0) {
+			metricscmd(ctx,line);
+			continue;
+		}
+        #endif
 
-	// clear integer array
-	if (intarray != NULL) {
-		free(intarray);
-		intarray = (int*)NULL;
-		arraymax = 0;
-	}
+		/* cover [on/off/lcov file] - which lines have run */
+		if (strncmp(line,"cover",5)==0) {
+			covershow(ctx,line);
+			continue;
+		}
 
-	// clear for/next variables
-	forvar = '\0';
-    forstep = 0;
-    foraddr = 0;
-    tovar = 0;
+		/* latency [on/off] - how long INPUT, FILEREAD, ... waited */
+		if (strncmp(line,"latency",7)==0) {
+			latencyshow(ctx,line);
+			continue;
+		}
 
-    // clear the string variables
-    memset(textvar,0,26*MAXLINE);
+		/* stats [json [file]] - the interpreter's counters */
+		if (strncmp(line,"stats",5)==0) {
+			statsshow(ctx,line);
+			continue;
+		}
 
-    #ifdef arduino
-    if (sdFile) sdFile.close();     // close if open
-    #endif
-	#ifdef posix
-	if (diskfile) { 
-		fclose(diskfile);
-		diskfile=0;		// null it
-	}
-	#endif
+		/* tracedump [n/file] - the last lines traced */
+		if (strncmp(line,"tracedump",9)==0) {
+			tracedump(ctx,line);
+			continue;
+		}
 
-	pos = 0;		// set initial position in the buffer
+		/* trace - trace program flow */
+		if (strncmp(line,"trace",4)==0) {
+			ctx->trace = abs(ctx->trace-1);
+			if (ctx->trace && !traceon(ctx)) {
+				prout(ctx,"out of memory\r\n");
+				ctx->trace = 0;
+			}
+			if (ctx->trace) {
+				sprintf(ctx->printmessage,"Trace ON\r\n");
+				prout(ctx,ctx->printmessage);
+			}
+			else {
+				sprintf(ctx->printmessage,"Trace OFF\r\n");
+				prout(ctx,ctx->printmessage);
+			}
+			continue;
+		}
 
-	} else 
-		pos = setlinenumber(linenum,0);		// get address of line number
+        /* clear the display */
+        if (strncmp(line,"cls",3)==0) {
+            #ifdef arduino
+            Serial.println(F("\e[H\e[J"));
+            #endif
+            continue;
+        }
 
+        #ifdef arduino
+        /* jump to line editor */
+        if (strncmp(line,"edit",4)==0) {
+            ledit(ctx);
+            continue;
+        }
+        #endif
+        
+		/* list - display basic listing in buffer */
+		if (strncmp(line,"list",4)==0) {
+			list(ctx,line);
+			continue;
+		}
 
-	while (1) {
 
+        /* slist - send listing to serial 1 (if arduino) */
         #ifdef arduino
-		/* stop on ^c (equiv in posix would be a signal) */
-        if (Serial.available() > 0) {
-            char ch = Serial.read();
-            if (ch == 0x03) {   // ^C
-                Serial.print("\r\n^C Break.\r\n");
-                while (Serial.available());
-                return 0;
-            }
+        if (strncmp(line,"slist",5)==0) {
+            list(ctx,line);
+            continue;
         }
         #endif
+        
+		/* new - clear the buffers, reset pointers */
+		if (strncmp(line,"new",3)==0) {
+			if (progwrite(ctx) == ERROR_RETURN) continue;
+			ctx->position=0;
+			memset(ctx->buffer,0,BUFSIZE);
+            arrayfree(ctx);        // clear DIM memory
+            hashfree(&ctx->hashmap); // and the put/get map
+            for (int i=0; i<26; i++)
+                ctx->intvar[i]=0;      // clear vars a-z
+			ctx->maxline=0;
+			continue;
+		}
 
+		/* dump - hex dump of program listing (used in debugging the editor) */
+		if (strncmp(line,"dump",4)==0) {
+			int addr = 0;
+			while (addr < ctx->position) {
+				sprintf(ctx->printmessage,"%04X  ",addr);
+				prout(ctx,ctx->printmessage);
+				for (n=0; n<16; n++) {
+					sprintf(ctx->printmessage,"%02X ",ctx->buffer[addr+n]);
+					prout(ctx,ctx->printmessage);
+				}
+				prout(ctx,"  ");
+				for (n=0; n<16; n++) {
+					sprintf(ctx->printmessage,"%c",isprint(ctx->buffer[addr+n])?ctx->buffer[addr+n]:'.');
+					prout(ctx,ctx->printmessage);
+				}
+				prout(ctx,"\r\n");
+				addr += 16;
+			}
+			prout(ctx,"\r\n");
+			continue;
+		}
 
-		memset(basicline,0,MAXLINE);
-
-		/* get a line */
-		for (n=0; n<MAXLINE; n++) {
-			basicline[n] = buffer[pos];			// pos points to current byte in the buffer
-			if (buffer[pos] == '\n') break;		// and increments from 0 to the end of the buffer
-			pos++; if (pos >= position) break;	// being changed only by goto/gosub/return/for/next
+		/* mem/size - show free memory */
+		if ((strncmp(line,"mem",3)==0) || (strncmp(line,"size",4)==0)) {
+			sprintf(ctx->printmessage,"Basic Program Storage: %d bytes free\r\n",BUFSIZE-ctx->position);
+			prout(ctx,ctx->printmessage);
+            showmem();
+			continue;
 		}
 
-		if (pos++ >= position) {
-			//prout("no end statement\n\r");
-			return 1;	// back to editor
+
+		/* load - load file to buffer */
+		if (strncmp(line,"load",4)==0) {
+			fileload(ctx,line);
+			continue;
 		}
 
-		if (basicline[n] == '\n') { // got line
-			sscanf(basicline,"%s ",linenum);	 // line # = atoi(linenum) 
-			res = parse(basicline);
-			if (res == NORMAL_RETURN) continue;	 // normal exit, next basic line
-			if (res == ERROR_RETURN) { 			 // error (err displayed in routine): exit to editor
-				#ifdef posix
-				printf("%s\n",linenum);
-				#endif
-				#ifdef arduino
-				Serial.println(linenum);
-				#endif
-				return 1;
-			}
-			if (res == END_RETURN) return 0;	// got 'end' statement. done, return to editor
-			if (res == STOP_RETURN) return 0;	// got 'stop' statement, done, return to editor
-			if (res >= 0) {
-				pos = res;		// result is address of a line to jump to
-				continue;
-			}
+		/* save - save buffer to file */
+		if (strncmp(line,"save",4)==0) {
+			filesave(ctx,line);
+			continue;
 		}
 
-		prout(ERR17);   // unexpected error
-		return 1;
-	}
-}
+		/* flist - display file contents */
+		if (strncmp(line,"flist",5)==0) {
+			flist(ctx,line);
+			continue;
+		}
 
+		/* dir - show directory */
+		if (strncmp(line,"dir",3)==0) {
+            prout(ctx,"\r\n");
+			dir(ctx,line);
+			continue;
+		}
 
+        /* delete - delete a file from the file system */
+        if (strncmp(line,"delete",6)==0) {
+            filedelete(ctx,line);
+            continue;
+        }
 
-/* ********************** */
-/*** Instruction Parser ***/
-/* ********************** */
-int parse (char line[]) {	// parse the line, run the contents 
-	char linenum[6]={}, keyword[20]={}, option[60]={}, value[20]={};
+		/* run & - run the program as a background job */
+		if (strncmp(line,"run",3)==0 && strchr(line,'&') != NULL) {
+			if (ctx->position==0) {
+				prout(ctx,ERR5);    // empty buffer
+				continue;
+			}
+			jobstart(ctx,line);
+			continue;
+		}
 
-	sscanf(line,"%s %s %s %s ",linenum,keyword,option,value);
-	if (strlen(line) == 1) return NORMAL_RETURN;	// ignore blank lines
+		/* jobs - list the background jobs */
+		if (strncmp(line,"jobs",4)==0) {
+			jobslist(ctx);
+			continue;
+		}
 
-	if (DEBUG) {
-		sprintf(printmessage,"TRACE: line [%s]  \r\n",line);
-		prout(printmessage);
-	}
+		/* kill n - stop a background job (or forget a finished one) */
+		if (strncmp(line,"kill",4)==0) {
+			jobkill(ctx,line);
+			continue;
+		}
 
-	if (atoi(linenum)==0) {
-		prout(ERR6);    // line number error
-		return ERROR_RETURN;
-	}
+		/* peek [n] [var] - look at a job's variables while it runs */
+		if (strncmp(line,"peek",4)==0) {
+			jobpeek(ctx,line);
+			continue;
+		}
 
-	error = 0;		// initialize before each line
-	/* test keyword */
-	if (strcmp(keyword,"end")==0) {		// END
-		prout(ERR18);   // end of line
         #ifdef posix
-        printf("%s\r\n",linenum);
-        #endif
-        #ifdef arduino
-        Serial.println(linenum);
-        #endif
-		return END_RETURN;
-	}
-
-    #ifdef posix
-	if (strcmp(keyword,"exit")==0) {	// EXIT
-		prout("\n");
-		exit(0);
-	}
-    #endif
+		/* profile [n] - run the program, then show where the time went */
+		if (strncmp(line,"profile",7)==0) {
+			if (ctx->position==0) {
+				prout(ctx,ERR5);    // empty buffer
+				continue;
+			}
+			profile(ctx,line);
+			continue;
+		}
 
-	if (strcmp(keyword,"stop")==0) {	// STOP
-		prout(ERR19);   // stop at line
-        #ifdef posix
-        printf("%s\r\n",linenum);
-        #endif
-        #ifdef arduino
-        Serial.println(linenum);
+		/* sample [file] - run the program, write flamegraph stacks */
+		if (strncmp(line,"sample",6)==0) {
+			if (ctx->position==0) {
+				prout(ctx,ERR5);    // empty buffer
+				continue;
+			}
+			sample(ctx,line);
+			continue;
+		}
         #endif
-		return STOP_RETURN;
-	}
-
-	if (strcmp(keyword,"rem")==0) {		// REM
-		return NORMAL_RETURN;	// ignore rest of line 
-	}
 
-	if (strcmp(keyword,"dim")==0) {		// DIM
-		if (arraymax > 0) {	// we already did this
-			prout(ERR20);   // array re-dim
-			return ERROR_RETURN;
-		}
-		error = 0;
-		int res = eval(option);		// get size of array
-		if (error) {
-			prout(ERR21);   // array size error
-			return ERROR_RETURN;
-		}
-		if (res < 1) {
-			prout(ERR22);   // dim - no action taken
-			return ERROR_RETURN;
-		}
-		if (res > ARRAYMAX) {
-			prout(ERR21);   // array size 
-			return ERROR_RETURN;
-		}
-		intarray = (int*) malloc(res * sizeof(int));
-		if (intarray == NULL) {
-			prout(ERR24);   // out of memory
-			return ERROR_RETURN;
+		/* run - run the basic program */
+		if (strncmp(line,"run",3)==0) {
+			if (ctx->position==0) {
+				prout(ctx,ERR5);    // empty buffer
+				continue;
+			}
+			run(ctx,line);
+            memset(line,0,MAXLINE);
+            #ifdef arduino
+            /* clear any chars in buffer caused by ctrl-c */
+            if (Serial.available())
+                while(Serial.available());
+            #endif
+			prout(ctx,"\r\n");	// in case print terminated with ;
+			continue;
 		}
-		arraymax = res;
-		return NORMAL_RETURN;
-	}
 
-	if (strcmp(keyword,"goto")==0) {	// GOTO
-		int result = setlinenumber(option,0);					// return the address of the line to goto
-		if (result == ERROR_RETURN) return ERROR_RETURN;		// line # not found
-		return result;	// return address of line
-	}
+        #ifdef dueMini
+        if (strncmp(line,"i80",3)==0) { // 8080 emulator
+            // free up used memory
+            ctxfree(ctx);
+            i80();      // jump to 8080 emulator
+            // restore memory, reset pointers
+            goto basicLoop;
+        }
+        #endif
 
-	if (strcmp(keyword,"gosub")==0) {	// GOSUB
-		int res = setlinenumber(linenum,1);		// get addr of line after linenum
-		if (res == ERROR_RETURN) return ERROR_RETURN;
-		if (return_stack_position + 1 > MAXRETURNSTACKPOS) {
-			prout(ERR25);   // stack full
-			return ERROR_RETURN;
+
+		/* if the 1st character of a line isn't a number, show an error */
+		if (!(isdigit(line[0]))) {
+			prout(ctx,ERR1);    // syntax
+			continue;
 		}
-		return_stack[return_stack_position++] = res;	// save return address on stack
-		res = setlinenumber(option,0);  				// get address of linenumber following gosub
-        if (res == ERROR_RETURN) return ERROR_RETURN;
-        return res; // gosub new address
-	}
 
-	if (strcmp(keyword,"return")==0) {	// RETURN
-		if (return_stack_position < 1) {
-			prout(ERR26);   // return w/o gosub
-			return ERROR_RETURN;
+		/* ********************** */
+		/* end of command testing */
+		/* ********************** */
+		
+		/* first char IS a line number - save in memory */
+
+		/* test line number count */
+		sscanf(line,"%s ",linenum);
+		if (atoi(linenum) < 1 || atoi(linenum) > MAXLINENUMBER) {
+			prout(ctx,ERR6);    // line # out of range
+			continue;
 		}
-		int res = return_stack[--return_stack_position];		// pop the return address
-		if (res == ERROR_RETURN) return ERROR_RETURN;
-		return res;
-	}
+        /* look for bad trailing chars in line number */
+        if (!(isdigit(linenum[strlen(linenum)-1]))) {
+                prout(ctx,ERR3);    // bad char in line #
+                continue;
+        }
 
-    #ifdef posix
-	if (strcmp(keyword,"sleep")==0) {	// SLEEP
-		if (atoi(option) > 0)
-			sleep(atoi(option));		// in integer seconds
-		return NORMAL_RETURN;
-	}
-    #endif
+		/* 
+		 * Memory savings when converting to tokens is only 18%, 
+		 * hardly worth the added code. With 16K ram you get about
+		 * 744 lines of basic code. Quite a lot for a controller.
+		 */
+		//tokenize(line);
+       
+		linetolower(line);  // all but quoted and inside () lower case
 
+		/* room to add the line? */
+		if (strlen(line) + ctx->position > BUFSIZE-1) {
+			prout(ctx,ERR4);    // out of memory
+            continue;
+        }
+		if (progwrite(ctx) == ERROR_RETURN) continue;	// our own copy to edit
 
-	if (strcmp(keyword,"clear")==0) {	// CLEAR
-		for (unsigned char ch='a'; ch <= 'z'; ch++)
-			intvar[ch-'a']=0;			// clear all integer variables
-		
-		free(intarray);
-		arraymax=0;
-        
-        // clear the string variables
-        memset(textvar,0,26*MAXLINE);
-		
-		return NORMAL_RETURN;
-	}
 
-	if (strcmp(keyword,"let")==0) {		// LET
-		int res = parse_let(line);
-		return res;
-		return parse_let(line);
-	}
 
-	if (strcmp(keyword,"print")==0) {	// PRINT
-		return parse_print(line);
-	}
+		/* *********************************************** */
+		/* if line number > maxline, append line to buffer */
+		/* *********************************************** */
+		if (atoi(linenum) > ctx->maxline) {
+						
+			/* test if line is blank (don't insert blank lines) */
+            int FLAG=0;
+			for (int n=strlen(linenum); n<strlen(line); n++) 
+                if (!(isspace(line[n]))) FLAG=1;
+            if (!FLAG) continue;
 
-	if (strcmp(keyword,"input")==0) {	// INPUT
-		return parse_input(line);
-	}
+			p=line;
+			while (*p != '\0') {
+				ctx->buffer[ctx->position++] = *p++;
+			}
+			if (ctx->position >= BUFSIZE-1) {
+				prout(ctx,ERR4);    // out of memory
+			}
+			ctx->maxline = getmaxlinenum(ctx);
+			continue;
+		}
+	
 
-	if (strcmp(keyword,"if")==0) {		// IF
-		int res = parse_if(line);
-		return res;
-		return parse_if(line);
-	}
 
-	if (strcmp(keyword,"for")==0) {		// FOR
-		return parse_for(line);
-	}
+		/* ********************************************************* */
+		/* if line number == existing line number, delete or replace */
+		/* ********************************************************* */
+		if ((pos = isline(ctx,atoi(linenum))) != -1) {
+			int FLAG=0;
+			/* pos points to start of line to replace */
+			unsigned char *start, *end;
+			end = start = ctx->buffer+pos;	// start of line
+			while (*end++ != '\n'); 	// look for \n - end = end of line 
+			
+			/* delete line */
+			while (end-ctx->buffer <= ctx->position) 
+				*start++ = *end++;
+			ctx->position -= (end-start); // line is deleted
+			
+			/* clear the old code above old position */
+			for (n=ctx->position+1; n<BUFSIZE; n++) ctx->buffer[n]='\0';
+			
+			/* test if entered line is empty (delete) */
+			if (strlen(line)-strlen(linenum) == 1) {
+				ctx->maxline = getmaxlinenum(ctx);
+				continue;		// line was empty - we're done
+			}
 
-	if (strcmp(keyword,"next")==0) {	// NEXT
-		return parse_next(line);
-	}
+			/* test if line is blank (don't insert blank lines) */
+			for (n=strlen(linenum); n<strlen(line); n++) 
+				if (!(isspace(line[n]))) FLAG=1;
+			if (!FLAG) continue;
 
+			/* else shift buffer up by strlen(line) */
+			memmove(&ctx->buffer[pos+strlen(line)],&ctx->buffer[pos],ctx->position-pos);
+			ctx->position += strlen(line);
+			
+			/* insert line at pos */
+			for (int i=pos, n=0; i<=pos+(strlen(line)-1); i++)
+				ctx->buffer[i] = line[n++];
+			ctx->maxline = getmaxlinenum(ctx);
+			continue;
+		}
 
-    if (strcmp(keyword,"fileopen")==0) {    // FILEOPEN
-        return fileopen(option,value);
-    }
+		/* ***************************************** */
+        /* line# < maxline - insert line into buffer */
+        /* ***************************************** */
+        if (atoi(linenum) < ctx->maxline) {
+            int n, i, start=0, end=1;
+            char temp[MAXLINE]={};
+            char LINEN[6];     // hold line number from temp
 
-    if (strcmp(keyword,"fileclose")==0) {    // FILECLOSE
-        return fileclose();
-    }
+			/* test if line is blank (don't insert blank lines) */
+            int FLAG=0;
+            for (int n=strlen(linenum); n<strlen(line); n++)
+                if (!(isspace(line[n]))) FLAG=1;
+            if (!FLAG) continue;
 
 
-    if (strcmp(keyword,"filewrite")==0) {   // FILEWRITE
-        return filewrite(line);
-    }
+            loop:   // find line w/line# higher than new line
 
-    if (strcmp(keyword,"fileread")==0) {    // FILEREAD
-        return fileread(line);
-    }
+            i = 0;
+            for (n=start; n<ctx->position; n++) {
+                if (n >= ctx->position) {
+                    //sprintf(printmessage,"error - line not found\r\n");
+					prout(ctx,ERR8);    // line not found
+                    continue;
+                }
+                if (ctx->buffer[n] == '\n') break;
+                temp[i++] = ctx->buffer[n];      // get line from buffer
+            }
+            end = n+1;
+            sscanf(temp,"%s",LINEN);
+            if (atoi(LINEN) > atoi(linenum)) goto loop2;
+            start = end;
+            goto loop;
+
+            loop2:  // start points to start position of our new line
 
+            /* shift up buffer by strlen(line) */
+            memmove(&ctx->buffer[start+strlen(line)],&ctx->buffer[start],ctx->position-start);
+            ctx->position += strlen(line);
 
-    if (strcmp(keyword,"delay")==0) {       // DELAY
-        int res = 0;
-        if (option[0] >= 'a' && option[0] <= 'z')
-            res = intvar[option[0] - 'a'];
-        else
-            res = atoi(option);
-        #ifdef arduino
-        delay(res);     // in msec
-        #endif
-        #ifdef posix
-        usleep(res*1000);
-        #endif
-        return NORMAL_RETURN;
-    }
+            /* insert line at start */
+            for (i=start, n=0; i<=start+(strlen(line)-1); i++)
+                ctx->buffer[i] = line[n++];
+            ctx->maxline = getmaxlinenum(ctx);
+            continue;
+        }
 
 
-	/* arduino specific statements */
-    #ifdef arduino
+		/* **************************** */
+		/* error - somehow we fell thru */
+		/* **************************** */
 
-	/* pinset pin# - set digital pin to 1 */
-	if (strcmp(keyword,"pinset")==0) {		// PINSET
-		int res=0;
-		if (option[0] >= 'a' && option[0] <= 'z') 
-			res = intvar[option[0] - 'a'];
-		else
-			res = atoi(option);
-		pinMode(res,OUTPUT);
-		digitalWrite(res,1);
-		return NORMAL_RETURN;
+		prout(ctx,ERR9);    // line not recognized
+    	// should never see this
+		continue;
 	}
+}
 
-	/* pinclr pin# - set digital pin to 0 */
-	if (strcmp(keyword,"pinclr")==0) {		// PINCLR
-        int res=0;    
-		if (option[0] >= 'a' && option[0] <= 'z') 
-            res = intvar[option[0] - 'a'];
-        else
-            res = atoi(option);
-		pinMode(res,OUTPUT);
-		digitalWrite(res,0);
-		return NORMAL_RETURN;
-	}
+#endif	// library
 
-	#endif  /* end of arduino specific statements */
 
-    
-    
-	
 
-	prout(ERR2);    // syntax in line
-	return ERROR_RETURN;
+#ifdef library
+/* ******************************************************** */
+/* library interface - a C/C++ host drives basic through    */
+/* these instead of main() and stdin. See tinybasic.h.      */
+/* ******************************************************** */
+struct context *tb_new(void) {
+	return ctxnew();
 }
 
+/* another interpreter for the same program, sharing its text */
+struct context *tb_share(struct context *from) {
+	return ctxshare(from);
+}
 
-/* ********* */
-/*    LET    */
-/* ********* */
-int parse_let(char line[]) {
-char *p;
-char linenum[6];
-char temp[20]={};
-int cnt=0;
+void tb_free(struct context *ctx) {
+	ctxfree(ctx);
+}
 
-	sscanf(line,"%s ",linenum);
-	if (atoi(linenum)==0) {
-		prout(ERR6);    // bad linenumber
-		return ERROR_RETURN;
-	}
+/* replace the program with text (lines of "nn statement\n") */
+int tb_load(struct context *ctx, const char *program) {
+	unsigned int len = strlen(program);
 
-	p = strstr(line,"let");
-	if (p == NULL) {
-		prout(ERR27);    // bad format
-		return ERROR_RETURN;
+	if (len + 2 > BUFSIZE) {
+		prout(ctx,ERR4);	// out of memory
+		return TB_ERROR;
 	}
+	if (progwrite(ctx) == ERROR_RETURN) return TB_ERROR;
+	memset(ctx->buffer,0,BUFSIZE);
+	memcpy(ctx->buffer,program,len);
+	ctx->position = len;
+	if (len > 0 && ctx->buffer[len-1] != '\n')
+		ctx->buffer[ctx->position++] = '\n';		// run() needs the last \n
+	ctx->maxline = getmaxlinenum(ctx);
+	return TB_OK;
+}
 
-	while (*p++ != ' ');	// point to 1st non-blank char after 'let'
-	cnt = 0;
+/* run the whole program, clearing variables first (like 'run') */
+int tb_run(struct context *ctx) {
+	if (run(ctx,(char *)"run") == ERROR_RETURN) return TB_ERROR;
+	return TB_OK;
+}
 
-	while (1) {
-		if (*p == '\n' || *p == '\0') return NORMAL_RETURN;
+/* address of a line for tb_call, looked up once by the host */
+int tb_line(struct context *ctx, int linenumber) {
+	char num[12];
+	int addr;
 
-		if (*p == ',') {
-            p++;
-            continue;
-        }
-		
-		if (*p == ' ') {
-            p++;
-            continue;
-        }
+
+	sprintf(num,"%d",linenumber);
+	addr = setlinenumber(ctx,num,0);
+	if (addr == ERROR_RETURN) return TB_ERROR;
+	return addr;
+}
+
+/* GOSUB to addr (from tb_line) and come back at its RETURN */
+int tb_call(struct context *ctx, int addr) {
+	int depth = ctx->return_stack_position;
+	int res;
+
+	if (addr < 0 || addr >= ctx->position) return TB_ERROR;
+	if (depth + 1 > MAXRETURNSTACKPOS) {
+		prout(ctx,ERR25);   // stack full
+		return TB_ERROR;
+	}
+	ctx->error = 0;
+	ctx->return_stack[ctx->return_stack_position++] = CALL_RETURN;
+	res = execute(ctx,addr);
+	ctx->return_stack_position = depth;		// drop whatever an END or error left
+	if (res == CALL_RETURN) return TB_OK;
+	if (res == ERROR_RETURN) return TB_ERROR;
+	return TB_END;		// END, STOP or last line before the RETURN
+}
+
+int tb_getvar(struct context *ctx, char var) {
+	if (var < 'a' || var > 'z') return 0;
+	return ctx->intvar[var-'a'];
+}
+
+void tb_setvar(struct context *ctx, char var, int value) {
+	if (var < 'a' || var > 'z') return;
+	ctx->intvar[var-'a'] = value;
+}
+
+int tb_getarray(struct context *ctx, int index) {
+	ctx->error = 0;
+	return arrayget(ctx,index);
+}
+
+int tb_setarray(struct context *ctx, int index, int value) {
+	ctx->error = 0;
+	if (arrayput(ctx,index,value) == ERROR_RETURN) return TB_ERROR;
+	return ctx->error ? TB_ERROR : TB_OK;
+}
+#endif	// library
+
+
+
+
+
+
+
+
+
+/* ************************************* */
+/* return highest line # found in buffer */
+/* ************************************* */
+int getmaxlinenum(struct context *ctx) {
+    char temp[MAXLINE]={};  // hold line
+    int n,i, highest = 0;
+    char linenum[10] = {};
+    int start = 0, end = 1;
+
+loop:
+    i = 0;
+    for (n=start; n<ctx->position; n++) {
+        if (ctx->buffer[n] == '\n') break;
+        temp[i++] = ctx->buffer[n];
+    }
+    if (n >= ctx->position) {
+		return highest;
+	}
+    end = n+1;
+    // got a line in temp
+    sscanf(temp,"%s",linenum);
+    if (atoi(linenum) > highest)
+        highest = atoi(linenum);
+    start = end;
+    goto loop;
+}
+
+
+/* *************************** */
+/* return true if line# exists */
+/* *************************** */
+int isline(struct context *ctx, int line) {
+	unsigned char *p;
+	char temp[MAXLINE]={}, linenum[32]={};
+	int n=0;
+	p = ctx->buffer;
+loop:
+	n=0;
+	while (1) {
+		temp[n++] = *p;
+		if (*p++ == '\n') break;
+	}
+	sscanf(temp,"%s ",linenum);
+	if (atoi(linenum)==line) return (p-ctx->buffer)-n;	// start position
+	if (p-ctx->buffer >= ctx->position-1) return -1;
+	goto loop;
+}
+
+
+
+/* ****************** */
+/*     list/slist     */
+/* ****************** */
+void list(struct context *ctx, char line[]) {
+char cmd[20]={};
+	unsigned char *p;
+	p=ctx->buffer;
+	int cnt=0;
+    sscanf(line,"%s ",cmd); // see what command we're running
+    if (ctx->position <1) return;
+	prout(ctx,"\n\r");
+	while (cnt++ < ctx->position) {
+		// list
+        if (strcmp(cmd,"list")==0) {
+            if (*p == '\n') prout(ctx,"\r");    // force a cr/lf
+		    sprintf(ctx->printmessage,"%c",*p++);
+		    prout(ctx,ctx->printmessage);
+        }
+        #ifdef arduino
+        if (strcmp(cmd,"slist")==0) {
+            if (*p == '\n') Serial1.print("\r");
+            Serial1.print(*p++);
+        }
+        #endif
+	}
+	return;
+}
+
+
+
+/* ******************* */
+/* load file to buffer */
+/* ******************* */
+void fileload(struct context *ctx, char *line) {
+
+	//FILE *infile;
+	char cmd[10]={}, filename[32]={};
+    sscanf(line,"%s %s ",cmd,filename);
+    if (strlen(filename)==0) {
+		prout(ctx,ERR10);   // usage: load fname
+        return;
+    }
+    #ifdef posix
+	if (readprogram(ctx,filename) == NORMAL_RETURN)
+		strcpy(ctx->source,filename);	// cover lcov names it
+    #endif
+
+    #ifdef arduino
+    char ch;
+    // sdFile defined in globals
+    sdFile = SD.open(filename, FILE_READ);
+    if (sdFile == NULL) {
+        prout(ctx,ERR13);      // error reading file
+        return;
+    }
+    if (progwrite(ctx) == ERROR_RETURN) return;
+    memset(ctx->buffer,0,BUFSIZE);
+    ctx->position = 0;
+    while (sdFile.available()) {
+        ch = sdFile.read();
+        if (ch != '\0')
+            ctx->buffer[ctx->position++] = ch;
+    }
+    sdFile.close();    
+    #endif
+    
+	return;
+}
+
+
+
+#ifdef posix
+/* read a program file (any path) into the buffer */
+int readprogram(struct context *ctx, const char *filename) {
+	FILE *infile;
+	int ch;
+
+    infile = fopen(filename,"r");
+    if (infile == NULL) {
+		prout(ctx,ERR16);   // file not found
+        return ERROR_RETURN;
+    }
+	if (progwrite(ctx) == ERROR_RETURN) {
+		fclose(infile);
+		return ERROR_RETURN;
+	}
+	memset(ctx->buffer,0,BUFSIZE);
+	ctx->position = 0;
+	while ((ch = fgetc(infile)) != EOF) {
+		if (ctx->position >= BUFSIZE-1) {
+			prout(ctx,ERR4);    // out of memory
+			break;
+		}
+		if (ch != '\0')
+			ctx->buffer[ctx->position++] = ch;
+	}
+	//position -= 1;	// otherwise we get run errors
+	fclose(infile);
+	return (ctx->position >= BUFSIZE-1) ? ERROR_RETURN : NORMAL_RETURN;
+}
+#endif
+
+
+/* ******************* */
+/* save buffer to file */
+/* ******************* */
+void filesave(struct context *ctx, char *line) {
+
+	char cmd[10]={}, filename[32]={};
+	sscanf(line,"%s %s ",cmd,filename);
+	if (strlen(filename)==0) {
+		prout(ctx,ERR11);   // usage: save fname
+		return;
+	}
+    #ifdef posix
+    FILE *outfile;
+	outfile = fopen(filename,"w");
+	if (outfile == NULL) {
+		prout(ctx,ERR12);   // error creating file
+		return;
+	}
+	for (int n=0; n<=ctx->position; n++)
+		fprintf(outfile,"%c",ctx->buffer[n]);
+	fclose(outfile);
+    #endif
+
+    #ifdef arduino
+    //sdFile defined in globals
+    if (SD.exists(filename))
+        SD.remove(filename);
+    sdFile = SD.open(filename, FILE_WRITE);
+    if (sdFile == NULL) {
+        prout(ctx,ERR12);   // error creating file
+        return;
+    }
+    for (int n=0; n<=ctx->position; n++)
+        sdFile.write(ctx->buffer[n]);
+    sdFile.close();
+    #endif
+    
+	return;
+}
+
+
+
+
+
+
+/* ******************************** */
+/* display listing of external file */
+/* ******************************** */
+void flist(struct context *ctx, char *line) {
+char ch;
+
+	char cmd[10]={}, filename[32]={};
+	sscanf(line,"%s %s ",cmd,filename);
+	if (strlen(filename)==0) {
+		prout(ctx,ERR14);   // usage:flist filename
+		return;
+	}
+   
+    #ifdef posix
+    FILE *infile;
+	infile = fopen(filename,"r");
+	if (infile == NULL) {
+		prout(ctx,ERR13);   // error reading file
+		return;
+	}
+	while (1) {
+		ch = fgetc(infile);
+		if (feof(infile)) break;
+		printf("%c",ch);
+	}
+	fclose(infile);
+    #endif
+    
+    #ifdef arduino
+    sdFile = SD.open(filename, FILE_READ);
+    if (sdFile == NULL) {
+        prout(ctx,ERR13);   // error reading file
+        return;
+    }
+    while (sdFile.available()) {
+        ch = sdFile.read();
+        if (ch == '\n') Serial.write('\r');
+        Serial.write(ch);    
+    }
+    sdFile.close();    
+    #endif
+
+	return;
+}
+
+
+
+
+/* ************** */
+/* show directory */
+/* ************** */
+void dir(struct context *ctx, char* line) {
+char cmd[12]={},dirname[20]={};
+sscanf(line,"%s %s ",cmd,dirname);
+    if (strlen(dirname)==0) strcpy(dirname,"/");
+    #ifdef posix
+    #include <dirent.h>
+	struct dirent **namelist;
+	int n=0, i=0;
+
+	n = scandir(".",&namelist,NULL,alphasort);
+	if (n == -1) {
+		prout(ctx,ERR50);   // directory error
+		return;
+	}
+
+	while (n--) {
+		printf("%s\r\n",namelist[i]->d_name);
+		free(namelist[i]);
+		i++;
+	}
+    #endif
+    
+    #ifdef arduino
+    root = SD.open(dirname);	// set to a directory you want to hold files
+    printDirectory(ctx,root,0);
+    #endif
+	
+	return;
+}
+
+// I pulled this from the SD examples
+#ifdef arduino
+void printDirectory(struct context *ctx, File dir, int numTabs) {
+  while (true) {
+
+    File entry =  dir.openNextFile();
+    if (! entry) {
+      // no more files
+      break;
+    }
+    for (uint8_t i = 0; i < numTabs; i++) {
+      Serial.print('\t');
+    }
+    Serial.print(entry.name());
+    if (entry.isDirectory()) {
+      Serial.println("/");
+      printDirectory(ctx,entry, numTabs + 1);
+    } else {
+      // files have sizes, directories do not
+      Serial.print(F("\t\t"));
+      Serial.println(entry.size(), DEC);
+    }
+    entry.close();
+  }
+}
+#endif
+
+
+/* ************** */
+/*  delete a file */
+/* ************** */
+void filedelete(struct context *ctx, char *line) {
+char cmd[10]={}, filename[32]={};
+    sscanf(line,"%s %s ",cmd,filename);
+    if (strlen(filename)==0) {
+        prout(ctx,ERR15);   // usage delete fname
+        return;
+    }
+    #ifdef posix
+    int err = unlink(filename);
+    if (err == -1) perror(filename);
+    #endif
+
+    #ifdef arduino
+    if (SD.exists(filename))
+        SD.remove(filename);
+    else
+        Serial.println(ERR16);  // file not found
+    #endif
+    
+    return;
+    
+}
+
+
+/* ************************** */
+/* convert line to lower case */
+/* ************************** */
+void linetolower(char *line) {
+char temp[strlen(line)+5];		// note: issue w/E being changed to e (2E5 now 2e5)
+int FLAG=1;						// currently not a critical issue.
+	FLAG=1;
+    for (int n=0; n<=strlen(line); n++) {
+        if (line[n] == '"' || line[n] == '(' || line[n] == ')')  // ignore quoted text & parens
+            FLAG=abs(FLAG-1);
+        if (FLAG)
+            temp[n] = tolower(line[n]);
+        else
+            temp[n] = line[n];
+    }
+	strcpy(line,temp);
+	return;
+}
+
+
+/* ********************** */
+/*    tokenize the line   */
+/* ********************** */
+void tokenize(char *line) {
+    // unused - not worth the effort
+	return;
+}
+
+
+
+/* ************************************************ */
+/* clear variables, arrays, stacks and files (run) */
+/* ************************************************ */
+void runclear(struct context *ctx) {
+	int n;
+
+	// clear the gosub stack and drop any spawned tasks
+	ctx->return_stack_position = 0;
+	for (n=0; n<10; n++)
+		ctx->return_stack[n] = -1;
+	taskclear(ctx);
+
+	// no ON TIMER/EVENT handlers
+	ctx->ntimers = ctx->nevents = ctx->onbusy = 0;
+
+	// counters start again
+	memset(&ctx->stats,0,sizeof(ctx->stats));
+
+	// empty the channels, unless programs on other threads use them
+	if (!chanshared) memset(channels,0,sizeof(channels));
+
+	// clear all integer variables
+	for (unsigned char ch='a'; ch <= 'z'; ch++)
+            ctx->intvar[ch-'a']=0;
+
+	// clear integer array and the put/get map
+	arrayfree(ctx);
+	hashfree(&ctx->hashmap);
+
+	// clear for/next variables
+	ctx->forvar = '\0';
+    ctx->forstep = 0;
+    ctx->foraddr = 0;
+    ctx->tovar = 0;
+
+    // clear the string variables
+    memset(ctx->textvar,0,26*MAXLINE);
+
+    #ifdef arduino
+    if (sdFile) sdFile.close();     // close if open
+    #endif
+	#ifdef posix
+	if (ctx->diskfile) { 
+		fclose(ctx->diskfile);
+		ctx->diskfile=0;		// null it
+	}
+	#endif
+}
+
+
+/* ************************************ */
+/* this is the actual basic interpreter */
+/* ************************************ */
+int run(struct context *ctx, char *line) {
+
+char linenum[6]={}, cmd[6]={};
+int pos=0, n=0; 	// n-local, pos = local position
+
+    //prout("\r\n");
+    
+	// test integrity of basic file (fixed after bug in load() found)
+	for (n=0; n<ctx->position-1; n++) {
+		if (ctx->buffer[n] == 0) {
+			sprintf(ctx->printmessage,"ERROR in basic file at address %04x\r\n",n);
+			prout(ctx,ctx->printmessage);
+			sprintf(ctx->printmessage,"Basic file is corrupt.\r\n");
+			prout(ctx,ctx->printmessage);
+			return ERROR_RETURN;
+		}
+	}
+
+	// test how we got here: run <cr> starts at position 0 and clear all 
+	// variables before starting.
+	// run <line number> does not clear the vars and starts running
+	// at <line number>.
+	
+	sscanf(line,"%s %s ",cmd,linenum);
+	if (atoi(linenum) == 0) {
+		runclear(ctx);	// clear all variables before starting
+		pos = 0;		// set initial position in the buffer
+	} else {
+		pos = setlinenumber(ctx,linenum,0);		// get address of line number
+		if (pos == ERROR_RETURN) return ERROR_RETURN;
+		taskclear(ctx);		// tasks of an earlier run don't come back
+	}
+
+	n = execute(ctx,pos);		// END/STOP/ERROR_RETURN, NORMAL_RETURN if no end
+	if (ctx->latencyend) latencyshow(ctx,(char *)"latency");
+	return n;
+}
+
+
+/* ********************************************************* */
+/* execute - run the program from address pos until END/STOP, */
+/* an error, the last line or a RETURN to the host. Returns   */
+/* the parse() code that stopped it (NORMAL_RETURN = no END). */
+/* With shared channels it is counted in chanrunning meanwhile */
+/* so taskstuck() can tell when every program is waiting.      */
+/* ********************************************************* */
+int execute(struct context *ctx, int pos) {
+	#ifdef posix
+	int counted = chanshared, res;
+
+	if (counted) __atomic_add_fetch(&chanrunning,1,__ATOMIC_SEQ_CST);
+	res = executelines(ctx,pos);
+	if (counted) {
+		chanunstuck(ctx);
+		__atomic_sub_fetch(&chanrunning,1,__ATOMIC_SEQ_CST);
+	}
+	return res;
+	#else
+	return executelines(ctx,pos);
+	#endif
+}
+
+int executelines(struct context *ctx, int pos) {
+
+char linenum[6]={};
+char basicline[MAXLINE]={};
+int n=0;
+int res=0;			// result returned from parse()
+int start;			// address of the line being run
+
+	while (1) {
+
+        #ifdef posix
+		if (__atomic_load_n(&ctx->killed,__ATOMIC_RELAXED)) return STOP_RETURN;	// kill from the prompt
+        #endif
+
+		if (ctx->ntimers | ctx->nevents | ctx->onbusy) {	// ON TIMER/EVENT: a handler's turn?
+			pos = onpoll(ctx,pos);
+			if (pos == ERROR_RETURN) return ERROR_RETURN;
+		}
+
+        #ifdef posix
+		if (ctx->prof) profline(ctx,pos);	// profile command: time this line
+        #endif
+
+        #ifdef arduino
+		if (ctx->slice && --ctx->slice == 0) {	// run & job: the prompt's turn
+			ctx->resume = pos;
+			return SLICE_RETURN;
+		}
+		/* stop on ^c (equiv in posix would be a signal) */
+        if (!ctx->background && Serial.available() > 0) {
+            char ch = Serial.read();
+            if (ch == 0x03) {   // ^C
+                Serial.print("\r\n^C Break.\r\n");
+                while (Serial.available());
+                return STOP_RETURN;
+            }
+        }
+        #endif
+
+
+		memset(basicline,0,MAXLINE);
+
+		/* get a line */
+		start = pos;
+		for (n=0; n<MAXLINE; n++) {
+			basicline[n] = ctx->buffer[pos];			// pos points to current byte in the buffer
+			if (ctx->buffer[pos] == '\n') break;		// and increments from 0 to the end of the buffer
+			pos++; if (pos >= ctx->position) break;	// being changed only by goto/gosub/return/for/next
+		}
+
+		if (pos++ >= ctx->position) {
+			//prout("no end statement\n\r");
+			if (ctx->curtask) {		// a spawned task ran off the end
+				pos = taskswitch(ctx,0,TASK_RETURN);
+				continue;
+			}
+			return NORMAL_RETURN;	// back to editor
+		}
+
+		if (basicline[n] == '\n') { // got line
+			res = parse(ctx,basicline);
+			if (res == NORMAL_RETURN) continue;	 // normal exit, next basic line
+			if (res == ERROR_RETURN) { 			 // error (err displayed in routine): exit to editor
+				sscanf(basicline,"%s ",linenum);	 // line # = atoi(linenum) 
+				if (ctx->trace) tracerecord(ctx,atoi(linenum),keywordid("error"));
+				prout(ctx,linenum);
+				prout(ctx,"\n");
+				return ERROR_RETURN;
+			}
+			if (res == END_RETURN) return res;	// got 'end' statement. done, return to editor
+			if (res == STOP_RETURN) return res;	// got 'stop' statement, done, return to editor
+			if (res == CALL_RETURN) return res;	// RETURN from a tb_call(), back to the host
+			if (res == LOOP_RETURN) return res;	// PFOR worker: share done, back to parse_pfor
+			if (res >= 0) {
+				pos = res;		// result is address of a line to jump to
+				continue;
+			}
+			if (res == YIELD_RETURN || res == TASK_RETURN) {	// next task's turn
+				pos = taskswitch(ctx,pos,res);
+				continue;
+			}
+			if (res == BLOCK_RETURN) {		// run this line again on its next turn
+				pos = taskswitch(ctx,start,res);
+				continue;
+			}
+		}
+
+		prout(ctx,ERR17);   // unexpected error
+		return ERROR_RETURN;
+	}
+}
+
+
+
+/* ************************************************************ */
+/* tasks: SPAWN starts another basic task in the same program.  */
+/* They share variables and arrays but each has its own gosub   */
+/* and for/next stacks. Switching is cooperative and round      */
+/* robin: only YIELD, WAIT, an INPUT with nothing to read, or   */
+/* the end of a task gives the interpreter to the next one, so  */
+/* a line always runs without another task getting in between. */
+/* No threads are used, so this works on the arduino too.       */
+/* ************************************************************ */
+
+/* taskclear - just the main program, nothing spawned */
+void taskclear(struct context *ctx) {
+	memset(ctx->tasks,0,sizeof(ctx->tasks));
+	ctx->tasks[0].live = 1;
+	ctx->curtask = 0;
+	ctx->livetasks = 1;
+	ctx->blocked = 0;
+	ctx->inputskip = 0;
+	ctx->wake = 0;
+	ctx->since = 0;
+}
+
+/* taskswitch - the running task stops (why is YIELD_RETURN, or    */
+/* BLOCK_RETURN with pos at the line to try again, or TASK_RETURN  */
+/* when it is done) and the next live one gets its stacks back.    */
+/* Returns the address the next task carries on from.              */
+int taskswitch(struct context *ctx, int pos, int why) {
+	struct task *t = &ctx->tasks[ctx->curtask];
+	int n;
+
+	if (why == TASK_RETURN) {
+		t->live = 0;
+		ctx->livetasks--;
+	}
+	else {
+		t->pos = pos;
+		t->foraddr = ctx->foraddr;
+		t->forvar = ctx->forvar;
+		t->tovar = ctx->tovar;
+		t->forstep = ctx->forstep;
+		memcpy(t->return_stack,ctx->return_stack,sizeof(t->return_stack));
+		t->return_stack_position = ctx->return_stack_position;
+		t->inputskip = ctx->inputskip;
+		t->wake = ctx->wake;
+		t->since = ctx->since;
+	}
+	if (why == BLOCK_RETURN) {
+		ctx->blocked++;
+		if (ctx->blocked >= ctx->livetasks) eventwait(ctx);	// nobody can go on yet
+	}
+	else ctx->blocked = 0;		// something moved on
+
+	for (n=1; n<=MAXTASKS; n++) {	// main (tasks[0]) is always live
+		t = &ctx->tasks[(ctx->curtask+n) % MAXTASKS];
+		if (t->live) break;
+	}
+	ctx->curtask = t - ctx->tasks;
+	ctx->foraddr = t->foraddr;
+	ctx->forvar = t->forvar;
+	ctx->tovar = t->tovar;
+	ctx->forstep = t->forstep;
+	memcpy(ctx->return_stack,t->return_stack,sizeof(ctx->return_stack));
+	ctx->return_stack_position = t->return_stack_position;
+	ctx->inputskip = t->inputskip;
+	ctx->wake = t->wake;
+	ctx->since = t->since;
+	return t->pos;
+}
+
+/* SPAWN line[,var] - start a task at line, its number goes in var */
+int parse_spawn(struct context *ctx, char option[]) {
+	char target[20]={};
+	char *var;
+	struct task *t;
+	int n, addr;
+
+	strncpy(target,option,sizeof(target)-1);
+	var = strchr(target,',');
+	if (var != NULL) {
+		*var++ = '\0';
+		if (*var < 'a' || *var > 'z' || var[1] != '\0') {
+			prout(ctx,ERR31);   // unknown variable
+			return ERROR_RETURN;
+		}
+	}
+	addr = setlinenumber(ctx,target,0);
+	if (addr == ERROR_RETURN) return ERROR_RETURN;
+
+	for (n=1; n<MAXTASKS; n++)
+		if (!ctx->tasks[n].live) break;
+	if (n == MAXTASKS) {
+		prout(ctx,ERR51);   // too many tasks
+		return ERROR_RETURN;
+	}
+	t = &ctx->tasks[n];
+	memset(t,0,sizeof(struct task));
+	for (int i=0; i<MAXRETURNSTACKPOS; i++)
+		t->return_stack[i] = -1;
+	t->pos = addr;
+	t->live = 1;
+	ctx->livetasks++;
+	if (var != NULL) ctx->intvar[*var-'a'] = n;
+	return NORMAL_RETURN;
+}
+
+/* WAIT [expr] - wait for task expr to finish, or with no task */
+/* given for every other task (main waiting for its workers)   */
+int parse_wait(struct context *ctx, char option[]) {
+	int id;
+
+	if (option[0] == '\0') {
+		if (ctx->livetasks == 1) return NORMAL_RETURN;	// nobody else left
+	}
+	else {
+		ctx->error = 0;
+		id = eval(ctx,option);
+		if (ctx->error) {
+			prout(ctx,ERR28);   // bad expression
+			return ERROR_RETURN;
+		}
+		if (id < 1 || id >= MAXTASKS || id == ctx->curtask || !ctx->tasks[id].live)
+			return NORMAL_RETURN;	// finished (or never was)
+	}
+	if (taskstuck(ctx)) {
+		prout(ctx,ERR52);   // all tasks waiting
+		return ERROR_RETURN;
+	}
+	return BLOCK_RETURN;
+}
+
+/* taskstuck - every task has been round twice with nothing moving */
+/* on. Not while a timer is set or a task is in DELAY: they will   */
+/* wake. When other threads share the channels they may yet, so    */
+/* then only when every program running is stuck too and no SEND  */
+/* or RECV has gone through since this one got stuck.              */
+int taskstuck(struct context *ctx) {
+	if (ctx->blocked < 2*ctx->livetasks || ctx->ntimers || tasksleep(ctx)) {
+		#ifdef posix
+		chanunstuck(ctx);
+		#endif
+		return 0;
+	}
+	if (!chanshared) return 1;
+	#ifdef posix
+	if (!ctx->chanwaits) {
+		ctx->chanseen = __atomic_load_n(&chanmoves,__ATOMIC_SEQ_CST);
+		ctx->chanwaits = 1;
+		__atomic_add_fetch(&chanstuck,1,__ATOMIC_SEQ_CST);
+		return 0;
+	}
+	// stuck count first: a program counted stuck after a SEND shows the SEND
+	if (__atomic_load_n(&chanstuck,__ATOMIC_SEQ_CST) < __atomic_load_n(&chanrunning,__ATOMIC_SEQ_CST))
+		return 0;
+	return __atomic_load_n(&chanmoves,__ATOMIC_SEQ_CST) == ctx->chanseen;
+	#else
+	return 0;
+	#endif
+}
+
+#ifdef posix
+/* chanunstuck - ctx is moving again (or stopping): not in chanstuck */
+void chanunstuck(struct context *ctx) {
+	if (!ctx->chanwaits) return;
+	ctx->chanwaits = 0;
+	__atomic_sub_fetch(&chanstuck,1,__ATOMIC_SEQ_CST);
+}
+#endif
+
+/* tasksleep - when the first task in DELAY/SLEEP wakes, 0 if none is */
+long long tasksleep(struct context *ctx) {
+	long long due = 0, w;
+	int n;
+
+	for (n=0; n<MAXTASKS; n++) {
+		if (!ctx->tasks[n].live) continue;
+		w = (n == ctx->curtask) ? ctx->wake : ctx->tasks[n].wake;
+		if (w && (due == 0 || w < due)) due = w;
+	}
+	return due;
+}
+
+/* eventwait - every task has blocked with nothing moving on: sleep  */
+/* until the first DELAY/SLEEP or ON TIMER is due, or a line comes   */
+/* in for a task in INPUT. On posix that is one poll() on the input  */
+/* with the time left as its timeout. Channels have no wakeup, so    */
+/* with one watched or shared it looks again every msec.             */
+void eventwait(struct context *ctx) {
+	long long due = tasksleep(ctx), wait;
+	int n, input = 0;
+
+	#ifdef arduino
+	if (ctx->slice) return;		// run &: the prompt waits, not the job
+	#endif
+	if (ctx->ntimers && (due == 0 || ctx->timers[0].due < due)) due = ctx->timers[0].due;
+	for (n=0; n<MAXTASKS; n++)
+		if (ctx->tasks[n].live && ctx->tasks[n].inputskip) input = 1;
+	if (due == 0 && !input) {	// only another thread can move things on
+		#ifdef posix
+		if (ctx->blocked > 100*ctx->livetasks) usleep(50);
+		else if (ctx->blocked > ctx->livetasks) sched_yield();
+		#endif
+		return;
+	}
+	wait = due ? due - clockms() : IDLEMAX;
+	if ((ctx->nevents || chanshared) && wait > 1) wait = 1;
+	if (wait > IDLEMAX) wait = IDLEMAX;
+	if (wait < 0) wait = 0;
+	#ifdef posix
+	struct pollfd pfd;
+	pfd.fd = fileno(ctx->in ? ctx->in : stdin);
+	pfd.events = POLLIN;
+	poll(&pfd,input,wait);
+	#endif
+	#ifdef arduino
+	while (wait-- > 0 && !(input && Serial.available())) delay(1);
+	#endif
+}
+
+/* inputwait - should INPUT give the other tasks a turn instead */
+/* of waiting for a line? Not if it's the only task and has no  */
+/* handlers, or if all of them are stuck with nothing to wake   */
+/* them (then it's fine to wait here).                          */
+int inputwait(struct context *ctx) {
+	int others = ctx->livetasks > 1 || (ctx->ntimers | ctx->nevents);
+
+	if (ctx->background || !others) return 0;
+	if (ctx->blocked >= ctx->livetasks && !tasksleep(ctx) && !(ctx->ntimers | ctx->nevents))
+		return 0;
+	#ifdef posix
+	return !inputready(ctx->in ? ctx->in : stdin);
+	#endif
+	#ifdef arduino
+	return Serial.available() == 0;
+	#endif
+}
+
+#ifdef posix
+/* inputready - would reading fp go on without waiting? Lines stdio */
+/* has already buffered don't make the fd readable, so try a getc   */
+/* with the fd non-blocking and put the char back. EOF or an error  */
+/* won't wait either.                                                */
+int inputready(FILE *fp) {
+	int fd = fileno(fp), flags, ch;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd,1,0) != 0) return 1;
+	flags = fcntl(fd,F_GETFL);
+	if (flags < 0) return 1;
+	fcntl(fd,F_SETFL,flags | O_NONBLOCK);
+	errno = 0;
+	ch = getc(fp);
+	if (ch == EOF && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		clearerr(fp);		// nothing there yet: not a real error
+		fcntl(fd,F_SETFL,flags);
+		return 0;
+	}
+	fcntl(fd,F_SETFL,flags);
+	if (ch != EOF) ungetc(ch,fp);
+	return 1;
+}
+#endif
+
+
+/* ************************************************************ */
+/* channels: SEND c,expr and RECV c,v. A full channel blocks    */
+/* SEND and an empty one blocks RECV, giving the other tasks    */
+/* (or threads) a turn until the line can go through.           */
+/* ************************************************************ */
+int parse_chan(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, option[MAXLINE]={}, temp[MAXLINE+2]={};
+char *p = temp;
+int args[2], n, var=0, ok;
+struct channel *c;
+
+	sscanf(line,"%s %s %s ",linenum,keyword,option);
+	if (strcmp(keyword,"recv")==0) {	// RECV c,v: v is a variable, not an expr
+		n = strlen(option);
+		if (n < 3 || option[n-2] != ',' || option[n-1] < 'a' || option[n-1] > 'z') {
+			prout(ctx,ERR27);   // bad format
+			return ERROR_RETURN;
+		}
+		var = option[n-1];
+		option[n-2] = '\0';
+	}
+	sprintf(temp,"(%s)",option);		// same form as function arguments
+	ctx->error = 0;
+	n = getargs(ctx,&p,args,2);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != (var ? 1 : 2)) {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	if (args[0] < 0 || args[0] >= MAXCHANNELS) {
+		prout(ctx,ERR53);   // bad channel
+		return ERROR_RETURN;
+	}
+	c = &channels[args[0]];
+	if (var) ok = chanrecv(c,&ctx->intvar[var-'a']);
+	else ok = chansend(c,args[1]);
+	if (ok) {
+		ctx->blocked = 0;
+		#ifdef posix
+		if (chanshared) {		// others waiting on it see something moved
+			chanunstuck(ctx);
+			__atomic_add_fetch(&chanmoves,1,__ATOMIC_SEQ_CST);
+		}
+		#endif
+		return NORMAL_RETURN;
+	}
+	if (taskstuck(ctx)) {		// nobody will ever SEND/RECV the other end
+		if (chanshared) prout(ctx,ERR59);   // channel deadlock
+		else prout(ctx,ERR52);   // all tasks waiting
+		return ERROR_RETURN;
+	}
+	return BLOCK_RETURN;		// full/empty: try again on the next turn
+}
+
+/* chansend - 1 if v went onto the channel, 0 if it is full */
+int chansend(struct channel *c, int v) {
+	unsigned int pos;
+
+	if (!chanshared) {		// spsc
+		pos = __atomic_load_n(&c->tail,__ATOMIC_RELAXED);
+		if (pos - __atomic_load_n(&c->head,__ATOMIC_ACQUIRE) == CHANSIZE) return 0;
+		c->val[pos & (CHANSIZE-1)] = v;
+		__atomic_store_n(&c->tail,pos+1,__ATOMIC_RELEASE);
+		return 1;
+	}
+	#ifdef posix
+	/* mpmc: claim the tail slot once its reader has finished with it */
+	unsigned int turn, slot;
+	pos = __atomic_load_n(&c->tail,__ATOMIC_RELAXED);
+	while (1) {
+		slot = pos & (CHANSIZE-1);
+		turn = __atomic_load_n(&c->turn[slot],__ATOMIC_ACQUIRE) + slot;
+		if (turn == pos) {
+			if (__atomic_compare_exchange_n(&c->tail,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;		// ours (a failed try reloads pos)
+		}
+		else if ((int)(turn - pos) < 0) return 0;	// a lap behind: full
+		else pos = __atomic_load_n(&c->tail,__ATOMIC_RELAXED);
+	}
+	c->val[slot] = v;
+	__atomic_store_n(&c->turn[slot],pos+1-slot,__ATOMIC_RELEASE);	// readers' turn
+	#endif
+	return 1;
+}
+
+/* chanrecv - 1 and the oldest value in *v, 0 if the channel is empty */
+int chanrecv(struct channel *c, int *v) {
+	unsigned int pos;
+
+	if (!chanshared) {		// spsc
+		pos = __atomic_load_n(&c->head,__ATOMIC_RELAXED);
+		if (pos == __atomic_load_n(&c->tail,__ATOMIC_ACQUIRE)) return 0;
+		*v = c->val[pos & (CHANSIZE-1)];
+		__atomic_store_n(&c->head,pos+1,__ATOMIC_RELEASE);
+		return 1;
+	}
+	#ifdef posix
+	/* mpmc: claim the head slot once its writer has filled it */
+	unsigned int turn, slot;
+	pos = __atomic_load_n(&c->head,__ATOMIC_RELAXED);
+	while (1) {
+		slot = pos & (CHANSIZE-1);
+		turn = __atomic_load_n(&c->turn[slot],__ATOMIC_ACQUIRE) + slot;
+		if (turn == pos+1) {
+			if (__atomic_compare_exchange_n(&c->head,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int)(turn - (pos+1)) < 0) return 0;	// not written yet: empty
+		else pos = __atomic_load_n(&c->head,__ATOMIC_RELAXED);
+	}
+	*v = c->val[slot];
+	__atomic_store_n(&c->turn[slot],pos+CHANSIZE-slot,__ATOMIC_RELEASE);	// next lap's writer
+	#endif
+	return 1;
+}
+
+/* chanready - 1 if a RECV on c would get a value now */
+int chanready(struct channel *c) {
+	unsigned int pos = __atomic_load_n(&c->head,__ATOMIC_ACQUIRE);
+
+	if (!chanshared) return pos != __atomic_load_n(&c->tail,__ATOMIC_ACQUIRE);
+	#ifdef posix
+	unsigned int slot = pos & (CHANSIZE-1);
+	return __atomic_load_n(&c->turn[slot],__ATOMIC_ACQUIRE) + slot == pos+1;
+	#endif
+	return 0;
+}
+
+
+/* ************************************************************ */
+/* ON TIMER / ON EVENT: handlers that run like a GOSUB slipped  */
+/* in between two lines, so a program doesn't have to sit in a  */
+/* loop polling the clock or a channel. The timers are a min-   */
+/* heap on their due time: execute() only looks at the top one  */
+/* and IDLE sleeps until it is due instead of spinning.         */
+/* ************************************************************ */
+
+/* clockms - a millisecond clock for the timers */
+long long clockms(void) {
+	#ifdef posix
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+	#endif
+	#ifdef arduino
+	return millis();
+	#endif
+}
+
+/* timerup - move timers[n] up the heap to its place */
+void timerup(struct context *ctx, int n) {
+	struct ontimer t = ctx->timers[n];
+
+	while (n > 0 && ctx->timers[(n-1)/2].due > t.due) {
+		ctx->timers[n] = ctx->timers[(n-1)/2];
+		n = (n-1)/2;
+	}
+	ctx->timers[n] = t;
+}
+
+/* timerdown - move timers[n] down the heap to its place */
+void timerdown(struct context *ctx, int n) {
+	struct ontimer t = ctx->timers[n];
+	int c;
+
+	while ((c = 2*n+1) < ctx->ntimers) {
+		if (c+1 < ctx->ntimers && ctx->timers[c+1].due < ctx->timers[c].due) c++;
+		if (t.due <= ctx->timers[c].due) break;
+		ctx->timers[n] = ctx->timers[c];
+		n = c;
+	}
+	ctx->timers[n] = t;
+}
+
+/* timerremove - take timers[n] out, the last one fills the gap */
+void timerremove(struct context *ctx, int n) {
+	ctx->timers[n] = ctx->timers[--ctx->ntimers];
+	if (n < ctx->ntimers) {
+		timerup(ctx,n);
+		timerdown(ctx,n);
+	}
+}
+
+/* ON TIMER expr GOSUB line - run line every expr msec (0 stops it) */
+/* ON TIMER OFF             - stop all the timers                   */
+/* ON EVENT expr GOSUB line - run line when channel expr has a value */
+/* ON EVENT expr OFF        - stop watching channel expr              */
+int parse_on(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, kind[8]={}, expr[MAXLINE]={}, word[8]={}, target[20]={};
+int n, value, addr=0;
+
+	n = sscanf(line,"%5s %7s %7s %s %7s %19s",linenum,keyword,kind,expr,word,target);
+	if (strcmp(kind,"timer")==0 && n == 4 && strcmp(expr,"off")==0) {
+		ctx->ntimers = 0;
+		return NORMAL_RETURN;
+	}
+	if ((strcmp(kind,"timer")!=0 && strcmp(kind,"event")!=0) ||
+		!((n == 6 && strcmp(word,"gosub")==0) || (n == 5 && strcmp(word,"off")==0))) {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	ctx->error = 0;
+	value = eval(ctx,expr);
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	if (n == 6) {
+		addr = setlinenumber(ctx,target,0);
+		if (addr == ERROR_RETURN) return ERROR_RETURN;
+	}
+
+	if (kind[0] == 't') {
+		for (n=0; n<ctx->ntimers; n++)		// new period for a line already timed
+			if (ctx->timers[n].addr == addr) {
+				timerremove(ctx,n);
+				break;
+			}
+		if (value <= 0) return NORMAL_RETURN;
+		if (ctx->ntimers == MAXTIMERS) {
+			prout(ctx,ERR58);   // too many timers
+			return ERROR_RETURN;
+		}
+		n = ctx->ntimers++;
+		ctx->timers[n].due = clockms() + value;
+		ctx->timers[n].period = value;
+		ctx->timers[n].addr = addr;
+		timerup(ctx,n);
+		return NORMAL_RETURN;
+	}
+
+	if (value < 0 || value >= MAXCHANNELS) {
+		prout(ctx,ERR53);   // bad channel
+		return ERROR_RETURN;
+	}
+	for (n=0; n<ctx->nevents; n++)
+		if (ctx->events[n].chan == value) break;
+	if (word[1] == 'f') {		// off
+		if (n < ctx->nevents) ctx->events[n] = ctx->events[--ctx->nevents];
+		return NORMAL_RETURN;
+	}
+	if (n == ctx->nevents) ctx->nevents++;
+	ctx->events[n].chan = value;
+	ctx->events[n].addr = addr;
+	return NORMAL_RETURN;
+}
+
+/* onpoll - called before the line at pos runs. If a timer is due */
+/* or a watched channel has a value, GOSUB its handler: pos is    */
+/* the return address. A handler is never cut into by another     */
+/* one; it is done when its gosub stack drops below where it was. */
+/* A DELAY or INPUT the task was in is put aside meanwhile, so the */
+/* handler's own don't take over its wake time.                    */
+int onpoll(struct context *ctx, int pos) {
+	char linenum[6]={};
+	long long now;
+	int n, c, addr = -1;
+	struct ontimer *t;
+
+	if (ctx->onbusy) {
+		if (ctx->tasks[ctx->ontask].live &&
+			(ctx->curtask != ctx->ontask || ctx->return_stack_position >= ctx->ondepth))
+			return pos;			// still in one
+		ctx->onbusy = 0;
+		if (ctx->tasks[ctx->ontask].live) {		// back in the DELAY/INPUT it cut into
+			ctx->wake = ctx->onwake;
+			ctx->since = ctx->onsince;
+			ctx->inputskip = ctx->oninputskip;
+		}
+	}
+
+	if (ctx->ntimers) {
+		now = clockms();
+		t = &ctx->timers[0];
+		if (t->due <= now) {
+			addr = t->addr;
+			t->due += t->period;
+			if (t->due <= now)	// fell behind: skip the runs it missed, keep the beat
+				t->due += ((now - t->due) / t->period + 1) * t->period;
+			timerdown(ctx,0);
+		}
+	}
+	for (n=0; addr < 0 && n<ctx->nevents; n++) {
+		c = (ctx->nextevent + n) % ctx->nevents;
+		if (chanready(&channels[ctx->events[c].chan])) {
+			addr = ctx->events[c].addr;
+			ctx->nextevent = c+1;
+		}
+	}
+	if (addr < 0) return pos;
+
+	if (ctx->return_stack_position + 1 > MAXRETURNSTACKPOS) {
+		prout(ctx,ERR25);   // stack full
+		sscanf((char *)ctx->buffer+pos,"%5s",linenum);
+		prout(ctx,linenum);
+		prout(ctx,"\n");
+		return ERROR_RETURN;
+	}
+	ctx->return_stack[ctx->return_stack_position++] = pos;
+	if (ctx->return_stack_position > ctx->stats.maxdepth)
+		ctx->stats.maxdepth = ctx->return_stack_position;
+	ctx->onbusy = 1;
+	ctx->ontask = ctx->curtask;
+	ctx->ondepth = ctx->return_stack_position;
+	ctx->onwake = ctx->wake;
+	ctx->onsince = ctx->since;
+	ctx->oninputskip = ctx->inputskip;
+	ctx->wake = ctx->since = ctx->inputskip = 0;
+	return addr;
+}
+
+/* IDLE - nothing to do until a handler runs: sleep till the next */
+/* timer is due, looking at the ON EVENT channels every msec. With */
+/* other tasks live it gives them the turn instead.                */
+int parse_idle(struct context *ctx) {
+	long long wait;
+
+	if (ctx->livetasks > 1) return YIELD_RETURN;
+	if (ctx->onbusy || (ctx->ntimers | ctx->nevents) == 0) return NORMAL_RETURN;
+	wait = ctx->ntimers ? ctx->timers[0].due - clockms() : 1;
+	if (ctx->nevents && wait > 1) wait = 1;
+	if (wait > IDLEMAX) wait = IDLEMAX;
+	if (wait <= 0) return NORMAL_RETURN;
+	#ifdef posix
+	usleep(wait*1000);
+	#endif
+	#ifdef arduino
+	delay(wait);
+	#endif
+	return NORMAL_RETURN;
+}
+
+/* DELAY msec, SLEEP sec - only this task waits when there are other  */
+/* tasks, handlers or (arduino) the prompt to serve: the line runs    */
+/* again each turn until its wake time, and while every task waits    */
+/* the scheduler sleeps in eventwait. With none of those it's a plain */
+/* sleep.                                                             */
+int parse_delay(struct context *ctx, int ms) {
+	long long now;
+
+	if (ctx->wake == 0) {
+		if (ms <= 0) return NORMAL_RETURN;
+		if (ctx->livetasks == 1 && (ctx->ntimers | ctx->nevents) == 0
+			#ifdef arduino
+			&& ctx->slice == 0
+			#endif
+			) {
+			#ifdef posix
+			if (ctx->background) {		// run & job: kill mustn't wait out the sleep
+				now = clockms();
+				for (long long end = now + ms; now < end; now = clockms()) {
+					if (__atomic_load_n(&ctx->killed,__ATOMIC_RELAXED)) break;	// execute() stops
+					usleep((end-now < IDLEMAX ? end-now : IDLEMAX)*1000);
+				}
+			}
+			else {
+				sleep(ms/1000);			// ms*1000 won't fit usleep's int past 35 minutes
+				usleep((ms%1000)*1000);
+			}
+			#endif
+			#ifdef arduino
+			delay(ms);
+			#endif
+			return NORMAL_RETURN;
+		}
+	}
+	now = clockms();
+	if (ctx->wake == 0) ctx->wake = now + ms;
+	if (now < ctx->wake) return BLOCK_RETURN;
+	ctx->wake = 0;
+	ctx->blocked = 0;		// moved on
+	return NORMAL_RETURN;
+}
+
+
+/* ********************** */
+/*** Instruction Parser ***/
+/* ********************** */
+int parse (struct context *ctx, char line[]) {	// parse the line, run the contents 
+	char linenum[6]={}, keyword[20]={}, option[60]={}, value[20]={};
+	int n;
+
+	sscanf(line,"%s %s %s %s ",linenum,keyword,option,value);
+	if (strlen(line) == 1) return NORMAL_RETURN;	// ignore blank lines
+
+	n = keywordid(keyword);
+	ctx->stats.statements[n]++;
+	if (ctx->trace) tracerecord(ctx,atoi(linenum),n);
+
+	ctx->stats.line = atoi(linenum);
+	if (ctx->stats.line == 0) {
+		prout(ctx,ERR6);    // line number error
+		return ERROR_RETURN;
+	}
+	if (ctx->cover && (unsigned int)ctx->stats.line <= MAXLINENUMBER)	// cover: this line ran
+		ctx->cover[ctx->stats.line >> 3] |= 1 << (ctx->stats.line & 7);
+
+	ctx->error = 0;		// initialize before each line
+	/* test keyword */
+	if (strcmp(keyword,"end")==0) {		// END
+		if (ctx->curtask) return TASK_RETURN;	// ends just a spawned task
+		prout(ctx,ERR18);   // end of line
+		prout(ctx,linenum);
+		prout(ctx,"\r\n");
+		return END_RETURN;
+	}
+
+    #ifdef posix
+	if (strcmp(keyword,"exit")==0) {	// EXIT
+		if (ctx->hosted) return END_RETURN;	// don't take the host down with us
+		prout(ctx,"\n");
+		statsexit(ctx);
+		coverexit(ctx);
+		#ifndef library
+		metricsstop();			// take the socket away
+		#endif
+		exit(0);
+	}
+    #endif
+
+	if (strcmp(keyword,"stop")==0) {	// STOP
+		prout(ctx,ERR19);   // stop at line
+		prout(ctx,linenum);
+		prout(ctx,"\r\n");
+		return STOP_RETURN;
+	}
+
+	if (strcmp(keyword,"rem")==0) {		// REM
+		return NORMAL_RETURN;	// ignore rest of line 
+	}
+
+	if (strcmp(keyword,"dim")==0) {		// DIM
+		if (option[0] >= 'a' && option[0] <= 'z' && option[1] == '(')
+			return dimnamed(ctx,option);		// DIM a(n,m),b(n)
+		if (ctx->arraymax > 0) {	// we already did this
+			prout(ctx,ERR20);   // array re-dim
+			return ERROR_RETURN;
+		}
+		ctx->error = 0;
+		if (strcmp(option,"sparse")==0) {	// DIM SPARSE [default]
+			ctx->sparsedefault = 0;
+			if (strlen(value) > 0)
+				ctx->sparsedefault = eval(ctx,value);	// value of unassigned elements
+			if (ctx->error) {
+				prout(ctx,ERR28);   // bad expression
+				return ERROR_RETURN;
+			}
+			ctx->sparsemode = 1;
+			ctx->arraymax = INT_MAX;		// any index 0 thru 2^31-2
+			return NORMAL_RETURN;
+		}
+		int res = eval(ctx,option);		// get size of array
+		if (ctx->error) {
+			prout(ctx,ERR21);   // array size error
+			return ERROR_RETURN;
+		}
+		if (res < 1) {
+			prout(ctx,ERR22);   // dim - no action taken
+			return ERROR_RETURN;
+		}
+		if (res > ARRAYMAX) {
+			prout(ctx,ERR21);   // array size 
+			return ERROR_RETURN;
+		}
+		ctx->intarray = (int*) malloc(res * sizeof(int));
+		if (ctx->intarray == NULL) {
+			prout(ctx,ERR24);   // out of memory
+			return ERROR_RETURN;
+		}
+		ctx->arraymax = res;
+		return NORMAL_RETURN;
+	}
+
+	if (strcmp(keyword,"goto")==0) {	// GOTO
+		int result = setlinenumber(ctx,option,0);					// return the address of the line to goto
+		if (result == ERROR_RETURN) return ERROR_RETURN;		// line # not found
+		return result;	// return address of line
+	}
+
+	if (strcmp(keyword,"gosub")==0) {	// GOSUB
+		int res = setlinenumber(ctx,linenum,1);		// get addr of line after linenum
+		if (res == ERROR_RETURN) return ERROR_RETURN;
+		if (ctx->return_stack_position + 1 > MAXRETURNSTACKPOS) {
+			prout(ctx,ERR25);   // stack full
+			return ERROR_RETURN;
+		}
+		ctx->return_stack[ctx->return_stack_position++] = res;	// save return address on stack
+		if (ctx->return_stack_position > ctx->stats.maxdepth)
+			ctx->stats.maxdepth = ctx->return_stack_position;
+		res = setlinenumber(ctx,option,0);  				// get address of linenumber following gosub
+        if (res == ERROR_RETURN) return ERROR_RETURN;
+        return res; // gosub new address
+	}
+
+	if (strcmp(keyword,"return")==0) {	// RETURN
+		if (ctx->return_stack_position < 1) {
+			if (ctx->curtask) return TASK_RETURN;	// spawned task is done
+			prout(ctx,ERR26);   // return w/o gosub
+			return ERROR_RETURN;
+		}
+		int res = ctx->return_stack[--ctx->return_stack_position];		// pop the return address
+		if (res == ERROR_RETURN) return ERROR_RETURN;
+		return res;
+	}
+
+	if (strcmp(keyword,"spawn")==0) {	// SPAWN
+		return parse_spawn(ctx,option);
+	}
+
+	if (strcmp(keyword,"yield")==0) {	// YIELD
+		return YIELD_RETURN;
+	}
+
+	if (strcmp(keyword,"wait")==0) {	// WAIT
+		return parse_wait(ctx,option);
+	}
+
+	if (strcmp(keyword,"send")==0 || strcmp(keyword,"recv")==0) {	// SEND RECV
+		return parse_chan(ctx,line);
+	}
+
+	if (strcmp(keyword,"on")==0) {		// ON TIMER/EVENT
+		return parse_on(ctx,line);
+	}
+
+	if (strcmp(keyword,"idle")==0) {	// IDLE
+		return parse_idle(ctx);
+	}
+
+    #ifdef posix
+	if (strcmp(keyword,"sleep")==0) {	// SLEEP
+		long long t = traceus();
+		n = atoi(option);
+		if (n > INT_MAX/1000) {		// no room for it in msec
+			prout(ctx,ERR27);   // bad format
+			return ERROR_RETURN;
+		}
+		return latency(ctx,LATDELAY,t,parse_delay(ctx,n*1000));		// in integer seconds
+	}
+    #endif
+
+
+	if (strcmp(keyword,"clear")==0) {	// CLEAR
+		for (unsigned char ch='a'; ch <= 'z'; ch++)
+			ctx->intvar[ch-'a']=0;			// clear all integer variables
+		
+		arrayfree(ctx);
+		hashfree(&ctx->hashmap);
+        
+        // clear the string variables
+        memset(ctx->textvar,0,26*MAXLINE);
+		
+		return NORMAL_RETURN;
+	}
+
+	if (strcmp(keyword,"fill")==0 || strcmp(keyword,"copy")==0 ||	// FILL COPY
+		strcmp(keyword,"add")==0 || strcmp(keyword,"sub")==0 ||		// ADD SUB
+		strcmp(keyword,"mul")==0 || strcmp(keyword,"mask")==0) {	// MUL MASK
+		return parse_vector(ctx,line);
+	}
+
+	if (strcmp(keyword,"put")==0 || strcmp(keyword,"del")==0) {	// PUT DEL
+		return parse_map(ctx,line);
+	}
+
+	if (strcmp(keyword,"sort")==0) {		// SORT
+		return parse_sort(ctx,option);
+	}
+
+	if (strcmp(keyword,"atomic")==0) {		// ATOMIC
+		return parse_atomic(ctx,line);
+	}
+
+	if (strcmp(keyword,"let")==0) {		// LET
+		int res = parse_let(ctx,line);
+		return res;
+		return parse_let(ctx,line);
+	}
+
+	if (strcmp(keyword,"print")==0) {	// PRINT
+		return parse_print(ctx,line);
+	}
+
+	if (strcmp(keyword,"input")==0) {	// INPUT
+		long long t = traceus();
+		return latency(ctx,LATINPUT,t,parse_input(ctx,line));
+	}
+
+	if (strcmp(keyword,"if")==0) {		// IF
+		int res = parse_if(ctx,line);
+		return res;
+		return parse_if(ctx,line);
+	}
+
+	if (strcmp(keyword,"for")==0) {		// FOR
+		return parse_for(ctx,line);
+	}
+
+	if (strcmp(keyword,"next")==0) {	// NEXT
+		return parse_next(ctx,line);
+	}
+
+	if (strcmp(keyword,"pfor")==0) {	// PFOR
+		return parse_pfor(ctx,line);
+	}
+
+
+    if (strcmp(keyword,"fileopen")==0) {    // FILEOPEN
+        return fileopen(ctx,option,value);
+    }
+
+    if (strcmp(keyword,"fileclose")==0) {    // FILECLOSE
+        return fileclose(ctx);
+    }
+
+
+    if (strcmp(keyword,"filewrite")==0) {   // FILEWRITE
+        long long t = traceus();
+        return latency(ctx,LATFILEWRITE,t,filewrite(ctx,line));
+    }
+
+    if (strcmp(keyword,"fileread")==0) {    // FILEREAD
+        long long t = traceus();
+        return latency(ctx,LATFILEREAD,t,fileread(ctx,line));
+    }
+
+
+    if (strcmp(keyword,"delay")==0) {       // DELAY
+        int res = 0;
+        if (option[0] >= 'a' && option[0] <= 'z')
+            res = ctx->intvar[option[0] - 'a'];
+        else
+            res = atoi(option);
+        long long t = traceus();
+        return latency(ctx,LATDELAY,t,parse_delay(ctx,res));     // in msec
+    }
+
+
+	/* arduino specific statements */
+    #ifdef arduino
+
+	/* pinset pin# - set digital pin to 1 */
+	if (strcmp(keyword,"pinset")==0) {		// PINSET
+		int res=0;
+		if (option[0] >= 'a' && option[0] <= 'z') 
+			res = ctx->intvar[option[0] - 'a'];
+		else
+			res = atoi(option);
+		pinMode(res,OUTPUT);
+		digitalWrite(res,1);
+		return NORMAL_RETURN;
+	}
+
+	/* pinclr pin# - set digital pin to 0 */
+	if (strcmp(keyword,"pinclr")==0) {		// PINCLR
+        int res=0;    
+		if (option[0] >= 'a' && option[0] <= 'z') 
+            res = ctx->intvar[option[0] - 'a'];
+        else
+            res = atoi(option);
+		pinMode(res,OUTPUT);
+		digitalWrite(res,0);
+		return NORMAL_RETURN;
+	}
+
+	#endif  /* end of arduino specific statements */
+
+    
+    
+	
+
+	prout(ctx,ERR2);    // syntax in line
+	return ERROR_RETURN;
+}
+
+
+/* ********* */
+/*    LET    */
+/* ********* */
+int parse_let(struct context *ctx, char line[]) {
+char *p;
+char linenum[6];
+char temp[20]={};
+int cnt=0;
+
+	sscanf(line,"%s ",linenum);
+	if (atoi(linenum)==0) {
+		prout(ctx,ERR6);    // bad linenumber
+		return ERROR_RETURN;
+	}
+
+	p = strstr(line,"let");
+	if (p == NULL) {
+		prout(ctx,ERR27);    // bad format
+		return ERROR_RETURN;
+	}
+
+	while (*p++ != ' ');	// point to 1st non-blank char after 'let'
+	cnt = 0;
+
+	while (1) {
+		if (*p == '\n' || *p == '\0') return NORMAL_RETURN;
+
+		if (*p == ',') {
+            p++;
+            continue;
+        }
+		
+		if (*p == ' ') {
+            p++;
+            continue;
+        }
+
+        // assign string variable
+        if (*p >= 'a' && *p <= 'z' && *(p+1)=='$') {
+            if (*(p+2) != '=' && *(p+3) != '"') { 
+                prout(ctx,ERR2);        // syntax error
+                return ERROR_RETURN;   
+            }
+            char tline[MAXLINE]={}; // hold string here
+            int indx=0;
+            char *st = p+4;  // get everything between double quotes
+            while (*st != '"') 
+                tline[indx++] = *st++; 
+            strcpy(ctx->textvar[*p-'a'],tline);  // save var
+            while (*p != '\n') p++;
+            continue;
+        }
+
+		// set named array element
+		if (*p >= 'a' && *p <= 'z' && *(p+1) == '(') {
+			struct namedarray *a = &ctx->arrays[*p - 'a'];
+			p++;
+			ctx->error = 0;
+			int index = arrayoffset(ctx,&p,a);	// p now points past )
+			if (ctx->error) return ERROR_RETURN;
+			if (*p != '=') {
+				prout(ctx,ERR2);    // syntax error
+				return ERROR_RETURN;
+			}
+			p++;
+			int res = eval(ctx,p);
+			if (ctx->error) {
+				prout(ctx,ERR28);   // bad expression
+				return ERROR_RETURN;
+			}
+			a->data[index] = res;
+			p = skipexpr(p);
+			continue;
+		}
+
+		// assign integer variable
+		if (*p >= 'a' && *p <= 'z') {
+			ctx->intvar[*p -'a'] = eval(ctx,p+2);
+			if (ctx->error) {
+				prout(ctx,ERR28);   // bad expression
+				return ERROR_RETURN;
+			}
+            if (*(p+1) != '=') {
+                prout(ctx,ERR2);    // syntax error
+                return ERROR_RETURN;
+            }
+			p = skipexpr(p+2);		// point past value
+			continue;
+		}
+
+		// set array value
+		if (*p == '@' ) {
+			p++;
+			if (*p != '(') {
+				prout(ctx,ERR29);   // bad array
+				return ERROR_RETURN;
+			}
+			p++;	// point to start of expr
+			ctx->error = 0;
+			cnt=0;
+			memset(temp,0,20);
+			while (*p != ')') {
+				if (cnt > 15) {		// beware overflow
+					prout(ctx,ERR23);
+					ctx->error = 1;
+					return ERROR_RETURN;
+				}
+				temp[cnt++]=*p++;
+			}
+			temp[cnt]='\n';		// temp holds value (num/var a-z) between()
+			int index=eval(ctx,temp);	// index is array index
+			if (ctx->error) {
+				prout(ctx,ERR2);
+				return ERROR_RETURN;
+			}
+			if (*p != ')') prout(ctx,"missing )");  // replace this w/syntax error
+			p++;
+			if (*p != '=') prout(ctx,"missing =");
+			p++;
+			int res = eval(ctx,p);
+			if (ctx->error) {
+				prout(ctx,ERR2);
+				return ERROR_RETURN;
+			}
+			if (arrayput(ctx,index,res) == ERROR_RETURN)
+				return ERROR_RETURN;
+			p = skipexpr(p);	// step p until *p=\n or ,
+			continue;
+		}
+
+		prout(ctx,ERR2);    // syntax in line
+		return ERROR_RETURN;
+	}
+
+	prout(ctx,ERR2);    // syntax in line
+	return ERROR_RETURN;
+}
+
+
+/* ********** */
+/*     IF     */
+/* ********** */
+int parse_if(struct context *ctx, char line[]) {
+	char linenum[6]={}, keyword[20]={}, expression[20]={}, wordthen[20]={}, newline[20]={};
+	sscanf(line,"%s %s %s %s %s ",linenum,keyword,expression,wordthen,newline);
+	int res = 0;
+
+	/* 
+	 * format: 
+	 * if [expression] [then/goto/gosub] [line#] 
+	 * if [expression] [return/stop]
+	 *
+	 */ 	
+
+	res = evallogic(ctx,expression);
+	if (ctx->error) {
+		return ERROR_RETURN;
+	}
+
+	if (!res) // returned FALSE
+		return NORMAL_RETURN;
+	else {	// goto line number 'newline'
+		if ((strcmp(wordthen,"then")==0) || (strcmp(wordthen,"goto")==0)) {
+			int result = setlinenumber(ctx,newline,0);                  // return the address of the line
+        	if (result == ERROR_RETURN) return ERROR_RETURN;        // line # not found
+        	return result;  										// return address of line
+		}
+		if (strcmp(wordthen,"gosub")==0) {
+			int res = setlinenumber(ctx,linenum,1);						// get address of next line
+			if (res == ERROR_RETURN) return ERROR_RETURN;			// non-existant #
+			if (ctx->return_stack_position + 1 > MAXRETURNSTACKPOS) {	// test stack
+				prout(ctx,ERR25);   // stack full
+				return ERROR_RETURN;
+			}
+			ctx->return_stack[ctx->return_stack_position++] = res;			// push return addr on stack
+			res = setlinenumber(ctx,newline,0);							// get address of dest line
+			if (res == ERROR_RETURN) return ERROR_RETURN;			// bad line number
+			return res;												// jump to new line
+		}
+		if (strcmp(wordthen,"return")==0) {
+			if (ctx->return_stack_position < 1) {
+				if (ctx->curtask) return TASK_RETURN;	// spawned task is done
+				prout(ctx,ERR26);   // return w/o gosub
+				return ERROR_RETURN;
+			}
+			int res = ctx->return_stack[--ctx->return_stack_position];		// get return address
+			if (res == ERROR_RETURN) return ERROR_RETURN;
+			return res;												// jump back
+		}
+		if (strcmp(wordthen,"stop")==0) {
+			prout(ctx,ERR19);   // stopped at line
+			return STOP_RETURN;
+		}
+
+
+		prout(ctx,ERR2);    // syntax in line
+		return ERROR_RETURN;
+	}
+	prout(ctx,ERR17);   // unknown error in line
+	return ERROR_RETURN;
+}
+
+
+/* *********** */
+/*    FOR      */
+/* *********** */
+int parse_for(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[6]={}, expr[12]={}, key2[6]={}, final[12]={}, key3[6]={}, stepsize[12]={};
+char *p;
+int res=0;
+	/* ex: 10 for n=1 to 10 step 1 */
+	/* the for part of a for/next loop just sets up the variables  */
+	/* global vars: foraddr (ret address) (int)intvar[n] (ch)forvar (int)tovar  (int)forstep */
+	sscanf(line,"%s %s %s %s %s %s %s ",linenum,keyword,expr,key2,final,key3,stepsize);
+	
+	/* get forvar */
+	expr[strlen(expr)]='\n';
+	/* test for 1st variable */
+	if (!(*expr >= 'a' && *expr <= 'z')) {
+		prout(ctx,ERR2);
+		return ERROR_RETURN;
+	}
+
+	p=strchr(expr,'=');		// point to =
+	p++;
+	ctx->error = 0;
+	res = eval(ctx,p);			// return value of var to start with
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	if (expr[0] >= 'a' && expr[0] <= 'z') {
+		ctx->forvar = expr[0];
+		ctx->intvar[(unsigned char)ctx->forvar-'a'] = res;
+	}
+	
+	/* get final var */
+	final[strlen(final)]='\n';
+	res = eval(ctx,final);
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	ctx->tovar = res;
+	
+	/* get step size */
+	if (atoi(stepsize)==0) 
+		res = 1;
+	else {
+		stepsize[strlen(stepsize)] = '\n';
+		res = eval(ctx,stepsize);
+	}
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	if (res == 0) 
+		ctx->forstep = 1;
+	else
+		ctx->forstep = res;
+
+	/* set return address */
+	res = setlinenumber(ctx,linenum,1);
+	if (res == ERROR_RETURN) return ERROR_RETURN;
+	ctx->foraddr = res;
+
+	return NORMAL_RETURN;
+}
+
+
+/* ************* */
+/*     NEXT      */
+/* ************* */
+int parse_next(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, var[4]={};
+int res=0;
+char varname;
+
+
+	sscanf(line,"%s %s %s ",linenum,keyword,var);
+
+	/* get var to test */
+	varname = var[0];
+	if (!(varname >= 'a' && varname <= 'z')) {
+		prout(ctx,ERR31);   // bad variable
+		return ERROR_RETURN;
+	}
+	if (varname != ctx->forvar) {
+		prout(ctx,ERR32);   // next w/o for
+		return ERROR_RETURN;
+	}
+
+	/* get the next var, add (subtract) it and save it */
+	res = ctx->intvar[(unsigned char)varname-'a'];
+	res += ctx->forstep;
+	ctx->intvar[(unsigned char)varname-'a'] = res;
+	
+	/* if counting up  */
+	if (ctx->forstep > 0) {
+		if (res > ctx->tovar) {
+			if (ctx->pfor) return LOOP_RETURN;	// PFOR worker: share done
+			ctx->forvar = '\0';	// clear for vars
+			ctx->forstep = 0;
+			ctx->foraddr = 0;
+			ctx->tovar = 0;
+			return setlinenumber(ctx,linenum,1);
+		}
+		else
+			return ctx->foraddr;
+	}
+	
+	/* if counting down */
+	if (ctx->forstep < 0) {
+		if (res < ctx->tovar) {
+			if (ctx->pfor) return LOOP_RETURN;	// PFOR worker: share done
+			ctx->forvar = '\0';	// clear for vars
+			ctx->forstep = 0;
+			ctx->foraddr = 0;
+			ctx->tovar = 0;
+			return setlinenumber(ctx,linenum,1);
+		}
+		else
+			return ctx->foraddr;
+	}
+	prout(ctx,ERR33);   // unexpected next error
+	return ERROR_RETURN;
+
+}
+
+
+
+/* ************* */
+/*     PFOR      */
+/* ************* */
+/* PFOR v=a TO b STEP s ... NEXT v is a FOR loop whose iterations    */
+/* are split over several threads. Each worker runs its share with   */
+/* its own copy of the variables a-z and a$-z$, sharing @() and the  */
+/* named arrays. Afterwards the variables are what the last          */
+/* iteration left, and v is what a FOR loop would leave. Loops too   */
+/* short to be worth it, bodies with statements that can't run side  */
+/* by side, and the arduino run it as an ordinary FOR.               */
+#ifdef posix
+struct pforjob {
+	struct context *ctx;	// worker: a copy of the context
+	int addr;				// first line of the body
+	int res;				// what execute() stopped with
+};
+
+void *pforthread(void *arg) {
+	struct pforjob *job = (struct pforjob *)arg;
+	job->res = execute(job->ctx,job->addr);
+	return NULL;
+}
+#endif
+
+int parse_pfor(struct context *ctx, char line[]) {
+	int res;
+
+	res = parse_for(ctx,line);		// start, TO, STEP and the body address
+	if (res != NORMAL_RETURN) return res;
+
+	#ifdef posix
+	struct pforjob job[PFORMAX];
+	pthread_t tid[PFORMAX];
+	char var = ctx->forvar;
+	int start = ctx->intvar[var-'a'], step = ctx->forstep;
+	int threads, cont, safe = 1, n;
+	long long count, first, last;
+
+	cont = pforbody(ctx,ctx->foraddr,var,&safe);	// line after the NEXT
+	if (cont == ERROR_RETURN) return ERROR_RETURN;
+
+	/* iterations a FOR loop would make (it always makes one) */
+	if (step > 0) count = (start > ctx->tovar) ? 1 : ((long long)ctx->tovar - start) / step + 1;
+	else count = (start < ctx->tovar) ? 1 : ((long long)start - ctx->tovar) / -(long long)step + 1;
+
+	threads = __atomic_load_n(&pforcores,__ATOMIC_RELAXED);
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1) threads = 1;
+		__atomic_store_n(&pforcores,threads,__ATOMIC_RELAXED);
+	}
+	if (threads > PFORMAX) threads = PFORMAX;
+	if (threads > count / PFORMIN) threads = count / PFORMIN;
+	if (!safe || ctx->sparsemode || ctx->prog->index == NULL || threads < 2)
+		return NORMAL_RETURN;		// run it as a FOR: NEXT does the rest
+
+	/* deal out the range: worker n gets iterations first..last */
+	for (n=0; n<threads; n++) {
+		job[n].ctx = (struct context *)malloc(sizeof(struct context));
+		if (job[n].ctx == NULL) {
+			while (n-- > 0) free(job[n].ctx);
+			return NORMAL_RETURN;		// no memory to split it: FOR
+		}
+		memcpy(job[n].ctx,ctx,sizeof(struct context));
+		first = count * n / threads;
+		last = count * (n+1) / threads - 1;
+		job[n].ctx->intvar[var-'a'] = start + first * step;
+		job[n].ctx->tovar = start + last * step;
+		job[n].ctx->pfor = 1;
+		job[n].ctx->return_stack_position = 0;
+		job[n].ctx->ntimers = job[n].ctx->nevents = 0;	// handlers stay with the program
+		job[n].ctx->prof = NULL;	// profile times the PFOR line as a whole
+		job[n].ctx->trace = 0;		// and trace has it as one line
+		memset(&job[n].ctx->stats,0,sizeof(struct stats));	// added back after the join
+		if (ctx->cover)		// own bitmap: threads or-ing one byte would race
+			job[n].ctx->cover = (unsigned char *)calloc(COVERBYTES,1);
+		taskclear(job[n].ctx);
+		job[n].addr = ctx->foraddr;
+	}
+	for (n=1; n<threads; n++)
+		if (pthread_create(&tid[n],NULL,pforthread,&job[n]) != 0) {
+			pforthread(&job[n]);		// no thread: do it ourselves
+			tid[n] = 0;
+		}
+	pforthread(&job[0]);
+	res = NORMAL_RETURN;
+	for (n=0; n<threads; n++) {
+		if (n > 0 && tid[n] != 0) pthread_join(tid[n],NULL);
+		if (job[n].res != LOOP_RETURN) res = ERROR_RETURN;	// error, or left the body
+	}
+
+	/* variables as the last iteration left them, v one step past */
+	memcpy(ctx->intvar,job[threads-1].ctx->intvar,sizeof(ctx->intvar));
+	memcpy(ctx->textvar,job[threads-1].ctx->textvar,sizeof(ctx->textvar));
+	ctx->intvar[var-'a'] = (int)(start + count * step);
+	for (n=0; n<threads; n++) {
+		statsadd(&ctx->stats,&job[n].ctx->stats);
+		if (ctx->cover && job[n].ctx->cover)
+			for (int b=0; b<COVERBYTES; b++) ctx->cover[b] |= job[n].ctx->cover[b];
+		free(job[n].ctx->cover);
+		free(job[n].ctx);
+	}
+	ctx->forvar = '\0';		// clear for vars
+	ctx->forstep = 0;
+	ctx->foraddr = 0;
+	ctx->tovar = 0;
+	if (res == ERROR_RETURN) {
+		prout(ctx,ERR54);   // pfor failed
+		return ERROR_RETURN;
+	}
+	return cont;
+	#endif
+
+	return NORMAL_RETURN;		// arduino: an ordinary FOR
+}
+
+/* pforbody - find the NEXT v that closes the PFOR body starting at */
+/* addr and return the address of the line after it. *safe is      */
+/* cleared if the body has a statement that can't run on several   */
+/* threads at once (shared files, the map, tasks, channels etc).   */
+/* A GOSUB or GOTO (an IF's too) also makes it serial: the lines it */
+/* reaches are not scanned.                                         */
+int pforbody(struct context *ctx, int addr, char var, int *safe) {
+	static const char *serial[] = {"put","del","dim","clear","sort","spawn","yield",
+		"wait","send","recv","input","fileopen","fileclose","fileread","filewrite",
+		"pfor","for","end","stop","exit","on","idle","gosub","goto","return",NULL};
+	char basicline[MAXLINE]={}, linenum[6], keyword[20], option[60];
+	int n;
+
+	while ((unsigned int)addr < ctx->position) {
+		for (n=0; n<MAXLINE-1 && (unsigned int)(addr+n) < ctx->position && ctx->buffer[addr+n] != '\n'; n++)
+			basicline[n] = ctx->buffer[addr+n];
+		basicline[n] = '\0';
+		addr += n+1;
+		keyword[0] = option[0] = '\0';
+		sscanf(basicline,"%5s %19s %59s",linenum,keyword,option);
+		if (strcmp(keyword,"next")==0 && option[0] == var) return addr;
+		for (n=0; serial[n] != NULL; n++)
+			if (strcmp(keyword,serial[n])==0) *safe = 0;
+		if (strstr(basicline," goto ") || strstr(basicline," gosub ")) *safe = 0;
+	}
+	prout(ctx,ERR55);   // pfor without next
+	return ERROR_RETURN;
+}
+
+
+/* *********** */
+/*    INPUT    */
+/* *********** */
+int parse_input(struct context *ctx, char line[]) {
+	char *p;
+	char lineno[6]={};
+	sscanf(line,"%s ",lineno);	// get line number for error messages
+	char temp[MAXLINE]={};
+
+	p = strstr(line,"input");
+	if (p == NULL) {
+		prout(ctx,ERR27);   // bad format in line
+		return ERROR_RETURN;
+	}
+
+	while (*p++ != ' ');		// point to 1st non-blank after 'input'
+	if (ctx->inputskip) {		// blocked last time: prompts are already out
+		p = line + ctx->inputskip;
+		ctx->inputskip = 0;
+	}
+
+	while (1) {		// input loop
+		if (*p == '\n') return NORMAL_RETURN;
+
+		if (*p == ',') {
+			prout(ctx,"   ");
+			p++;
+			continue;
+		}
+
+		if (*p == ';') {		// do-nothing
+			p++;
+			continue;
+		}
+
+		if (*p == ' ') {		// ignore spaces
+			p++;
+			continue;
+		}
+
+		if (*p == '"') {        // double quotes - print everything until next double quotes
+            p++;
+            while (1) {
+                if (*p == '"') break;
+                sprintf(ctx->printmessage,"%c",*p);
+				prout(ctx,ctx->printmessage);
+                p++;
+            }
+            p++;        // increment past "
+            continue;
+        }
 
         // assign string variable
-        if (*p >= 'a' && *p <= 'z' && *(p+1)=='$') {
-            if (*(p+2) != '=' && *(p+3) != '"') { 
-                prout(ERR2);        // syntax error
-                return ERROR_RETURN;   
+        if (*p >= 'a' && *p <= 'z' && *(p+1)=='$') { 
+            if (inputwait(ctx)) {		// let other tasks run meanwhile
+                ctx->inputskip = p - line;
+                return BLOCK_RETURN;
+            }
+            memset(temp,0,MAXLINE);
+			if (ctx->background)
+				temp[0] = '\n';		// run &: the keyboard is the prompt's
+			else {
+			#ifdef arduino
+			sgets(temp);
+			#endif
+			#ifdef posix
+			if (fgets(temp,MAXLINE,ctx->in ? ctx->in : stdin) == NULL)
+				temp[0] = '\n';		// end of input reads as an empty line
+			#endif
+			}
+            // strip off the \n
+            if (strlen(temp) > 0) temp[strlen(temp)-1]='\0';
+            strcpy(ctx->textvar[*p-'a'],temp);  // save var
+            ctx->blocked = 0;
+            p+=2;
+            continue;
+        }
+
+
+		// load an integer variable
+		if (*p >= 'a' && *p <= 'z') {
+			if (inputwait(ctx)) {		// let other tasks run meanwhile
+				ctx->inputskip = p - line;
+				return BLOCK_RETURN;
+			}
+			memset(temp,0,MAXLINE);
+			if (ctx->background)
+				temp[0] = '\n';		// run &: reads as 0
+			else {
+			#ifdef posix
+			if (fgets(temp,11,ctx->in ? ctx->in : stdin) == NULL)
+				temp[0] = '\n';		// end of input reads as 0
+			#endif
+
+			#ifdef arduino 
+			sgets(temp); 
+			#endif
+			}
+
+			ctx->intvar[(unsigned char)*p-'a'] = atoi(temp);
+			ctx->blocked = 0;
+			p++;
+			continue;
+		}
+
+		prout(ctx,ERR2);    // syntax error in line
+		return ERROR_RETURN;
+	}
+	prout(ctx,ERR17);   // unexpected error in line
+	return ERROR_RETURN;
+}
+
+
+/* ******** */
+/* FILEOPEN */
+/* ******** */
+int fileopen(struct context *ctx, char fname[],char mode[]) {
+// open a file for fileread, filewrite. Error if already open.
+    if (strlen(fname)==0) {
+        prout(ctx,ERR34);       // usage:
+        return ERROR_RETURN;
+    }
+    
+    // open a file for read/append
+#ifdef posix
+	if (ctx->diskfile != NULL) {
+		prout(ctx,ERR35);	// file already open
+		return ERROR_RETURN;
+	}
+	if (mode[0] == 'w' || mode[0] == 'W')
+		ctx->diskfile = fopen(fname,"a");
+	else if (mode[0] == 'r' || mode[0] == 'R')
+		ctx->diskfile = fopen(fname,"r");
+	else {
+		prout(ctx,ERR36);	// bad mode in fileopen
+		return ERROR_RETURN;
+	}
+	if (ctx->diskfile == NULL) {
+		prout(ctx,ERR16);	// file not found
+		perror("");
+		return ERROR_RETURN;
+	}
+	return NORMAL_RETURN;
+#endif
+
+#ifdef arduino
+    if (sdFile != NULL) {
+        prout(ctx,ERR35);   // file already open
+        return ERROR_RETURN;
+    }
+    if (mode[0] == 'w' || mode[0] == 'W')
+        sdFile = SD.open(fname,FILE_WRITE);
+    else if (mode[0] == 'r' || mode[0] == 'R')
+        sdFile = SD.open(fname);
+    else {
+        prout(ctx,ERR36);   // bad mode in fileopen
+        return ERROR_RETURN;
+    }
+    if (sdFile == NULL) {
+        prout(ctx,ERR16);   // file not found
+        return ERROR_RETURN;    
+    }
+    return NORMAL_RETURN;
+#endif 
+}
+
+
+
+/* ********* */
+/* FILECLOSE */
+/* ********* */
+int fileclose(struct context *ctx) {
+// close an already open file. Error if already closed.    
+#ifdef posix
+	if (ctx->diskfile == NULL) {	// file not open
+		prout(ctx,ERR37);
+		return ERROR_RETURN;
+	}
+	fclose(ctx->diskfile);
+	ctx->diskfile=0;	// null it
+	return NORMAL_RETURN;
+#endif
+#ifdef arduino
+    if (sdFile == NULL) {
+        prout(ctx,ERR37);       // file not open
+        return ERROR_RETURN;
+    }
+    sdFile.close();		// automagically nulls pointer
+    //sdFile = NULL;
+    return NORMAL_RETURN;
+#endif
+
+    return 0;
+}
+
+
+/* ********* */
+/* FILEWRITE */
+/* ********* */
+int filewrite(struct context *ctx, char line[]) {
+// write values to open file
+char *p; char temp[20]={};
+int res=0, cnt=0;
+
+#ifdef arduino
+    if (sdFile == NULL) {
+        prout(ctx,ERR38);   // no file open for write
+        return ERROR_RETURN;
+    }
+#endif
+
+#ifdef posix
+	if (ctx->diskfile == NULL) {
+		prout(ctx,ERR38);	// no file open for write 
+		return ERROR_RETURN;
+	}
+#endif
+	
+    p = line;
+    p = strstr(line,"filewrite");    // point to begin of statement
+    while (islower(*p++));             // point to space after
+    
+    if (*p == '\n') {   // write empty line
+        #ifdef arduino
+        ctx->stats.filewritten += sdFile.write('\n');
+        #endif
+		#ifdef posix
+		ctx->stats.filewritten += fprintf(ctx->diskfile,"\n");
+		#endif
+        return NORMAL_RETURN;
+    }
+    
+    while (1) {    
+        if (p-line > strlen(line)) {
+            prout(ctx,ERR39);       // unterminated line
+            return ERROR_RETURN;
+        }
+        if (*p == '\0') return NORMAL_RETURN;    
+    
+        if (*p == ' ') {            // skip blanks
+            p++;
+            continue;
+        }
+        if (*p >= 'a' && *p <= 'z') {   // write variable contents
+            res = ctx->intvar[*p - 'a'];
+            #ifdef arduino
+            ctx->stats.filewritten += sdFile.print(res);
+            #endif
+			#ifdef posix
+			ctx->stats.filewritten += fprintf(ctx->diskfile,"%d",res);
+			#endif
+            p++;
+            continue;            
+        }
+        if (*p == '"') {    // write everything inside double quotes
+            p++;    // skip past "
+            while (*p != '"') {
+                #ifdef arduino
+                ctx->stats.filewritten += sdFile.write(*p++);
+                #endif
+				#ifdef posix
+				ctx->stats.filewritten += fprintf(ctx->diskfile,"%c",*p++);
+				#endif
+            }
+            if (*p == '"') p++;        // skip past term quote
+            continue;
+        }
+        if (*p == ',') {    // write 3 spaces
+            #ifdef arduino
+            ctx->stats.filewritten += sdFile.write("   ");
+            #endif
+			#ifdef posix
+			ctx->stats.filewritten += fprintf(ctx->diskfile,"   ");
+			#endif
+            p++;
+            continue;
+        }
+        if (*p == ';') {    // do nothing 
+            p++;
+            continue;
+        }
+        if (*p == '@') {    // write array var
+            memset(temp,0,20);
+            cnt=0;
+            while (*p != ')') 
+                temp[cnt++]=*p++;
+            temp[cnt++]=*p++;       // write )
+            //temp[cnt]='\n';         // and terminating newline
+            ctx->error = 0;
+            res = eval(ctx,temp);
+            if (ctx->error) return ERROR_RETURN; // eval failed
+            #ifdef arduino
+            ctx->stats.filewritten += sdFile.print(res);
+            #endif
+			#ifdef posix
+			ctx->stats.filewritten += fprintf(ctx->diskfile,"%d",res);
+			#endif
+            continue;
+        }
+        if (*p == '\n' && *(p-1) == ';') {
+            return NORMAL_RETURN;
+        }
+        if (*p == '\n' && *(p-1) != ';') {
+            #ifdef arduino
+            ctx->stats.filewritten += sdFile.write('\n');
+            #endif
+			#ifdef posix
+			ctx->stats.filewritten += fprintf(ctx->diskfile,"\n");
+			#endif
+            return NORMAL_RETURN;
+        }
+   
+        prout(ctx,ERR7);    // bad char in line
+        return ERROR_RETURN;
+    }
+
+    return NORMAL_RETURN;   // probably won't get here
+}
+
+/* ******** */
+/* FILEREAD */
+/* ******** */
+int fileread(struct context *ctx, char line[]) {
+char *p; char temp[MAXLINE]={}, ch;
+int res=0, cnt=0;
+
+#ifdef arduino
+    if (sdFile == NULL) {
+        prout(ctx,ERR40);   // no file open for read
+        return ERROR_RETURN;
+    }
+#endif
+#ifdef posix
+	if (ctx->diskfile == NULL) {
+		prout(ctx,ERR40);	// no file open for read
+		return ERROR_RETURN;
+	}
+#endif
+
+
+    p = line;
+    p = strstr(line,"fileread");    // point to begin of statement
+    while (islower(*p++));             // point to space after
+
+    while (1) {     // read chars until vars run out or -1 returned
+        if (*p == '\n' || *p == '\0') return NORMAL_RETURN;
+
+        if (*p == ',' || *p == ' ') {   // ignore space, commas
+            p++;
+            continue;
+        }
+        
+        if (*p >= 'a' && *p <= 'z' ) {  // read data into a variable
+            memset(temp,0,MAXLINE);
+            cnt=0;
+            while (1) {
+				#ifdef arduino
+                ch = sdFile.read();
+				#endif
+				#ifdef posix
+				ch = fgetc(ctx->diskfile);
+				#endif
+                if (ch == -1) break; // EOF
+                ctx->stats.fileread++;
+                if ((!(isdigit(ch))) || ch==',') break;
+                temp[cnt++] = ch;    
             }
-            char tline[MAXLINE]={}; // hold string here
-            int indx=0;
-            char *st = p+4;  // get everything between double quotes
-            while (*st != '"') 
-                tline[indx++] = *st++; 
-            strcpy(textvar[*p-'a'],tline);  // save var
-            while (*p != '\n') p++;
+            if (ch == -1) 
+                res=ch;
+            else
+                res = atoi(temp);
+            ctx->intvar[*p - 'a'] = res;
+            // if no more data, -1 is returned
+            if (res == -1) return NORMAL_RETURN;
+            p++;
             continue;
         }
+        
+        prout(ctx,ERR7);    // bad char in line
+        return ERROR_RETURN;      
 
-		// assign integer variable
-		if (*p >= 'a' && *p <= 'z') {
-			intvar[*p -'a'] = eval(p+2);
-			if (error) {
-				prout(ERR28);   // bad expression
+    }
+
+
+}
+
+
+
+/* *********** */
+/*    PRINT    */
+/* *********** */
+int parse_print(struct context *ctx, char line[]) {	// the entire line is passed
+	char *p;
+	char lineno[6]={}, temp[MAXLINE]={};		// create an expression to send to eval()
+	int cnt=0, result=0;
+	int linelen = strlen(line);
+    
+	sscanf(line,"%s ",lineno);
+	
+	p = strstr(line,"print");	// point to print statement
+	if (p == NULL) {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	
+	ctx->error = 0;
+	
+	while (*p++ != 't');		// point to 1st non-blank after 'print'
+	if (*p == '\n') {           // print a blank line
+        prout(ctx,"\r\n");
+        return NORMAL_RETURN;
+	}
+   
+	while (1) {		// loop thru 
+		if (p-line > linelen) {
+				prout(ctx,ERR39);   // unterminated line
+				return ERROR_RETURN;
+		}
+	
+		// print the value of array @(x)
+		if (*p == '@' && *(p+1) == '(') {
+			ctx->error = 0;
+			p+=2;
+			char temp[8]={}; int cnt=0;
+			while (*p != ')')
+				temp[cnt++]=*p++;
+			temp[cnt]='\n';
+			int res = eval(ctx,temp);
+			if (!ctx->error) res = arrayget(ctx,res);
+			if (ctx->error) {
+				prout(ctx,ERR28);   // bad expression
 				return ERROR_RETURN;
 			}
-            if (*(p+1) != '=') {
-                prout(ERR2);    // syntax error
-                return ERROR_RETURN;
-            }
-			while (1) {		// point past value
-				p++;
-				if (*p=='\n' || *p=='\0' || *p==',' || *p== ' ') break;
-			}
+			sprintf(ctx->printmessage,"%d",res);
+			prout(ctx,ctx->printmessage);
+			p++;
 			continue;
 		}
 
-		// set array value
-		if (*p == '@' ) {
+
+		if (*p == '\n' && *(p-1) == ';') 
+			return NORMAL_RETURN;
+	
+		if (*p == '\n' && *(p-1) != ';') {
+			prout(ctx,"\r\n");
+			return NORMAL_RETURN;
+		}
+
+		if (*p == ',') {		// comma (3 spaces)
+			prout(ctx,"   ");
 			p++;
-			if (*p != '(') {
-				prout(ERR29);   // bad array
-				return ERROR_RETURN;
-			}
-			p++;	// point to start of expr
-			error = 0;
-			cnt=0;
-			memset(temp,0,20);
-			while (*p != ')') {
-				if (cnt > 15) {		// beware overflow
-					prout(ERR23);
-					error = 1;
-					return ERROR_RETURN;
-				}
-				temp[cnt++]=*p++;
-			}
-			temp[cnt]='\n';		// temp holds value (num/var a-z) between()
-			int index=eval(temp);	// index is array index
-			if (error) {
-				prout(ERR2);
-				return ERROR_RETURN;
-			}
-			if (index > arraymax-1) {
-				prout(ERR23);   // array too large
-				return ERROR_RETURN;
-			}
-			if (*p != ')') prout("missing )");  // replace this w/syntax error
+			continue;
+		}
+		
+		if (*p == ';') {		// semi-colon - do nothing
+			p++;
+			continue;
+		}
+
+		if (*p == ' ') {		// ignore spaces
 			p++;
-			if (*p != '=') prout("missing =");
+			continue;
+		}
+
+		if (*p == '"') {		// double quotes - print everything until next double quotes
 			p++;
-			int res = eval(p);
-			if (error) {
-				prout(ERR2);
-				return ERROR_RETURN;
-			}
-			intarray[index] = res;
-			while (1) {	// step p until *p=\n or ,
-				if (*p == '\n' || *p == ',') break;
+			while (1) {
+				if (*p == '"') break;
+				sprintf(ctx->printmessage,"%c",*p);
+				prout(ctx,ctx->printmessage);
 				p++;
+				if (p-line > linelen) {
+					prout(ctx,ERR39);   // unterminated line
+					return ERROR_RETURN;
+				}
 			}
+			p++;		// increment past "
 			continue;
 		}
 
+        // test string vars
+        if (*p >= 'a' && *p <= 'z' && *(p+1) == '$') {
+            sprintf(ctx->printmessage,"%s",ctx->textvar[*p-'a']);
+            prout(ctx,ctx->printmessage);
+            p+=2;   // point past a$
+            continue;
+        }
+
+        // test numeric vars
+		if ((*p >= 'a' && *p <= 'z') && 
+			(*(p+1)==',' || *(p+1)==';' || *(p+1)=='\n')) {	// print value of integer variable
+				sprintf(ctx->printmessage,"%d",ctx->intvar[(unsigned char)*p-'a']);		// but only if followed by , or ;  or \n
+				prout(ctx,ctx->printmessage);
+				p++;							// (otherwise it messes up eval below)
+				continue;
+		}
+
+		// evaluate an expression
+		memset(temp,0,MAXLINE); result=0; cnt=0;
+		int depth=0;	// don't stop at commas inside a(i,j)
+		while (1) {
+			if (*p == '(') depth++;
+			if (*p == ')') depth--;
+			temp[cnt++]=*p++;
+			if (*p == '\n' || *p == '\0') break;
+			if (depth == 0 && (*p == ',' || *p == ';')) break;
+		}
+		temp[cnt]='\n';		// keep eval() happy
+		result = eval(ctx,temp);
+		if (ctx->error) {
+			prout(ctx,ERR28);   // bad expression
+			return ERROR_RETURN;
+		}
+		sprintf(ctx->printmessage,"%d",result);	
+		prout(ctx,ctx->printmessage);
+		continue;
+
+		
+	}
+	// should never get here
+	prout(ctx,ERR17);   // unknown error in line
+	return ERROR_RETURN;
+}
+
+
+
+
+/* Used in GOTO/GOSUB to find address vs line number */
+/* if curnext == 0, return start address for line in opt */
+/* if curnext == 1, return start address for line # +1 in opt */
+int setlinenumber (struct context *ctx, char opt[20],int curnext) {
+	int n, startpos=0, pos=0;
+	char basicline[MAXLINE]={};
+	char linenum[6]={};
+	struct program *prog = ctx->prog;
+	struct lineindex *found = NULL;
+	int want = atoi(opt);
+
+	ctx->stats.lookups++;
+	/* look it up in the line index (only the owner may build it) */
+	if (prog->index == NULL && __atomic_load_n(&prog->refs,__ATOMIC_ACQUIRE) == 1) progindex(ctx);
+	if (prog->index != NULL) {
+		if (prog->sorted) {
+			int lo = 0, hi = prog->lines-1, mid;
+			while (lo <= hi) {
+				ctx->stats.lookupsteps++;
+				mid = (lo+hi)/2;
+				if (prog->index[mid].line == want) {
+					found = &prog->index[mid];
+					break;
+				}
+				if (prog->index[mid].line < want) lo = mid+1;
+				else hi = mid-1;
+			}
+		}
+		else {
+			for (n=0; n<prog->lines && found == NULL; n++)
+				if (prog->index[n].line == want) found = &prog->index[n];
+			ctx->stats.lookupsteps += n;
+		}
+		if (found == NULL) {
+			prout(ctx,ERR8);    // line not found
+			return ERROR_RETURN;
+		}
+		return curnext ? found->next : found->addr;
+	}
+
+	/* no index: get a line */
+loop:
+		ctx->stats.lookupsteps++;
+		for (n=0; n<MAXLINE; n++) {
+            basicline[n] = ctx->buffer[pos];
+            if (ctx->buffer[pos] == '\n') break;
+            pos++; if (pos >= ctx->position) break;
+        }
+
+        if (pos++ >= ctx->position) {
+            prout(ctx,ERR8);    // line not found
+			return ERROR_RETURN; 
+        }
+
+		sscanf(basicline,"%s ",linenum);	// get linenum
+		if (atoi(linenum) == atoi(opt)) {
+			if (!curnext) return startpos;		// return address of linenum
+			if (curnext) return pos;			// return address of linenum+1
+		}
+		memset(basicline,0,MAXLINE);
+		startpos = pos;
+		goto loop;
+}
+
+#ifdef arduino
+/* *********** */
+/* analog read */
+/* *********** */
+int dueanalog(int val) {
+    // the compiler decodes the A0-A11 in analogRead - can't
+    // be done at runtime. So we do this ugly piece of code    
+
+    switch (val) {
+        case 0:
+        return analogRead(A0);
+        break;
+        case 1:
+        return analogRead(A1);
+        break;
+        case 2:
+        return analogRead(A2);
+        break;
+        case 3:
+        return analogRead(A3);
+        break;
+        case 4:
+        return analogRead(A4);
+        break;
+        case 5:
+        return analogRead(A5);
+        break;
+        case 6:
+        return analogRead(A6);
+        break;
+        case 7:
+        return analogRead(A7);
+        break;
+        case 8:
+        return analogRead(A8);
+        break;
+        case 9:
+        return analogRead(A9);
+        break;
+        case 10:
+        return analogRead(A10);
+        break;
+        case 11:
+        return analogRead(A11);
+        break;
+        default:
+        return -1;
+    }
+}
+#endif
+
+
+/* *************** */
+/*    isoperand    */
+/* *************** */
+// return 1 if supplied char is an operand
+int isoperand(char ch) {
+	if (ch == '+' ||	// plus
+		ch == '-' ||	// subtract
+		ch == '*' ||	// multiply
+		ch == '/' ||	// divide
+		ch == '%' ||	// modulo
+		ch == '&' ||	// and
+		ch == '|' ||	// or
+		ch == '^' ||	// xor
+		ch == 'E' ||	// exponent ie 2E3 = 2*2*2
+        ch == 'e' ||    // lower case
+		ch == '~' ) 	// compliment
+		return 1;
+	else
+		return 0;
+}
+
 
+/* ******************* */
+/* hash table routines */
+/* ******************* */
+// home slot of a key: multiplicative hash masked to the table size
+unsigned int hashindex(struct hashtable *h, int key) {
+	unsigned int n = (unsigned int)key * 2654435769u;
+	n ^= n >> 15;
+	return n & (h->size-1);
+}
 
+// return pointer to the value stored for key, NULL if not found
+int *hashfind(struct hashtable *h, int key) {
+	unsigned int n;
+	if (key == HASHEMPTY) return h->haveempty ? &h->emptyval : (int*)NULL;
+	if (h->slot == NULL) return NULL;
+	n = hashindex(h,key);
+	while (h->slot[n].key != HASHEMPTY) {
+		if (h->slot[n].key == key) return &h->slot[n].val;
+		n = (n+1) & (h->size-1);	// linear probe
 	}
-
-	prout(ERR2);    // syntax in line
-	return ERROR_RETURN;
+	return NULL;
 }
 
+// double the table (or create it) and re-insert all keys
+int hashgrow(struct hashtable *h) {
+	struct hashslot *old = h->slot;
+	unsigned int oldsize = h->size, n, i;
+	unsigned int size = (oldsize == 0) ? HASHINIT : oldsize*2;
 
-/* ********** */
-/*     IF     */
-/* ********** */
-int parse_if(char line[]) {
-	char linenum[6]={}, keyword[20]={}, expression[20]={}, wordthen[20]={}, newline[20]={};
-	sscanf(line,"%s %s %s %s %s ",linenum,keyword,expression,wordthen,newline);
-	int res = 0;
-
-	/* 
-	 * format: 
-	 * if [expression] [then/goto/gosub] [line#] 
-	 * if [expression] [return/stop]
-	 *
-	 */ 	
-
-	res = evallogic(expression);
-	if (error) {
+	h->slot = (struct hashslot *) malloc(size * sizeof(struct hashslot));
+	if (h->slot == NULL) {
+		h->slot = old;
 		return ERROR_RETURN;
 	}
-
-	if (!res) // returned FALSE
-		return NORMAL_RETURN;
-	else {	// goto line number 'newline'
-		if ((strcmp(wordthen,"then")==0) || (strcmp(wordthen,"goto")==0)) {
-			int result = setlinenumber(newline,0);                  // return the address of the line
-        	if (result == ERROR_RETURN) return ERROR_RETURN;        // line # not found
-        	return result;  										// return address of line
-		}
-		if (strcmp(wordthen,"gosub")==0) {
-			int res = setlinenumber(linenum,1);						// get address of next line
-			if (res == ERROR_RETURN) return ERROR_RETURN;			// non-existant #
-			if (return_stack_position + 1 > MAXRETURNSTACKPOS) {	// test stack
-				prout(ERR25);   // stack full
-				return ERROR_RETURN;
-			}
-			return_stack[return_stack_position++] = res;			// push return addr on stack
-			res = setlinenumber(newline,0);							// get address of dest line
-			if (res == ERROR_RETURN) return ERROR_RETURN;			// bad line number
-			return res;												// jump to new line
-		}
-		if (strcmp(wordthen,"return")==0) {
-			if (return_stack_position < 1) {
-				prout(ERR26);   // return w/o gosub
-				return ERROR_RETURN;
-			}
-			int res = return_stack[--return_stack_position];		// get return address
-			if (res == ERROR_RETURN) return ERROR_RETURN;
-			return res;												// jump back
-		}
-		if (strcmp(wordthen,"stop")==0) {
-			prout(ERR19);   // stopped at line
-			return STOP_RETURN;
-		}
-
-
-		prout(ERR2);    // syntax in line
-		return ERROR_RETURN;
+	for (n=0; n<size; n++)
+		h->slot[n].key = HASHEMPTY;
+	h->size = size;
+	for (n=0; n<oldsize; n++) {
+		if (old[n].key == HASHEMPTY) continue;
+		i = hashindex(h,old[n].key);
+		while (h->slot[i].key != HASHEMPTY)
+			i = (i+1) & (size-1);
+		h->slot[i] = old[n];
 	}
-	prout(ERR17);   // unknown error in line
-	return ERROR_RETURN;
+	if (old != NULL) free(old);
+	return NORMAL_RETURN;
 }
 
-
-/* *********** */
-/*    FOR      */
-/* *********** */
-int parse_for(char line[]) {
-char linenum[6]={}, keyword[6]={}, expr[12]={}, key2[6]={}, final[12]={}, key3[6]={}, stepsize[12]={};
-char *p;
-int res=0;
-	/* ex: 10 for n=1 to 10 step 1 */
-	/* the for part of a for/next loop just sets up the variables  */
-	/* global vars: foraddr (ret address) (int)intvar[n] (ch)forvar (int)tovar  (int)forstep */
-	sscanf(line,"%s %s %s %s %s %s %s ",linenum,keyword,expr,key2,final,key3,stepsize);
-	
-	/* get forvar */
-	expr[strlen(expr)]='\n';
-	/* test for 1st variable */
-	if (!(*expr >= 'a' && *expr <= 'z')) {
-		prout(ERR2);
-		return ERROR_RETURN;
-	}
-
-	p=strchr(expr,'=');		// point to =
-	p++;
-	error = 0;
-	res = eval(p);			// return value of var to start with
-	if (error) {
-		prout(ERR28);   // bad expression
-		return ERROR_RETURN;
-	}
-	if (expr[0] >= 'a' && expr[0] <= 'z') {
-		forvar = expr[0];
-		intvar[(unsigned char)forvar-'a'] = res;
+// store val under key, growing the table past 3/4 full
+int hashput(struct context *ctx, struct hashtable *h, int key, int val) {
+	unsigned int n;
+	int *v = hashfind(h,key);
+	if (v != NULL) {
+		*v = val;
+		return NORMAL_RETURN;
 	}
-	
-	/* get final var */
-	final[strlen(final)]='\n';
-	res = eval(final);
-	if (error) {
-		prout(ERR28);   // bad expression
+	if (h->count >= h->max) {
+		prout(ctx,ERR24);   // out of memory
 		return ERROR_RETURN;
 	}
-	tovar = res;
-	
-	/* get step size */
-	if (atoi(stepsize)==0) 
-		res = 1;
-	else {
-		stepsize[strlen(stepsize)] = '\n';
-		res = eval(stepsize);
+	if (key == HASHEMPTY) {		// can't go in a slot
+		h->haveempty = 1;
+		h->emptyval = val;
+		h->count++;
+		return NORMAL_RETURN;
 	}
-	if (error) {
-		prout(ERR28);   // bad expression
-		return ERROR_RETURN;
+	if ((h->count - h->haveempty + 1)*4 > h->size*3) {
+		if (hashgrow(h) == ERROR_RETURN) {
+			prout(ctx,ERR24);   // out of memory
+			return ERROR_RETURN;
+		}
 	}
-	if (res == 0) 
-		forstep = 1;
-	else
-		forstep = res;
-
-	/* set return address */
-	res = setlinenumber(linenum,1);
-	if (res == ERROR_RETURN) return ERROR_RETURN;
-	foraddr = res;
-
+	n = hashindex(h,key);
+	while (h->slot[n].key != HASHEMPTY)
+		n = (n+1) & (h->size-1);
+	h->slot[n].key = key;
+	h->slot[n].val = val;
+	h->count++;
 	return NORMAL_RETURN;
 }
 
+// remove key, return 1 if it was there. Later keys in the same run
+// of slots are shifted back into the hole so no tombstones are needed
+int hashdel(struct hashtable *h, int key) {
+	unsigned int i, j, k, mask = h->size-1;
 
-/* ************* */
-/*     NEXT      */
-/* ************* */
-int parse_next(char line[]) {
-char linenum[6]={}, keyword[8]={}, var[4]={};
-int res=0;
-char varname;
+	if (key == HASHEMPTY) {
+		if (!h->haveempty) return 0;
+		h->haveempty = 0;
+		h->count--;
+		return 1;
+	}
+	if (h->slot == NULL) return 0;
+	i = hashindex(h,key);
+	while (h->slot[i].key != key) {
+		if (h->slot[i].key == HASHEMPTY) return 0;	// not there
+		i = (i+1) & mask;
+	}
+	j = i;
+	while (1) {
+		j = (j+1) & mask;
+		if (h->slot[j].key == HASHEMPTY) break;
+		k = hashindex(h,h->slot[j].key);
+		// leave it if its home slot is between the hole and where it sits
+		if ((i < j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+		h->slot[i] = h->slot[j];
+		i = j;
+	}
+	h->slot[i].key = HASHEMPTY;
+	h->count--;
+	return 1;
+}
 
+// release all slots
+void hashfree(struct hashtable *h) {
+	if (h->slot != NULL) free(h->slot);
+	h->slot = (struct hashslot *)NULL;
+	h->size = 0;
+	h->count = 0;
+	h->haveempty = 0;
+}
 
-	sscanf(line,"%s %s %s ",linenum,keyword,var);
 
-	/* get var to test */
-	varname = var[0];
-	if (!(varname >= 'a' && varname <= 'z')) {
-		prout(ERR31);   // bad variable
+/* ********************************* */
+/* @() array access (dense / sparse) */
+/* ********************************* */
+// return @(index), sets error on a bounds error
+int arrayget(struct context *ctx, int index) {
+	int *v;
+	ctx->stats.arrayreads++;
+	if (index < 0 || index >= ctx->arraymax) {
+		prout(ctx,ERR45);   // array bounds error
+		ctx->error = 1;
 		return ERROR_RETURN;
 	}
-	if (varname != forvar) {
-		prout(ERR32);   // next w/o for
-		return ERROR_RETURN;
+	if (ctx->sparsemode) {
+		v = hashfind(&ctx->maps->sparse,index);
+		if (v == NULL) return ctx->sparsedefault;	// never assigned
+		return *v;
 	}
+	return ctx->intarray[index];
+}
 
-	/* get the next var, add (subtract) it and save it */
-	res = intvar[(unsigned char)varname-'a'];
-	res += forstep;
-	intvar[(unsigned char)varname-'a'] = res;
-	
-	/* if counting up  */
-	if (forstep > 0) {
-		if (res > tovar) {
-			forvar = '\0';	// clear for vars
-			forstep = 0;
-			foraddr = 0;
-			tovar = 0;
-			return setlinenumber(linenum,1);
-		}
-		else
-			return foraddr;
+// set @(index) to value
+int arrayput(struct context *ctx, int index, int value) {
+	ctx->stats.arraywrites++;
+	if (index < 0 || index >= ctx->arraymax) {
+		prout(ctx,ERR45);   // array bounds error
+		ctx->error = 1;
+		return ERROR_RETURN;
 	}
-	
-	/* if counting down */
-	if (forstep < 0) {
-		if (res < tovar) {
-			forvar = '\0';	// clear for vars
-			forstep = 0;
-			foraddr = 0;
-			tovar = 0;
-			return setlinenumber(linenum,1);
+	if (ctx->sparsemode) {
+		if (value == ctx->sparsedefault) {		// nothing to store
+			hashdel(&ctx->maps->sparse,index);
+			return NORMAL_RETURN;
 		}
-		else
-			return foraddr;
+		if (hashput(ctx,&ctx->maps->sparse,index,value) == ERROR_RETURN) {
+			ctx->error = 1;
+			return ERROR_RETURN;
+		}
+		return NORMAL_RETURN;
 	}
-	prout(ERR33);   // unexpected next error
-	return ERROR_RETURN;
-
+	ctx->intarray[index] = value;
+	return NORMAL_RETURN;
 }
 
-
-
-/* *********** */
-/*    INPUT    */
-/* *********** */
-int parse_input(char line[]) {
-	char *p;
-	char lineno[6]={};
-	sscanf(line,"%s ",lineno);	// get line number for error messages
-	char temp[MAXLINE]={};
-
-	p = strstr(line,"input");
-	if (p == NULL) {
-		prout(ERR27);   // bad format in line
-		return ERROR_RETURN;
+// release DIM memory (dense or sparse)
+void arrayfree(struct context *ctx) {
+	if (ctx->intarray != NULL) free(ctx->intarray);
+	ctx->intarray = (int*)NULL;
+	hashfree(&ctx->sparse);
+	ctx->sparsemode = 0;
+	ctx->sparsedefault = 0;
+	ctx->arraymax = 0;
+	for (int n=0; n<26; n++) {		// and the named arrays
+		if (ctx->arrays[n].data != NULL) free(ctx->arrays[n].data);
+		ctx->arrays[n].data = (int*)NULL;
+		ctx->arrays[n].dims = 0;
+		ctx->arrays[n].total = 0;
 	}
+}
 
-	while (*p++ != ' ');		// point to 1st non-blank after 'input'
 
-	while (1) {		// input loop
-		if (*p == '\n') return NORMAL_RETURN;
+/* ******************************** */
+/* named arrays a()-z() (DIM a(n,m)) */
+/* ******************************** */
+// DIM one or more named arrays: a(n),b(n,m),c(n,m,o)
+int dimnamed(struct context *ctx, char *p) {
+	struct namedarray *a;
+	char temp[MAXLINE];
+	int n, cnt, size, total;
 
+	while (1) {
+		if (*p == '\0' || *p == '\n') return NORMAL_RETURN;
 		if (*p == ',') {
-			prout("   ");
 			p++;
 			continue;
 		}
-
-		if (*p == ';') {		// do-nothing
-			p++;
-			continue;
+		if (!(*p >= 'a' && *p <= 'z' && *(p+1) == '(')) {
+			prout(ctx,ERR29);   // bad array
+			return ERROR_RETURN;
 		}
-
-		if (*p == ' ') {		// ignore spaces
-			p++;
-			continue;
+		a = &ctx->arrays[*p - 'a'];
+		if (a->dims > 0) {
+			prout(ctx,ERR20);   // array re-dim
+			return ERROR_RETURN;
+		}
+		p += 2;		// point to 1st size
+		n = 0;
+		while (1) {		// get each dimension
+			cnt = 0;
+			while (*p != ',' && *p != ')') {
+				if (*p == '\0' || *p == '\n' || cnt >= MAXLINE-2) {
+					prout(ctx,ERR44);   // missing closing )
+					return ERROR_RETURN;
+				}
+				temp[cnt++] = *p++;
+			}
+			temp[cnt] = '\n';
+			temp[cnt+1] = '\0';
+			if (n >= MAXDIMS) {
+				prout(ctx,ERR21);   // array size error
+				return ERROR_RETURN;
+			}
+			ctx->error = 0;
+			size = eval(ctx,temp);
+			if (ctx->error) {
+				prout(ctx,ERR21);   // array size error
+				return ERROR_RETURN;
+			}
+			if (size < 1) {
+				prout(ctx,ERR22);   // dim - no action taken
+				return ERROR_RETURN;
+			}
+			a->size[n++] = size;
+			if (*p++ == ')') break;
 		}
 
-		if (*p == '"') {        // double quotes - print everything until next double quotes
-            p++;
-            while (1) {
-                if (*p == '"') break;
-                sprintf(printmessage,"%c",*p);
-				prout(printmessage);
-                p++;
-            }
-            p++;        // increment past "
-            continue;
-        }
-
-        // assign string variable
-        if (*p >= 'a' && *p <= 'z' && *(p+1)=='$') { 
-            memset(temp,0,MAXLINE);
-			#ifdef arduino
-			sgets(temp);
-			#endif
-			#ifdef posix
-			fgets(temp,MAXLINE,stdin);
-			#endif
-            // strip off the \n
-            temp[strlen(temp)-1]='\0';
-            strcpy(textvar[*p-'a'],temp);  // save var
-            p+=2;
-            continue;
-        }
-
+		/* row-major: strides are worked out once here so an element */
+		/* access is one multiply-add per index */
+		total = 1;
+		for (int i=n-1; i>=0; i--) {
+			a->stride[i] = total;
+			if (a->size[i] > ARRAYMAX / total) {
+				prout(ctx,ERR23);   // array too big
+				return ERROR_RETURN;
+			}
+			total *= a->size[i];
+		}
+		a->data = (int*) calloc(total,sizeof(int));
+		if (a->data == NULL) {
+			prout(ctx,ERR24);   // out of memory
+			return ERROR_RETURN;
+		}
+		a->dims = n;
+		a->total = total;
+	}
+}
 
-		// load an integer variable
-		if (*p >= 'a' && *p <= 'z') {
-			memset(temp,0,MAXLINE);
+// *pp points to '(' of a(i,j) - return the element offset, step *pp past ')'
+int arrayoffset(struct context *ctx, char **pp, struct namedarray *a) {
+	int index[MAXDIMS], n, offset=0;
 
-			#ifdef posix
-			fgets(temp,11,stdin); 
-			#endif
+	if (a->dims == 0 || **pp != '(') {
+		prout(ctx,ERR29);   // bad array (not dimensioned)
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	n = getargs(ctx,pp,index,MAXDIMS);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != a->dims) {		// wrong number of indexes
+		prout(ctx,ERR45);   // array bounds error
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	for (int d=0; d<n; d++) {
+		if (index[d] < 0 || index[d] >= a->size[d]) {
+			prout(ctx,ERR45);   // array bounds error
+			ctx->error = 1;
+			return ERROR_RETURN;
+		}
+		offset += index[d] * a->stride[d];
+	}
+	return offset;
+}
 
-			#ifdef arduino 
-			sgets(temp); 
-			#endif
+// return the value of a(i,j) at *pp, step *pp past ')'
+int namedget(struct context *ctx, char **pp) {
+	struct namedarray *a = &ctx->arrays[**pp - 'a'];
+	int index;
+	(*pp)++;
+	index = arrayoffset(ctx,pp,a);
+	if (ctx->error) return ERROR_RETURN;
+	return a->data[index];
+}
 
-			intvar[(unsigned char)*p-'a'] = atoi(temp);
-			p++;
-			continue;
+/* ************************************************ */
+/* whole array statements: FILL COPY ADD SUB MUL MASK */
+/* ************************************************ */
+/* 
+ * format:
+ * fill @(lo..hi) expr			@(lo..hi) = expr
+ * copy @(lo..hi) @(d)			@(d..) = @(lo..hi)
+ * add/sub/mul @(lo..hi) expr	@(lo..hi) = @(lo..hi) +-* expr
+ * add/sub/mul @(lo..hi) @(s)	@(lo..hi) = @(lo..hi) +-* @(s..)
+ * mask @(lo..hi) [=#<>]expr @(d)	@(d..) = 1 if test true, else 0
+ *
+ * results are the same as the equivalent for/next loop. 
+ */
+int parse_vector(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, range[MAXLINE]={}, arg[MAXLINE]={}, dest[MAXLINE]={};
+char *p, op='\0';
+int kind=0, lo=0, hi=0, n=0, v=0, src=-1, dst=-1;
+
+	sscanf(line,"%s %s %s %s %s ",linenum,keyword,range,arg,dest);
+	if (strcmp(keyword,"fill")==0) kind = VEC_FILL;
+	if (strcmp(keyword,"copy")==0) kind = VEC_COPY;
+	if (strcmp(keyword,"add")==0) kind = VEC_ADD;
+	if (strcmp(keyword,"sub")==0) kind = VEC_SUB;
+	if (strcmp(keyword,"mul")==0) kind = VEC_MUL;
+	if (strcmp(keyword,"mask")==0) kind = VEC_MASK;
+
+	if (arrayrange(ctx,range,&lo,&hi) == ERROR_RETURN) return ERROR_RETURN;
+	n = hi-lo+1;
+
+	p = arg;
+	if (kind == VEC_MASK) {
+		op = *p++;		// comparison
+		if (op != '=' && op != '#' && op != '<' && op != '>') {
+			prout(ctx,ERR2);    // syntax error
+			return ERROR_RETURN;
+		}
+		dst = arraystart(ctx,dest,n);
+		if (dst == ERROR_RETURN) return ERROR_RETURN;
+	}
+	if (kind == VEC_COPY) {
+		dst = arraystart(ctx,p,n);
+		if (dst == ERROR_RETURN) return ERROR_RETURN;
+	}
+	else if (*p == '@' && kind != VEC_FILL && kind != VEC_MASK) {	// array operand
+		src = arraystart(ctx,p,n);
+		if (src == ERROR_RETURN) return ERROR_RETURN;
+	}
+	else {		// scalar operand
+		ctx->error = 0;
+		v = eval(ctx,p);
+		if (ctx->error) {
+			prout(ctx,ERR28);   // bad expression
+			return ERROR_RETURN;
 		}
+	}
 
-		prout(ERR2);    // syntax error in line
-		return ERROR_RETURN;
+	/* overlapping ranges (or sparse arrays) go an element at */
+	/* a time so they give the same answer as a for/next loop */
+	if (ctx->sparsemode) return vecslow(ctx,kind,lo,n,src,dst,op,v);
+	if (kind == VEC_COPY && dst > lo && dst <= hi) return vecslow(ctx,kind,lo,n,src,dst,op,v);
+	if (src >= 0 && src != lo && src+n > lo && src < lo+n) return vecslow(ctx,kind,lo,n,src,dst,op,v);
+	if (kind == VEC_MASK && dst != lo && dst+n > lo && dst < lo+n) return vecslow(ctx,kind,lo,n,src,dst,op,v);
+
+	switch (kind) {
+		case VEC_FILL:
+			vecfill(ctx->intarray+lo,n,v);
+			break;
+		case VEC_COPY:
+			memmove(ctx->intarray+dst,ctx->intarray+lo,n*sizeof(int));
+			break;
+		case VEC_ADD:
+			if (src >= 0) vecaddarray(ctx->intarray+lo,ctx->intarray+src,n,1);
+			else vecadd(ctx->intarray+lo,n,v);
+			break;
+		case VEC_SUB:
+			if (src >= 0) vecaddarray(ctx->intarray+lo,ctx->intarray+src,n,-1);
+			else vecadd(ctx->intarray+lo,n,(int)(0u-(unsigned int)v));
+			break;
+		case VEC_MUL:
+			if (src >= 0) vecmularray(ctx->intarray+lo,ctx->intarray+src,n);
+			else vecmul(ctx->intarray+lo,n,v);
+			break;
+		case VEC_MASK:
+			vecmask(ctx->intarray+dst,ctx->intarray+lo,n,op,v);
+			break;
 	}
-	prout(ERR17);   // unexpected error in line
-	return ERROR_RETURN;
+	return NORMAL_RETURN;
 }
 
-
-/* ******** */
-/* FILEOPEN */
-/* ******** */
-int fileopen(char fname[],char mode[]) {
-// open a file for fileread, filewrite. Error if already open.
-    if (strlen(fname)==0) {
-        prout(ERR34);       // usage:
-        return ERROR_RETURN;
-    }
-    
-    // open a file for read/append
-#ifdef posix
-	if (diskfile != NULL) {
-		prout(ERR35);	// file already open
+// get lo and hi from @(lo..hi), test both are inside the array
+int arrayrange(struct context *ctx, char *opt, int *lo, int *hi) {
+	char temp[MAXLINE]={};
+	char *p;
+	int cnt=0;
+
+	if (*opt != '@' || *(opt+1) != '(' || strstr(opt,"..") == NULL) {
+		prout(ctx,ERR29);   // bad array
 		return ERROR_RETURN;
 	}
-	if (mode[0] == 'w' || mode[0] == 'W')
-		diskfile = fopen(fname,"a");
-	else if (mode[0] == 'r' || mode[0] == 'R')
-		diskfile = fopen(fname,"r");
-	else {
-		prout(ERR36);	// bad mode in fileopen
+	p = opt+2;
+	while (!(*p == '.' && *(p+1) == '.'))
+		temp[cnt++] = *p++;
+	temp[cnt] = '\n';
+	ctx->error = 0;
+	*lo = eval(ctx,temp);
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
 		return ERROR_RETURN;
 	}
-	if (diskfile == NULL) {
-		prout(ERR16);	// file not found
-		perror("");
+	p += 2;		// point past ..
+	cnt = 0;
+	memset(temp,0,MAXLINE);
+	while (*p != ')') {
+		if (*p == '\0') {
+			prout(ctx,ERR44);   // missing closing )
+			return ERROR_RETURN;
+		}
+		temp[cnt++] = *p++;
+	}
+	temp[cnt] = '\n';
+	*hi = eval(ctx,temp);
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	if (*lo < 0 || *lo > *hi || *hi >= ctx->arraymax) {
+		prout(ctx,ERR45);   // array bounds error
 		return ERROR_RETURN;
 	}
 	return NORMAL_RETURN;
-#endif
-
-#ifdef arduino
-    if (sdFile != NULL) {
-        prout(ERR35);   // file already open
-        return ERROR_RETURN;
-    }
-    if (mode[0] == 'w' || mode[0] == 'W')
-        sdFile = SD.open(fname,FILE_WRITE);
-    else if (mode[0] == 'r' || mode[0] == 'R')
-        sdFile = SD.open(fname);
-    else {
-        prout(ERR36);   // bad mode in fileopen
-        return ERROR_RETURN;
-    }
-    if (sdFile == NULL) {
-        prout(ERR16);   // file not found
-        return ERROR_RETURN;    
-    }
-    return NORMAL_RETURN;
-#endif 
 }
 
+// get index from @(expr), test that n elements from there fit in the array
+int arraystart(struct context *ctx, char *opt, int n) {
+	char temp[MAXLINE]={};
+	char *p;
+	int cnt=0, index;
 
-
-/* ********* */
-/* FILECLOSE */
-/* ********* */
-int fileclose(void) {
-// close an already open file. Error if already closed.    
-#ifdef posix
-	if (diskfile == NULL) {	// file not open
-		prout(ERR37);
+	if (*opt != '@' || *(opt+1) != '(') {
+		prout(ctx,ERR29);   // bad array
 		return ERROR_RETURN;
 	}
-	fclose(diskfile);
-	diskfile=0;	// null it
-	return NORMAL_RETURN;
-#endif
-#ifdef arduino
-    if (sdFile == NULL) {
-        prout(ERR37);       // file not open
-        return ERROR_RETURN;
-    }
-    sdFile.close();		// automagically nulls pointer
-    //sdFile = NULL;
-    return NORMAL_RETURN;
-#endif
+	p = opt+2;
+	while (*p != ')') {
+		if (*p == '\0') {
+			prout(ctx,ERR44);   // missing closing )
+			return ERROR_RETURN;
+		}
+		temp[cnt++] = *p++;
+	}
+	temp[cnt] = '\n';
+	ctx->error = 0;
+	index = eval(ctx,temp);
+	if (ctx->error) {
+		prout(ctx,ERR28);   // bad expression
+		return ERROR_RETURN;
+	}
+	if (index < 0 || index > ctx->arraymax - n) {
+		prout(ctx,ERR45);   // array bounds error
+		return ERROR_RETURN;
+	}
+	return index;
+}
 
-    return 0;
+// element at a time version of the whole array statements
+int vecslow(struct context *ctx, int kind, int lo, int n, int src, int dst, char op, int v) {
+	int a, b, t, res=0;
+
+	ctx->error = 0;
+	for (int i=0; i<n; i++) {
+		a = arrayget(ctx,lo+i);
+		b = (src >= 0) ? arrayget(ctx,src+i) : v;
+		if (ctx->error) return ERROR_RETURN;
+		t = lo+i;
+		switch (kind) {
+			case VEC_FILL: res = v; break;
+			case VEC_COPY: res = a; t = dst+i; break;
+			case VEC_ADD: res = (int)((unsigned int)a + (unsigned int)b); break;
+			case VEC_SUB: res = (int)((unsigned int)a - (unsigned int)b); break;
+			case VEC_MUL: res = (int)((unsigned int)a * (unsigned int)b); break;
+			case VEC_MASK:
+				t = dst+i;
+				if (op == '=') res = (a == v);
+				if (op == '#') res = (a != v);
+				if (op == '<') res = (a < v);
+				if (op == '>') res = (a > v);
+				break;
+		}
+		if (arrayput(ctx,t,res) == ERROR_RETURN) return ERROR_RETURN;
+	}
+	return NORMAL_RETURN;
 }
 
 
-/* ********* */
-/* FILEWRITE */
-/* ********* */
-int filewrite(char line[]) {
-// write values to open file
-char *p; char temp[20]={};
-int res=0, cnt=0;
+/* 
+ * array kernels. On posix these use AVX2 (8 ints at a time) if the
+ * compiler targets it (ie cc -O2 -march=native), else SSE2 (4 at a 
+ * time, always there on x86-64). Everything else (arduino) runs the
+ * plain loop, which also finishes off the last few elements.
+ */
+#if defined(posix) && defined(__SSE2__) && !defined(__AVX2__) && !defined(__SSE4_1__)
+// SSE2 has no 32 bit multiply low - build it from two 32x32->64 multiplies
+static inline __m128i mullo128(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a,b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_si128(a,4),_mm_srli_si128(b,4));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),
+								_mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0)));
+}
+#elif defined(posix) && defined(__SSE4_1__) && !defined(__AVX2__)
+#include <smmintrin.h>
+#define mullo128 _mm_mullo_epi32
+#endif
 
-#ifdef arduino
-    if (sdFile == NULL) {
-        prout(ERR38);   // no file open for write
-        return ERROR_RETURN;
-    }
+// a[0..n-1] = v
+void vecfill(int *a, int n, int v) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i vv = _mm256_set1_epi32(v);
+	for (; i+8 <= n; i+=8)
+		_mm256_storeu_si256((__m256i *)(a+i),vv);
+#elif defined(posix) && defined(__SSE2__)
+	__m128i vv = _mm_set1_epi32(v);
+	for (; i+4 <= n; i+=4)
+		_mm_storeu_si128((__m128i *)(a+i),vv);
 #endif
+	for (; i<n; i++)
+		a[i] = v;
+}
 
-#ifdef posix
-	if (diskfile == NULL) {
-		prout(ERR38);	// no file open for write 
-		return ERROR_RETURN;
+// a[0..n-1] += v  (sub passes -v)
+void vecadd(int *a, int n, int v) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i vv = _mm256_set1_epi32(v);
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(a+i));
+		_mm256_storeu_si256((__m256i *)(a+i),_mm256_add_epi32(x,vv));
+	}
+#elif defined(posix) && defined(__SSE2__)
+	__m128i vv = _mm_set1_epi32(v);
+	for (; i+4 <= n; i+=4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(a+i));
+		_mm_storeu_si128((__m128i *)(a+i),_mm_add_epi32(x,vv));
 	}
 #endif
-	
-    p = line;
-    p = strstr(line,"filewrite");    // point to begin of statement
-    while (islower(*p++));             // point to space after
-    
-    if (*p == '\n') {   // write empty line
-        #ifdef arduino
-        sdFile.write('\n');
-        #endif
-		#ifdef posix
-		fprintf(diskfile,"\n");
-		#endif
-        return NORMAL_RETURN;
-    }
-    
-    while (1) {    
-        if (p-line > strlen(line)) {
-            prout(ERR39);       // unterminated line
-            return ERROR_RETURN;
-        }
-        if (*p == '\0') return NORMAL_RETURN;    
-    
-        if (*p == ' ') {            // skip blanks
-            p++;
-            continue;
-        }
-        if (*p >= 'a' && *p <= 'z') {   // write variable contents
-            res = intvar[*p - 'a'];
-            #ifdef arduino
-            sdFile.print(res);
-            #endif
-			#ifdef posix
-			fprintf(diskfile,"%d",res);
-			#endif
-            p++;
-            continue;            
-        }
-        if (*p == '"') {    // write everything inside double quotes
-            p++;    // skip past "
-            while (*p != '"') {
-                #ifdef arduino
-                sdFile.write(*p++);
-                #endif
-				#ifdef posix
-				fprintf(diskfile,"%c",*p++);
-				#endif
-            }
-            if (*p == '"') p++;        // skip past term quote
-            continue;
-        }
-        if (*p == ',') {    // write 3 spaces
-            #ifdef arduino
-            sdFile.write("   ");
-            #endif
-			#ifdef posix
-			fprintf(diskfile,"   ");
-			#endif
-            p++;
-            continue;
-        }
-        if (*p == ';') {    // do nothing 
-            p++;
-            continue;
-        }
-        if (*p == '@') {    // write array var
-            memset(temp,0,20);
-            cnt=0;
-            while (*p != ')') 
-                temp[cnt++]=*p++;
-            temp[cnt++]=*p++;       // write )
-            //temp[cnt]='\n';         // and terminating newline
-            error = 0;
-            res = eval(temp);
-            if (error) return ERROR_RETURN; // eval failed
-            #ifdef arduino
-            sdFile.print(res);
-            #endif
-			#ifdef posix
-			fprintf(diskfile,"%d",res);
-			#endif
-            continue;
-        }
-        if (*p == '\n' && *(p-1) == ';') {
-            return NORMAL_RETURN;
-        }
-        if (*p == '\n' && *(p-1) != ';') {
-            #ifdef arduino
-            sdFile.write('\n');
-            #endif
-			#ifdef posix
-			fprintf(diskfile,"\n");
-			#endif
-            return NORMAL_RETURN;
-        }
-   
-        prout(ERR7);    // bad char in line
-        return ERROR_RETURN;
-    }
-
-    return NORMAL_RETURN;   // probably won't get here
+	for (; i<n; i++)
+		a[i] = (int)((unsigned int)a[i] + (unsigned int)v);
 }
 
-/* ******** */
-/* FILEREAD */
-/* ******** */
-int fileread(char line[]) {
-char *p; char temp[MAXLINE]={}, ch;
-int res=0, cnt=0;
-
-#ifdef arduino
-    if (sdFile == NULL) {
-        prout(ERR40);   // no file open for read
-        return ERROR_RETURN;
-    }
+// a[0..n-1] *= v
+void vecmul(int *a, int n, int v) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i vv = _mm256_set1_epi32(v);
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(a+i));
+		_mm256_storeu_si256((__m256i *)(a+i),_mm256_mullo_epi32(x,vv));
+	}
+#elif defined(posix) && defined(__SSE2__)
+	__m128i vv = _mm_set1_epi32(v);
+	for (; i+4 <= n; i+=4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(a+i));
+		_mm_storeu_si128((__m128i *)(a+i),mullo128(x,vv));
+	}
 #endif
-#ifdef posix
-	if (diskfile == NULL) {
-		prout(ERR40);	// no file open for read
-		return ERROR_RETURN;
+	for (; i<n; i++)
+		a[i] = (int)((unsigned int)a[i] * (unsigned int)v);
+}
+
+// a[0..n-1] += b[0..n-1] (sign 1) or -= b[0..n-1] (sign -1)
+void vecaddarray(int *a, const int *b, int n, int sign) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(a+i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+		x = (sign > 0) ? _mm256_add_epi32(x,y) : _mm256_sub_epi32(x,y);
+		_mm256_storeu_si256((__m256i *)(a+i),x);
+	}
+#elif defined(posix) && defined(__SSE2__)
+	for (; i+4 <= n; i+=4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(a+i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+		x = (sign > 0) ? _mm_add_epi32(x,y) : _mm_sub_epi32(x,y);
+		_mm_storeu_si128((__m128i *)(a+i),x);
 	}
 #endif
+	for (; i<n; i++) {
+		if (sign > 0)
+			a[i] = (int)((unsigned int)a[i] + (unsigned int)b[i]);
+		else
+			a[i] = (int)((unsigned int)a[i] - (unsigned int)b[i]);
+	}
+}
 
+// a[0..n-1] *= b[0..n-1]
+void vecmularray(int *a, const int *b, int n) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(a+i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+		_mm256_storeu_si256((__m256i *)(a+i),_mm256_mullo_epi32(x,y));
+	}
+#elif defined(posix) && defined(__SSE2__)
+	for (; i+4 <= n; i+=4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(a+i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+		_mm_storeu_si128((__m128i *)(a+i),mullo128(x,y));
+	}
+#endif
+	for (; i<n; i++)
+		a[i] = (int)((unsigned int)a[i] * (unsigned int)b[i]);
+}
 
-    p = line;
-    p = strstr(line,"fileread");    // point to begin of statement
-    while (islower(*p++));             // point to space after
+// d[0..n-1] = 1 if (a[0..n-1] op v) else 0, op is one of = # < >
+void vecmask(int *d, const int *a, int n, char op, int v) {
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i vv = _mm256_set1_epi32(v), one = _mm256_set1_epi32(1), m;
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+		if (op == '<') m = _mm256_cmpgt_epi32(vv,x);
+		else if (op == '>') m = _mm256_cmpgt_epi32(x,vv);
+		else m = _mm256_cmpeq_epi32(x,vv);
+		if (op == '#') m = _mm256_andnot_si256(m,one);	// not equal
+		else m = _mm256_and_si256(m,one);				// -1/0 to 1/0
+		_mm256_storeu_si256((__m256i *)(d+i),m);
+	}
+#elif defined(posix) && defined(__SSE2__)
+	__m128i vv = _mm_set1_epi32(v), one = _mm_set1_epi32(1), m;
+	for (; i+4 <= n; i+=4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+		if (op == '<') m = _mm_cmplt_epi32(x,vv);
+		else if (op == '>') m = _mm_cmpgt_epi32(x,vv);
+		else m = _mm_cmpeq_epi32(x,vv);
+		if (op == '#') m = _mm_andnot_si128(m,one);	// not equal
+		else m = _mm_and_si128(m,one);				// -1/0 to 1/0
+		_mm_storeu_si128((__m128i *)(d+i),m);
+	}
+#endif
+	for (; i<n; i++) {
+		if (op == '=') d[i] = (a[i] == v);
+		if (op == '#') d[i] = (a[i] != v);
+		if (op == '<') d[i] = (a[i] < v);
+		if (op == '>') d[i] = (a[i] > v);
+	}
+}
 
-    while (1) {     // read chars until vars run out or -1 returned
-        if (*p == '\n' || *p == '\0') return NORMAL_RETURN;
 
-        if (*p == ',' || *p == ' ') {   // ignore space, commas
-            p++;
-            continue;
-        }
-        
-        if (*p >= 'a' && *p <= 'z' ) {  // read data into a variable
-            memset(temp,0,MAXLINE);
-            cnt=0;
-            while (1) {
-				#ifdef arduino
-                ch = sdFile.read();
-				#endif
-				#ifdef posix
-				ch = fgetc(diskfile);
-				#endif
-                if (ch == -1) break; // EOF
-                if ((!(isdigit(ch))) || ch==',') break;
-                temp[cnt++] = ch;    
-            }
-            if (ch == -1) 
-                res=ch;
-            else
-                res = atoi(temp);
-            intvar[*p - 'a'] = res;
-            // if no more data, -1 is returned
-            if (res == -1) return NORMAL_RETURN;
-            p++;
-            continue;
-        }
-        
-        prout(ERR7);    // bad char in line
-        return ERROR_RETURN;      
+// *pp points to '(' - evaluate up to max comma seperated expressions
+// into args[], step *pp past ')' and return how many there were
+int getargs(struct context *ctx, char **pp, int args[], int max) {
+	char temp[MAXLINE];
+	char *p = *pp;
+	int n=0, depth, cnt;
 
-    }
+	if (*p != '(') {
+		prout(ctx,ERR27);   // bad format
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	p++;
+	while (1) {
+		cnt = 0; depth = 0;
+		while (1) {		// copy one expression
+			if (*p == '\n' || *p == '\0' || cnt >= MAXLINE-2) {
+				prout(ctx,ERR44);   // missing closing )
+				ctx->error = 1;
+				return ERROR_RETURN;
+			}
+			if (depth == 0 && (*p == ',' || *p == ')')) break;
+			if (*p == '(') depth++;
+			if (*p == ')') depth--;
+			temp[cnt++] = *p++;
+		}
+		temp[cnt] = '\n';
+		temp[cnt+1] = '\0';
+		if (n >= max) {		// too many
+			prout(ctx,ERR27);   // bad format
+			ctx->error = 1;
+			return ERROR_RETURN;
+		}
+		args[n++] = eval(ctx,temp);
+		if (ctx->error) return ERROR_RETURN;
+		if (*p++ == ')') break;
+	}
+	*pp = p;
+	return n;
+}
 
 
+/* **************************************** */
+/* hash map: PUT k,v  DEL k  GET(k)  HAS(k) */
+/* **************************************** */
+int parse_map(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, option[MAXLINE]={}, temp[MAXLINE+2]={};
+char *p = temp;
+int args[2], n;
+
+	sscanf(line,"%s %s %s ",linenum,keyword,option);
+	sprintf(temp,"(%s)",option);		// same form as function arguments
+	ctx->error = 0;
+	n = getargs(ctx,&p,args,2);
+	if (ctx->error) return ERROR_RETURN;
+	if (strcmp(keyword,"put")==0) {
+		if (n != 2) {
+			prout(ctx,ERR27);   // bad format
+			return ERROR_RETURN;
+		}
+		return hashput(ctx,&ctx->maps->hashmap,args[0],args[1]);
+	}
+	if (n != 1) {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	hashdel(&ctx->maps->hashmap,args[0]);		// not there is not an error
+	return NORMAL_RETURN;
 }
 
+// *pp points to get( or has( - return the value (0 if no key) or 1/0, step past )
+int mapfunc(struct context *ctx, char **pp) {
+	char *p = *pp;
+	int key, n, *v;
+	int has = (strncmp(p,"has(",4)==0);
+
+	p += 3;		// point to (
+	n = getargs(ctx,&p,&key,1);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != 1) {
+		prout(ctx,ERR27);   // bad format
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	*pp = p;
+	v = hashfind(&ctx->maps->hashmap,key);
+	if (has) return (v != NULL);
+	if (v == NULL) return 0;
+	return *v;
+}
 
 
-/* *********** */
-/*    PRINT    */
-/* *********** */
-int parse_print(char line[]) {	// the entire line is passed
-	char *p;
-	char lineno[6]={}, temp[MAXLINE]={};		// create an expression to send to eval()
-	int cnt=0, result=0;
-	int linelen = strlen(line);
-    
-	sscanf(line,"%s ",lineno);
-	
-	p = strstr(line,"print");	// point to print statement
-	if (p == NULL) {
-		prout(ERR27);   // bad format
+/* ********************************************************* */
+/* atomic @(): ATOMIC ADD/XCHG/CAS @(i),... and the XADD(i,n) */
+/* XCHG(i,n) CAS(i,old,new) functions. Each is one indivisible */
+/* step, so threads (PFOR) updating the same element don't     */
+/* lose updates the way LET @(i)=@(i)+1 can.                   */
+/* ********************************************************* */
+int parse_atomic(struct context *ctx, char line[]) {
+char linenum[6]={}, keyword[8]={}, opname[20]={}, option[MAXLINE]={}, temp[MAXLINE+2]={};
+char *p = option + 1;
+int args[2], index, n, op;
+
+	sscanf(line,"%s %s %s %s ",linenum,keyword,opname,option);
+	if (strcmp(opname,"add")==0) op = ATOM_ADD;
+	else if (strcmp(opname,"xchg")==0) op = ATOM_XCHG;
+	else if (strcmp(opname,"cas")==0) op = ATOM_CAS;
+	else {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	if (option[0] != '@' || option[1] != '(') {
+		prout(ctx,ERR29);   // bad array
 		return ERROR_RETURN;
 	}
-	
-	error = 0;
-	
-	while (*p++ != 't');		// point to 1st non-blank after 'print'
-	if (*p == '\n') {           // print a blank line
-        prout("\r\n");
-        return NORMAL_RETURN;
+	ctx->error = 0;
+	n = getargs(ctx,&p,&index,1);		// @(index), p past the )
+	if (ctx->error) return ERROR_RETURN;
+	if (n != 1 || *p != ',') {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
 	}
-   
-	while (1) {		// loop thru 
-		if (p-line > linelen) {
-				prout(ERR39);   // unterminated line
-				return ERROR_RETURN;
-		}
-	
-		// print the value of array @(x)
-		if (*p == '@' && *(p+1) == '(') {
-			error = 0;
-			p+=2;
-			char temp[8]={}; int cnt=0;
-			while (*p != ')')
-				temp[cnt++]=*p++;
-			temp[cnt]='\n';
-			int res = eval(temp);
-			sprintf(printmessage,"%d",intarray[res]);
-			prout(printmessage);
-			p++;
-			continue;
-		}
+	sprintf(temp,"(%s)",p+1);		// the values, same form as function arguments
+	p = temp;
+	n = getargs(ctx,&p,args,2);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != ((op == ATOM_CAS) ? 2 : 1)) {
+		prout(ctx,ERR27);   // bad format
+		return ERROR_RETURN;
+	}
+	atomicop(ctx,op,index,args[0],args[1]);
+	if (ctx->error) return ERROR_RETURN;
+	return NORMAL_RETURN;
+}
 
+// *pp points to xadd( xchg( or cas( - return its value, step past )
+int atomfunc(struct context *ctx, char **pp) {
+	char *p = *pp;
+	int args[3], n, op = ATOM_ADD;
+
+	if (strncmp(p,"xchg(",5)==0) op = ATOM_XCHG;
+	if (strncmp(p,"cas(",4)==0) op = ATOM_CAS;
+	while (*p != '(') p++;
+	n = getargs(ctx,&p,args,3);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != ((op == ATOM_CAS) ? 3 : 2)) {
+		prout(ctx,ERR27);   // bad format
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	*pp = p;
+	return atomicop(ctx,op,args[0],args[1],args[2]);
+}
 
-		if (*p == '\n' && *(p-1) == ';') 
-			return NORMAL_RETURN;
-	
-		if (*p == '\n' && *(p-1) != ';') {
-			prout("\r\n");
-			return NORMAL_RETURN;
-		}
+// do op to @(index) in one step. Returns the old value (add, xchg),
+// or 1 if @(index) was a and is now b, else 0 (cas)
+int atomicop(struct context *ctx, int op, int index, int a, int b) {
+	int old;
+	int *v;
 
-		if (*p == ',') {		// comma (3 spaces)
-			prout("   ");
-			p++;
-			continue;
-		}
-		
-		if (*p == ';') {		// semi-colon - do nothing
-			p++;
-			continue;
+	if (index < 0 || index >= ctx->arraymax) {
+		prout(ctx,ERR45);   // array bounds error
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	if (ctx->sparsemode) {		// only ever one thread in a sparse @() (pfor runs as for)
+		old = arrayget(ctx,index);
+		if (op == ATOM_CAS) {
+			if (old != a) return 0;
+			arrayput(ctx,index,b);
+			return 1;
 		}
+		arrayput(ctx,index,(op == ATOM_ADD) ? (int)((unsigned int)old + (unsigned int)a) : a);	// wraps like the dense add
+		return old;
+	}
+	v = &ctx->intarray[index];
+	if (op == ATOM_ADD) return __atomic_fetch_add(v,a,__ATOMIC_SEQ_CST);
+	if (op == ATOM_XCHG) return __atomic_exchange_n(v,a,__ATOMIC_SEQ_CST);
+	return __atomic_compare_exchange_n(v,&a,b,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+}
 
-		if (*p == ' ') {		// ignore spaces
-			p++;
-			continue;
-		}
 
-		if (*p == '"') {		// double quotes - print everything until next double quotes
-			p++;
-			while (1) {
-				if (*p == '"') break;
-				sprintf(printmessage,"%c",*p);
-				prout(printmessage);
-				p++;
-				if (p-line > linelen) {
-					prout(ERR39);   // unterminated line
-					return ERROR_RETURN;
-				}
-			}
-			p++;		// increment past "
-			continue;
-		}
+/* ******************************************************** */
+/* reduction functions: SUM(a,b) MIN(a,b) MAX(a,b) COUNT(a,b,n) */
+/* and SEARCH(a,b,n)                                            */
+/* ******************************************************** */
+// *pp points to the function name - return its value over @(a) thru @(b)
+int reduce(struct context *ctx, char **pp) {
+	char *p = *pp;
+	int args[3], n, kind=RED_SUM, lo, hi;
+
+	if (strncmp(p,"min(",4)==0) kind = RED_MIN;
+	if (strncmp(p,"max(",4)==0) kind = RED_MAX;
+	if (strncmp(p,"count(",6)==0) kind = RED_COUNT;
+	if (strncmp(p,"search(",7)==0) kind = RED_SEARCH;
+	while (*p != '(') p++;
+	n = getargs(ctx,&p,args,3);
+	if (ctx->error) return ERROR_RETURN;
+	if (n != ((kind == RED_COUNT || kind == RED_SEARCH) ? 3 : 2)) {
+		prout(ctx,ERR27);   // bad format
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	lo = args[0];
+	hi = args[1];
+	if (lo < 0 || lo > hi || hi >= ctx->arraymax) {
+		prout(ctx,ERR45);   // array bounds error
+		ctx->error = 1;
+		return ERROR_RETURN;
+	}
+	*pp = p;
+
+	if (kind == RED_SEARCH) return vecsearch(ctx,lo,hi,args[2]);
+	if (ctx->sparsemode) return sparsereduce(ctx,kind,lo,hi,args[2]);
+	switch (kind) {
+		case RED_MIN: return vecminmax(ctx->intarray+lo,hi-lo+1,0);
+		case RED_MAX: return vecminmax(ctx->intarray+lo,hi-lo+1,1);
+		case RED_COUNT: return veccount(ctx->intarray+lo,hi-lo+1,args[2]);
+	}
+	return vecsum(ctx->intarray+lo,hi-lo+1);
+}
 
-        // test string vars
-        if (*p >= 'a' && *p <= 'z' && *(p+1) == '$') {
-            sprintf(printmessage,"%s",textvar[*p-'a']);
-            prout(printmessage);
-            p+=2;   // point past a$
-            continue;
-        }
+// reduction over a sparse @(): walk the stored elements, not the index range
+int sparsereduce(struct context *ctx, int kind, int lo, int hi, int v) {
+	unsigned int sum=0, missing, stored=0, cnt=0;
+	int res=0, k, x;
+
+	for (unsigned int n=0; n<ctx->maps->sparse.size; n++) {
+		k = ctx->maps->sparse.slot[n].key;
+		if (k == HASHEMPTY || k < lo || k > hi) continue;
+		x = ctx->maps->sparse.slot[n].val;
+		sum += (unsigned int)x;
+		if (stored == 0 || (kind == RED_MIN && x < res) || (kind == RED_MAX && x > res)) 
+			res = x;
+		if (x == v) cnt++;
+		stored++;
+	}
+	missing = (unsigned int)(hi-lo) + 1 - stored;	// elements still at the default
+	switch (kind) {
+		case RED_SUM:
+			return (int)(sum + missing * (unsigned int)ctx->sparsedefault);
+		case RED_MIN:
+			if (missing > 0 && (stored == 0 || ctx->sparsedefault < res)) res = ctx->sparsedefault;
+			return res;
+		case RED_MAX:
+			if (missing > 0 && (stored == 0 || ctx->sparsedefault > res)) res = ctx->sparsedefault;
+			return res;
+	}
+	if (v == ctx->sparsedefault) cnt += missing;
+	return (int)cnt;
+}
 
-        // test numeric vars
-		if ((*p >= 'a' && *p <= 'z') && 
-			(*(p+1)==',' || *(p+1)==';' || *(p+1)=='\n')) {	// print value of integer variable
-				sprintf(printmessage,"%d",intvar[(unsigned char)*p-'a']);		// but only if followed by , or ;  or \n
-				prout(printmessage);
-				p++;							// (otherwise it messes up eval below)
-				continue;
-		}
+// sum of a[0..n-1] (wraps like + does)
+int vecsum(const int *a, int n) {
+	unsigned int sum=0;
+	int i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	int lane[8];
+	for (; i+8 <= n; i+=8)
+		acc = _mm256_add_epi32(acc,_mm256_loadu_si256((const __m256i *)(a+i)));
+	_mm256_storeu_si256((__m256i *)lane,acc);
+	for (int j=0; j<8; j++) sum += (unsigned int)lane[j];
+#elif defined(posix) && defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	int lane[4];
+	for (; i+4 <= n; i+=4)
+		acc = _mm_add_epi32(acc,_mm_loadu_si128((const __m128i *)(a+i)));
+	_mm_storeu_si128((__m128i *)lane,acc);
+	for (int j=0; j<4; j++) sum += (unsigned int)lane[j];
+#endif
+	for (; i<n; i++)
+		sum += (unsigned int)a[i];
+	return (int)sum;
+}
 
-		// evaluate an expression
-		memset(temp,0,MAXLINE); result=0; cnt=0;
-		while (1) {
-			temp[cnt++]=*p++;
-			if (*p == '\n' || *p == ',' || *p == ';') break;
-		}
-		temp[cnt]='\n';		// keep eval() happy
-		result = eval(temp);
-		if (error) {
-			prout(ERR28);   // bad expression
-			return ERROR_RETURN;
-		}
-		sprintf(printmessage,"%d",result);	
-		prout(printmessage);
-		continue;
+// smallest (max=0) or largest (max=1) of a[0..n-1], n > 0
+int vecminmax(const int *a, int n, int max) {
+	int res=a[0], i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i m = _mm256_set1_epi32(a[0]);
+	int lane[8];
+	for (; i+8 <= n; i+=8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+		m = max ? _mm256_max_epi32(m,x) : _mm256_min_epi32(m,x);
+	}
+	_mm256_storeu_si256((__m256i *)lane,m);
+	for (int j=0; j<8; j++)
+		if (max ? lane[j] > res : lane[j] < res) res = lane[j];
+#elif defined(posix) && defined(__SSE2__)
+	__m128i m = _mm_set1_epi32(a[0]), take;
+	int lane[4];
+	for (; i+4 <= n; i+=4) {		// no min/max_epi32 in SSE2: compare and select
+		__m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+		take = max ? _mm_cmpgt_epi32(x,m) : _mm_cmplt_epi32(x,m);
+		m = _mm_or_si128(_mm_and_si128(take,x),_mm_andnot_si128(take,m));
+	}
+	_mm_storeu_si128((__m128i *)lane,m);
+	for (int j=0; j<4; j++)
+		if (max ? lane[j] > res : lane[j] < res) res = lane[j];
+#endif
+	for (; i<n; i++)
+		if (max ? a[i] > res : a[i] < res) res = a[i];
+	return res;
+}
 
-		
+// how many of a[0..n-1] equal v
+int veccount(const int *a, int n, int v) {
+	int cnt=0, i=0;
+#if defined(posix) && defined(__AVX2__)
+	__m256i vv = _mm256_set1_epi32(v), acc = _mm256_setzero_si256();
+	int lane[8];
+	for (; i+8 <= n; i+=8)		// a match is -1, so subtract to count
+		acc = _mm256_sub_epi32(acc,_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(a+i)),vv));
+	_mm256_storeu_si256((__m256i *)lane,acc);
+	for (int j=0; j<8; j++) cnt += lane[j];
+#elif defined(posix) && defined(__SSE2__)
+	__m128i vv = _mm_set1_epi32(v), acc = _mm_setzero_si128();
+	int lane[4];
+	for (; i+4 <= n; i+=4)		// a match is -1, so subtract to count
+		acc = _mm_sub_epi32(acc,_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a+i)),vv));
+	_mm_storeu_si128((__m128i *)lane,acc);
+	for (int j=0; j<4; j++) cnt += lane[j];
+#endif
+	for (; i<n; i++)
+		if (a[i] == v) cnt++;
+	return cnt;
+}
+
+
+// binary search of sorted @(lo..hi) for v - return the index of the first
+// one equal to v, -1 if not there. Lower bound, so runs of equal values
+// don't make it walk back.
+int vecsearch(struct context *ctx, int lo, int hi, int v) {
+	int mid, x, end = hi+1;
+	while (lo < end) {
+		mid = lo + (end-lo)/2;
+		x = ctx->sparsemode ? arrayget(ctx,mid) : ctx->intarray[mid];
+		if (x < v) 
+			lo = mid+1;
+		else
+			end = mid;
 	}
-	// should never get here
-	prout(ERR17);   // unknown error in line
-	return ERROR_RETURN;
+	if (lo > hi) return -1;
+	x = ctx->sparsemode ? arrayget(ctx,lo) : ctx->intarray[lo];
+	return (x == v) ? lo : -1;
 }
 
 
+/* ************** */
+/* SORT @(lo..hi) */
+/* ************** */
+int parse_sort(struct context *ctx, char opt[]) {
+	int lo, hi;
+	if (arrayrange(ctx,opt,&lo,&hi) == ERROR_RETURN) return ERROR_RETURN;
+	if (ctx->sparsemode) return sparsesort(ctx,lo,hi);
+	sortints(ctx->intarray+lo,hi-lo+1);
+	return NORMAL_RETURN;
+}
 
+// sort the stored elements of a sparse range: values below the
+// default go to the bottom, the rest to the top, defaults in between
+int sparsesort(struct context *ctx, int lo, int hi) {
+	int *vals, *keys, k;
+	unsigned int cnt=0, below=0, i;
 
-/* Used in GOTO/GOSUB to find address vs line number */
-/* if curnext == 0, return start address for line in opt */
-/* if curnext == 1, return start address for line # +1 in opt */
-int setlinenumber (char opt[20],int curnext) {
-	int n, startpos=0, pos=0;
-	char basicline[MAXLINE]={};
-	char linenum[6]={};
+	if (ctx->maps->sparse.count == 0) return NORMAL_RETURN;
+	vals = (int *) malloc(2 * ctx->maps->sparse.count * sizeof(int));
+	if (vals == NULL) {
+		prout(ctx,ERR24);   // out of memory
+		return ERROR_RETURN;
+	}
+	keys = vals + ctx->maps->sparse.count;
+	for (i=0; i<ctx->maps->sparse.size; i++) {		// pull them out
+		k = ctx->maps->sparse.slot[i].key;
+		if (k == HASHEMPTY || k < lo || k > hi) continue;
+		keys[cnt] = k;
+		vals[cnt++] = ctx->maps->sparse.slot[i].val;
+	}
+	for (i=0; i<cnt; i++)
+		hashdel(&ctx->maps->sparse,keys[i]);
+	sortints(vals,cnt);
+	while (below < cnt && vals[below] < ctx->sparsedefault) below++;
+	ctx->error = 0;
+	for (i=0; i<cnt; i++) {			// and put them back in order
+		if (i < below)
+			arrayput(ctx,lo+i,vals[i]);
+		else
+			arrayput(ctx,hi-(cnt-1-i),vals[i]);
+		if (ctx->error) break;
+	}
+	free(vals);
+	if (ctx->error) return ERROR_RETURN;
+	return NORMAL_RETURN;
+}
 
-	/* get a line */
-loop:
-		for (n=0; n<MAXLINE; n++) {
-            basicline[n] = buffer[pos];
-            if (buffer[pos] == '\n') break;
-            pos++; if (pos >= position) break;
-        }
+// sort a[0..n-1] ascending - radix sort if there's room for a copy, else introsort
+void sortints(int *a, int n) {
+	int *tmp = (int*)NULL;
+	int depth=0;
+
+	if (n < 2) return;
+	if (n >= RADIXMIN) 
+		tmp = (int *) malloc(n * sizeof(int));
+	if (tmp != NULL) {
+		sortradix(a,tmp,n);
+		free(tmp);
+		return;
+	}
+	for (int i=n; i>1; i>>=1) depth += 2;	// 2*log2(n) before heap sort takes over
+	sortintro(a,n,depth);
+}
 
-        if (pos++ >= position) {
-            prout(ERR8);    // line not found
-			return ERROR_RETURN; 
-        }
+// LSD radix sort, 8 bits per pass, sign bit flipped so negatives sort first
+void sortradix(int *a, int *tmp, int n) {
+	unsigned int count[256], sum, c;
+	int *src=a, *dst=tmp, *t;
+	int i, b;
+
+	for (int shift=0; shift<32; shift+=8) {
+		memset(count,0,sizeof(count));
+		for (i=0; i<n; i++)
+			count[(((unsigned int)src[i] ^ 0x80000000u) >> shift) & 0xff]++;
+		b = (((unsigned int)src[0] ^ 0x80000000u) >> shift) & 0xff;
+		if (count[b] == (unsigned int)n) continue;		// all the same here - skip the pass
+		sum = 0;
+		for (b=0; b<256; b++) {		// count -> first slot of each bucket
+			c = count[b];
+			count[b] = sum;
+			sum += c;
+		}
+		for (i=0; i<n; i++)
+			dst[count[(((unsigned int)src[i] ^ 0x80000000u) >> shift) & 0xff]++] = src[i];
+		t = src; src = dst; dst = t;
+	}
+	if (src != a) memcpy(a,src,n*sizeof(int));
+}
 
-		sscanf(basicline,"%s ",linenum);	// get linenum
-		if (atoi(linenum) == atoi(opt)) {
-			if (!curnext) return startpos;		// return address of linenum
-			if (curnext) return pos;			// return address of linenum+1
+// quicksort (median of 3), heap sort when depth runs out, insertion sort for the small bits
+void sortintro(int *a, int n, int depth) {
+	int i, j, x, pivot;
+
+	while (n > 16) {
+		if (depth-- == 0) {
+			sortheap(a,n);
+			return;
 		}
-		memset(basicline,0,MAXLINE);
-		startpos = pos;
-		goto loop;
+		i = 0; j = n-1;
+		pivot = a[n/2];		// median of first/middle/last
+		if (a[0] < pivot) {
+			if (a[n-1] < pivot) pivot = (a[0] < a[n-1]) ? a[n-1] : a[0];
+		} else {
+			if (a[n-1] > pivot) pivot = (a[0] < a[n-1]) ? a[0] : a[n-1];
+		}
+		while (1) {		// hoare partition
+			while (a[i] < pivot) i++;
+			while (a[j] > pivot) j--;
+			if (i >= j) break;
+			x = a[i]; a[i] = a[j]; a[j] = x;
+			i++; j--;
+		}
+		// recurse into the smaller half, loop on the bigger one
+		if (j+1 < n-j-1) {
+			sortintro(a,j+1,depth);
+			a += j+1;
+			n -= j+1;
+		} else {
+			sortintro(a+j+1,n-j-1,depth);
+			n = j+1;
+		}
+	}
+	for (i=1; i<n; i++) {
+		x = a[i];
+		for (j=i; j>0 && a[j-1] > x; j--)
+			a[j] = a[j-1];
+		a[j] = x;
+	}
 }
 
-#ifdef arduino
-/* *********** */
-/* analog read */
-/* *********** */
-int dueanalog(int val) {
-    // the compiler decodes the A0-A11 in analogRead - can't
-    // be done at runtime. So we do this ugly piece of code    
+void sortheap(int *a, int n) {
+	int x;
+	for (int i=n/2-1; i>=0; i--)	// build the heap
+		siftdown(a,i,n);
+	for (int i=n-1; i>0; i--) {		// move the largest to the end, re-heap the rest
+		x = a[0]; a[0] = a[i]; a[i] = x;
+		siftdown(a,0,i);
+	}
+}
 
-    switch (val) {
-        case 0:
-        return analogRead(A0);
-        break;
-        case 1:
-        return analogRead(A1);
-        break;
-        case 2:
-        return analogRead(A2);
-        break;
-        case 3:
-        return analogRead(A3);
-        break;
-        case 4:
-        return analogRead(A4);
-        break;
-        case 5:
-        return analogRead(A5);
-        break;
-        case 6:
-        return analogRead(A6);
-        break;
-        case 7:
-        return analogRead(A7);
-        break;
-        case 8:
-        return analogRead(A8);
-        break;
-        case 9:
-        return analogRead(A9);
-        break;
-        case 10:
-        return analogRead(A10);
-        break;
-        case 11:
-        return analogRead(A11);
-        break;
-        default:
-        return -1;
-    }
+// move a[root] down the heap a[0..n-1] to where it belongs
+void siftdown(int *a, int root, int n) {
+	int child, x;
+	while ((child = 2*root+1) < n) {
+		if (child+1 < n && a[child+1] > a[child]) child++;
+		if (a[root] >= a[child]) return;
+		x = a[root]; a[root] = a[child]; a[child] = x;
+		root = child;
+	}
 }
-#endif
 
 
-/* *************** */
-/*    isoperand    */
-/* *************** */
-// return 1 if supplied char is an operand
-int isoperand(char ch) {
-	if (ch == '+' ||	// plus
-		ch == '-' ||	// subtract
-		ch == '*' ||	// multiply
-		ch == '/' ||	// divide
-		ch == '%' ||	// modulo
-		ch == '&' ||	// and
-		ch == '|' ||	// or
-		ch == '^' ||	// xor
-		ch == 'E' ||	// exponent ie 2E3 = 2*2*2
-        ch == 'e' ||    // lower case
-		ch == '~' ) 	// compliment
-		return 1;
-	else
-		return 0;
+// step over an expression, stop at a ',' ' ' or end of line outside of ()
+char *skipexpr(char *p) {
+	int depth=0;
+	while (*p != '\n' && *p != '\0') {
+		if (depth == 0 && (*p == ',' || *p == ' ')) break;
+		if (*p == '(') depth++;
+		if (*p == ')') depth--;
+		p++;
+	}
+	return p;
 }
 
 
 /* ****************************** */
 /* evaluate arithmetic expression */
 /* ****************************** */
-int eval (char *expr) {
+int eval (struct context *ctx, char *expr) {
 
 int lvalue=0, rvalue=0, cnt=0, index=0, res=0;
 char operand='\0';
@@ -2688,29 +7314,25 @@ int MINUSFLAG=0;
 char *p;
 
 	// all other routines return an address or return value. This returns an integer value.
+	ctx->stats.evals++;
 	
-	if (DEBUG) {
-		sprintf(printmessage,"in eval: [%s]\r\n",expr);
-		prout(printmessage);
-	}
-
 	if (*expr == '\n' || *expr == '\0') {
-		error = 1;
+		ctx->error = 1;
 		return ERROR_RETURN;			// initial error check for empty expression
 	}
 
 #ifdef arduino
 	/* arduino specific commands */
-	error = 0;
+	ctx->error = 0;
 	p = strstr(expr,"pinread(");	// test pinread
 	if (p != NULL) {
 		while (*p++ != '(');	// point to variable
         //Serial.print("*p="); Serial.println(*p);
 		if (*p >= 'a' && *p <= 'z') {	// use var as pin #
-			res = intvar[*p - 'a'];		// get pin #
+			res = ctx->intvar[*p - 'a'];		// get pin #
 			//Serial.print("pin number "); Serial.println(res,DEC);
 			pinMode(res,INPUT_PULLUP);
-			if (*(p+1) != ')') error = 1;	// trailing )
+			if (*(p+1) != ')') ctx->error = 1;	// trailing )
 			return digitalRead(res);
 		}
 		// must be a number
@@ -2722,7 +7344,7 @@ char *p;
 			res = atoi(value);
             //Serial.print("pin number "); Serial.println(res,DEC);
 			pinMode(res,INPUT_PULLUP);
-			if (*p != ')') error = 1;	// trailing )
+			if (*p != ')') ctx->error = 1;	// trailing )
 			return digitalRead(res);
 		}
         
@@ -2734,16 +7356,16 @@ char *p;
 			while(isdigit(*p)) 
 					value[cnt++] = *p++;
 			if (atoi(value) < 0 || atoi(value) > 11) {	// bad number
-				prout(ERR43);   // bad pin number
-				error = 1;
+				prout(ctx,ERR43);   // bad pin number
+				ctx->error = 1;
 				return ERROR_RETURN;
 			}
 			res = dueanalog(atoi(value));
-            if (res == -1) error = 1;
+            if (res == -1) ctx->error = 1;
 			return res;
 		}
-		prout(ERR43);   // bad pin number
-		error = 1;
+		prout(ctx,ERR43);   // bad pin number
+		ctx->error = 1;
 		return ERROR_RETURN;
 	}
 #endif
@@ -2754,11 +7376,11 @@ char *p;
 	if (p != NULL) {
 		while (*p++ != '(');	// pointing to variable
 		if (*p >= 'a' && *p <= 'z') {	// it's a var
-			if (intvar[*p - 'a'] < 0)
-				res = intvar[*p - 'a'] * -1;
+			if (ctx->intvar[*p - 'a'] < 0)
+				res = ctx->intvar[*p - 'a'] * -1;
 			else
-				res = intvar[*p - 'a'];
-			if (*(p+1) != ')') error = 1;
+				res = ctx->intvar[*p - 'a'];
+			if (*(p+1) != ')') ctx->error = 1;
 			return res;
 		}
 	}
@@ -2786,8 +7408,9 @@ evalloop:
 
 	if (*expr == '\n' || *expr == '\0' || *expr == ',' || *expr == ' ')  {
 		if (operand != '\0')
-			lvalue = domath(lvalue,operand,rvalue);
-		printf("top: lvalue=%d\n",lvalue);
+			lvalue = domath(ctx,lvalue,operand,rvalue);
+		sprintf(ctx->printmessage,"top: lvalue=%d\n",lvalue);
+		prout(ctx,ctx->printmessage);
 		return lvalue;
 	}
 
@@ -2803,12 +7426,12 @@ evalloop:
 			if (operand == '\0') 
 				return rvalue;
 			else {
-				lvalue = domath(lvalue,operand,rvalue);
+				lvalue = domath(ctx,lvalue,operand,rvalue);
 				return lvalue;
 			}
 		}
 		if (operand != '\0') {	// middle of an expresion
-			lvalue = domath(lvalue,operand,rvalue);
+			lvalue = domath(ctx,lvalue,operand,rvalue);
 			operand = '\0';
 			rvalue = 0;
 			if (isoperand(*expr)) 
@@ -2825,21 +7448,51 @@ evalloop:
 		
 	}
 
+	// test reduction functions
+	if (strncmp(expr,"sum(",4)==0 || strncmp(expr,"min(",4)==0 ||
+		strncmp(expr,"max(",4)==0 || strncmp(expr,"count(",6)==0 ||
+		strncmp(expr,"search(",7)==0) {
+		rvalue = reduce(ctx,&expr);		// expr now points past )
+		if (ctx->error) return ERROR_RETURN;
+		goto gotvalue;
+	}
+
+	// test hash map functions
+	if (strncmp(expr,"get(",4)==0 || strncmp(expr,"has(",4)==0) {
+		rvalue = mapfunc(ctx,&expr);	// expr now points past )
+		if (ctx->error) return ERROR_RETURN;
+		goto gotvalue;
+	}
+
+	// test atomic @() functions
+	if (strncmp(expr,"xadd(",5)==0 || strncmp(expr,"xchg(",5)==0 || strncmp(expr,"cas(",4)==0) {
+		rvalue = atomfunc(ctx,&expr);	// expr now points past )
+		if (ctx->error) return ERROR_RETURN;
+		goto gotvalue;
+	}
+
+	// test named array a(i,j)
+	if (*expr >= 'a' && *expr <= 'z' && *(expr+1) == '(') {
+		rvalue = namedget(ctx,&expr);	// expr now points past )
+		if (ctx->error) return ERROR_RETURN;
+		goto gotvalue;
+	}
+
 	// test letters
 	if (*expr >= 'a' && *expr <= 'z') {
-		rvalue = intvar[*expr - 'a'];
+		rvalue = ctx->intvar[*expr - 'a'];
 		if (MINUSFLAG) rvalue *= -1;
 		expr++;
 		if (*expr == '\n' || *expr == '\0' || *expr == ',' || *expr == ' ') {
 			if (operand == '\0')
 				return rvalue;
 			else {
-				lvalue = domath(lvalue,operand,rvalue);
+				lvalue = domath(ctx,lvalue,operand,rvalue);
 				return lvalue;
 			}
 		}
 		if (operand != '\0') {  // middle of an expresion
-            lvalue = domath(lvalue,operand,rvalue);
+            lvalue = domath(ctx,lvalue,operand,rvalue);
             operand = '\0';
             rvalue = 0;
             if (isoperand(*expr))
@@ -2867,33 +7520,29 @@ evalloop:
 			index = atoi(value);
 		}
 		if (*expr >= 'a' && *expr <= 'z') {	// var in array index
-			index = intvar[*expr - 'a'];
+			index = ctx->intvar[*expr - 'a'];
             expr++;
 		}
 		if (*expr != ')') {		
-			prout(ERR44);   // missing closing )
-			error = 1;
+			prout(ctx,ERR44);   // missing closing )
+			ctx->error = 1;
 			return ERROR_RETURN;
 		}
 		expr++;	// point past ')'
        
-		if (index >= arraymax) {
-			prout(ERR45);   // array bounds error
-			error = 1;
-			return ERROR_RETURN;
-		}
-		rvalue = intarray[index];
+		rvalue = arrayget(ctx,index);
+		if (ctx->error) return ERROR_RETURN;		// bounds error
 		if (MINUSFLAG) rvalue *= -1;
 		if (*expr == '\n' || *expr == '\0' || *expr == ',' || *expr == ' ') {
 			if (operand == '\0')
 				return rvalue;
 			else {
-				lvalue = domath(lvalue,operand,rvalue);
+				lvalue = domath(ctx,lvalue,operand,rvalue);
 				return lvalue;
 			}
 		}
 		if (operand != '\0') {	// mid expr
-			lvalue = domath(lvalue,operand,rvalue);
+			lvalue = domath(ctx,lvalue,operand,rvalue);
 			operand = '\0';
 			rvalue = 0;
 			if (isoperand(*expr))
@@ -2909,12 +7558,38 @@ evalloop:
 		goto evalloop;
 	}
 
-	error = 1;
+	ctx->error = 1;
 	return ERROR_RETURN;
+
+gotvalue:	// rvalue came from a function or named array, expr points past its )
+	if (MINUSFLAG) rvalue *= -1;
+	if (*expr == '\n' || *expr == '\0' || *expr == ',' || *expr == ' ') {
+		if (operand == '\0')
+			return rvalue;
+		else {
+			lvalue = domath(ctx,lvalue,operand,rvalue);
+			return lvalue;
+		}
+	}
+	if (operand != '\0') {	// mid expr
+		lvalue = domath(ctx,lvalue,operand,rvalue);
+		operand = '\0';
+		rvalue = 0;
+		if (isoperand(*expr))
+			operand = *expr++;
+		goto evalloop;
+	}
+	if (isoperand(*expr)) {
+		operand = *expr;
+		expr++;
+		lvalue = rvalue; rvalue = 0;
+		goto evalloop;
+	}
+	goto evalloop;
 }
 
 
-int domath(int lvalue, char operand, int rvalue) {
+int domath(struct context *ctx, int lvalue, char operand, int rvalue) {
 int res = 0;
 
 	switch (operand) {
@@ -2932,16 +7607,16 @@ int res = 0;
 			break;
 		case '/':	// divide
 			if (rvalue == 0) {
-				prout(ERR46);   // divide by zero
-				error = 1;
+				prout(ctx,ERR46);   // divide by zero
+				ctx->error = 1;
 				return ERROR_RETURN;
 			}
 			return lvalue / rvalue;
 			break;
 		case '%':	// modulo (remainder)
 			if (rvalue == 0) {
-				prout(ERR46);   // divide by zero
-				error = 1;
+				prout(ctx,ERR46);   // divide by zero
+				ctx->error = 1;
 				return ERROR_RETURN;
 			}
 			return lvalue % rvalue;
@@ -2970,8 +7645,8 @@ int res = 0;
 			break;
 
 		default:	// really shouldn't get here
-			prout(ERR47);   // unknown operand
-			error = 1;
+			prout(ctx,ERR47);   // unknown operand
+			ctx->error = 1;
 			return ERROR_RETURN;
 		}
 }
@@ -2981,29 +7656,61 @@ int res = 0;
 /* ************************************************ */
 /*    Evaluate Logical Expression (used in if/then) */
 /* ************************************************ */
-int evallogic(char *expr) {		// logical evaluation, return 1 if true, 0 if false
+// return 1 if p points to a named array or function: a(...), get(...)
+int iscall(char *p) {
+	char *q = p;
+	while (*q >= 'a' && *q <= 'z') q++;
+	return (q > p && *q == '(');
+}
+
+// evaluate the array element or function at *pp, step *pp past its )
+int callvalue(struct context *ctx, char **pp) {
+	char temp[MAXLINE]={};
+	char *p = *pp;
+	int cnt=0, depth=0;
+	while (1) {
+		if (*p == '\0' || *p == '\n' || cnt >= MAXLINE-2) {
+			prout(ctx,ERR44);   // missing closing )
+			ctx->error = 1;
+			return ERROR_RETURN;
+		}
+		if (*p == '(') depth++;
+		temp[cnt++] = *p;
+		if (*p++ == ')' && --depth == 0) break;
+	}
+	temp[cnt] = '\n';
+	*pp = p;
+	return eval(ctx,temp);
+}
+
+int evallogic(struct context *ctx, char *expr) {		// logical evaluation, return 1 if true, 0 if false
 char operand = '\0';
 char value[20]={};
 int lvalue=0, rvalue=0;
 int cnt=0;
 
-	// 1st char MUST be a variable
-	if (*expr >= 'a' && *expr <= 'z') {
-		lvalue = intvar[(unsigned char)*expr-'a'];	// get value of variable
+	// 1st char MUST be a variable, array or function
+	if (iscall(expr)) {
+		lvalue = callvalue(ctx,&expr);	// point to '=' after a(i), get(k) etc
+		if (ctx->error) return ERROR_RETURN;
+	}
+	else if (*expr >= 'a' && *expr <= 'z') {
+		lvalue = ctx->intvar[(unsigned char)*expr-'a'];	// get value of variable
 		expr++;		// point to '=' after variable
 	}
 
 	if (*expr == '@' && *(expr+1) == '(') {
 		expr+=2;
 		if (*expr >= 'a' && *expr <= 'z') {
-			int index = intvar[(unsigned char)*expr - 'a'];
-			lvalue = intarray[index];
+			int index = ctx->intvar[(unsigned char)*expr - 'a'];
+			lvalue = arrayget(ctx,index);
+			if (ctx->error) return ERROR_RETURN;
 			expr++; // point to ');
 			expr++;	// point to '='
 		}
 		else {
-			prout("index to array must be a variable (a-z)\r\n");
-			error = 1;
+			prout(ctx,"index to array must be a variable (a-z)\r\n");
+			ctx->error = 1;
 			return ERROR_RETURN;
 		}
 	}
@@ -3019,14 +7726,20 @@ int cnt=0;
 			 rvalue = atoi(value);
 			 goto logictest;
 		}
+		// test named arrays and functions
+		if (iscall(expr)) {
+			rvalue = callvalue(ctx,&expr);
+			if (ctx->error) return ERROR_RETURN;
+			goto logictest;
+		}
 		// test variables
 		if (*expr >= 'a' && *expr <= 'z') {
-			rvalue = intvar[(unsigned char)*expr-'a'];
+			rvalue = ctx->intvar[(unsigned char)*expr-'a'];
 			goto logictest;
 		}
 		// neither number or var - show error and return
-		prout("logical eval error");
-		error=1;
+		prout(ctx,"logical eval error");
+		ctx->error=1;
 		return ERROR_RETURN;
 	
 
@@ -3054,15 +7767,15 @@ logictest:	// test variable against rvalue
 				return (lvalue ^ rvalue);
 				break;
 			default:
-				sprintf(printmessage,"unknown operand [%c]",operand);
-				prout(printmessage);
-				error=1;
+				sprintf(ctx->printmessage,"unknown operand [%c]",operand);
+				prout(ctx,ctx->printmessage);
+				ctx->error=1;
 				return ERROR_RETURN;
 		}
 
 		// end of tests
 	
-	prout(ERR17);   // unknown error
-	error = 1;
+	prout(ctx,ERR17);   // unknown error
+	ctx->error = 1;
 	return ERROR_RETURN;
 }
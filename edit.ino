@@ -1,21 +1,19 @@
 /* edit.ino - simple line editor for due */
 
-void ledit() {
+void ledit(struct context *ctx) {
     /* pre-define functions */
     void buffersave(char[],unsigned char*);
     int bufferload(char[],unsigned char*);
-    int bufferdelete(char[],unsigned char*);
-    int bufferinsert(char[],unsigned char*);
+    int bufferdelete(struct context *,char[],unsigned char*);
+    int bufferinsert(struct context *,char[],unsigned char*);
 
     
     /* setup buffer and pointers */    
     char line[MAXLINE]={};
 
-    /* use buffer set up in basic() */
-    extern unsigned char* buffer;
-    unsigned char* buf = buffer;
-    extern unsigned int position;
-    unsigned int pos = position;
+    /* use buffer set up in basic(), our own copy since we edit it */
+    if (progwrite(ctx) == ERROR_RETURN) return;
+    unsigned char* buf = ctx->buffer;
     Serial.println("\r\nOk,");  // we're ready
 
     /* this is the main edit loop */
@@ -39,7 +37,7 @@ void ledit() {
         
         /* list - show buffer contents */
         if (strncmp(line,"list",4)==0) {
-            ledlist(buf,position);  //*
+            ledlist(buf,ctx->position);  //*
             Serial.println("\r\nOk,");
             continue;
         }
@@ -47,7 +45,7 @@ void ledit() {
         /* new - clear the buffer, reset pointers */
         if (strncmp(line,"new",3)==0) {
             memset(buf,0,BUFSIZE);
-            position = 0;   //*
+            ctx->position = 0;   //*
             Serial.println("\r\nOk,");
             continue;
         }
@@ -55,7 +53,7 @@ void ledit() {
         /* mem - show free memory */
         if (strncmp(line,"mem",3)==0) {
             Serial.print("Free edit memory: "); 
-            Serial.print(BUFSIZE-position); //*
+            Serial.print(BUFSIZE-ctx->position); //*
             Serial.println(" bytes");
             showmem();  // and show arduino stats
             Serial.println("\r\nOk,");
@@ -82,29 +80,29 @@ void ledit() {
 
         /* dir [subdir] - show directory */
         if (strncmp(line,"dir",3)==0) {
-            dir(line);
+            dir(ctx,line);
             Serial.println("\r\nOk,");
             continue;
         }
 
         /* save file - save buffer to file */
         if (strncmp(line,"save",4)==0) {
-            filesave(line);
+            filesave(ctx,line);
             Serial.println("\r\nOk,");
             continue;
         }
 
         /* load file - load file into buffer */
         if (strncmp(line,"load",4)==0) {
-            fileload(line);
+            fileload(ctx,line);
             Serial.println("\r\nOk,");
             continue;
         }
 
         /* d # - delete a line */
         if (strncmp(line,"d ",2)==0) {
-            int res = bufferdelete(line,buf);  //*
-            if (res > 0) position = res;    //*
+            int res = bufferdelete(ctx,line,buf);  //*
+            if (res > 0) ctx->position = res;    //*
             Serial.println("\r\nOk,");
             continue;
         }
@@ -113,7 +111,7 @@ void ledit() {
         if (strncmp(line,"dump",4)==0) {
             char printmessage[MAXLINE];
             int addr = 0;
-            while (addr < position) {   //*
+            while (addr < ctx->position) {   //*
                 sprintf(printmessage,"%04X  ",addr);
                 Serial.print(printmessage);
                 for (int n=0; n<16; n++) {
@@ -135,8 +133,8 @@ void ledit() {
         /* i # - insert line(s) of text in buffer */
         if (strncmp(line,"i ",2)==0) {
             int res=0;
-            res = bufferinsert(line,buf);  //*
-            if (res > 0) position = res;    //*
+            res = bufferinsert(ctx,line,buf);  //*
+            if (res > 0) ctx->position = res;    //*
             Serial.println("\r\nOk,");
             continue;
         }
@@ -144,14 +142,14 @@ void ledit() {
 
         /* a - append text to end of buffer */
         if (line[0] == 'a') {
-            append();
+            append(ctx);
             Serial.println("\r\nOk,");
             continue;
         }
 
         /* f [string] - find a string in the buffer */
         if (strncmp(line,"f ",2)==0) {  
-            find(line);
+            find(ctx,line);
             Serial.println("\r\nOk,");
             continue;
         }
@@ -169,7 +167,7 @@ void ledit() {
 
 
 /* append to end of text */
-void append(void) {
+void append(struct context *ctx) {
     char line[MAXLINE];
     int n=0;
     while (1) {
@@ -178,14 +176,14 @@ void append(void) {
         sgets(line);
         if (strncmp(line,".q",2)==0) return;
         for (n=0; n < strlen(line); n++)
-            buffer[position++] = line[n];
+            ctx->buffer[ctx->position++] = line[n];
         continue;
     }
         
 }
 
 /* insert before line (ie ins 5) */
-int bufferinsert(char cmdline[MAXLINE],unsigned char *buffer) {//*
+int bufferinsert(struct context *ctx, char cmdline[MAXLINE],unsigned char *buffer) {//*
 char cmd[12]={},linenum[12]={}, line[MAXLINE];
 int linen=0, start=-1, end=1, n=0, ctr=1, len=0, i=0;
     sscanf(cmdline,"%s %s ",cmd,linenum);
@@ -194,7 +192,7 @@ int linen=0, start=-1, end=1, n=0, ctr=1, len=0, i=0;
         Serial.println("bad line number");
         return -1;
     }
-    for (n=0; n<position; n++) { //*
+    for (n=0; n<ctx->position; n++) { //*
         if (buffer[n] == '\n') {
             end = n;
             if (linen == ctr) break;    // match
@@ -204,7 +202,7 @@ int linen=0, start=-1, end=1, n=0, ctr=1, len=0, i=0;
             continue;
         }
     }
-    if (n == position || linen != ctr) {    // no match
+    if (n == ctx->position || linen != ctr) {    // no match
         Serial.println("line not found");
         return -1;
     }
@@ -214,11 +212,11 @@ loop:    // start insert at start
     Serial.print("i> ");
     memset(line,0,MAXLINE);
     sgets(line);     // get a line from the user
-    if (strncmp(line,".q",2)==0) return position;   // done here
+    if (strncmp(line,".q",2)==0) return ctx->position;   // done here
     len = strlen(line);
     /* shift up buffer by strlen(line) */
-    memmove(&buffer[start+len],&buffer[start],position-start);
-    position += len;
+    memmove(&buffer[start+len],&buffer[start],ctx->position-start);
+    ctx->position += len;
     /* and insert new line */
     for (i=start, n=0; i<=start+(strlen(line)-1); i++)
         buffer[i] = line[n++];
@@ -230,7 +228,7 @@ loop:    // start insert at start
     
 
 /* delete a line given a line number (ie del 10) */
-int bufferdelete(char line[MAXLINE],unsigned char *buffer) {
+int bufferdelete(struct context *ctx, char line[MAXLINE],unsigned char *buffer) {
 char cmd[12]={},linenum[12]={};
 int linen=0, start=-1, end=1, n=0, ctr=1;
     sscanf(line,"%s %s ",cmd,linenum);
@@ -239,7 +237,7 @@ int linen=0, start=-1, end=1, n=0, ctr=1;
         Serial.println("bad line number");
         return -1;
     }
-    for (n=0; n<position; n++) {
+    for (n=0; n<ctx->position; n++) {
         if (buffer[n] == '\n') {
             end = n;
             if (linen == ctr) break;    // match
@@ -249,13 +247,13 @@ int linen=0, start=-1, end=1, n=0, ctr=1;
             continue;
         }
     }
-    if (n == position || linen != ctr) {    // no match
+    if (n == ctx->position || linen != ctr) {    // no match
         Serial.println("line not found");
         return -1;
     }
     // line num match. line is start->end
     end += 1; start += 1;  // skip past \n at EOL
-    while (end < position)
+    while (end < ctx->position)
         buffer[start++] = buffer[end++]; 
     for (n=start; n<BUFSIZE; n++) buffer[n] = '\0'; // set mem to NULL
     return start;   // new position value
@@ -285,7 +283,7 @@ int n=0, lineno=1;
 }
 
 
-void find(char temp[]) {
+void find(struct context *ctx, char temp[]) {
 char cmd[6]={}, sstring[MAXLINE]={}, line[MAXLINE]={};
     char *p;
     sscanf(temp,"%s %s ",cmd,sstring);
@@ -293,11 +291,11 @@ char cmd[6]={}, sstring[MAXLINE]={}, line[MAXLINE]={};
     while (1) {
         memset(line,0,MAXLINE);
         i=0; linenum++;
-        for (n=start; n<position; n++) {
-            line[i++]=buffer[n];
-            if (buffer[n] == '\n') break;
+        for (n=start; n<ctx->position; n++) {
+            line[i++]=ctx->buffer[n];
+            if (ctx->buffer[n] == '\n') break;
         }
-        if (n >= position) return;
+        if (n >= ctx->position) return;
         // we have a line
         start = n+1;    // skip \n
         p = strstr(line,sstring);
@@ -0,0 +1,70 @@
+/* tracedec.c - print a trace written by tracedump file
+ *
+ *	cc -O2 -o tracedec tracedec.c
+ *	./tracedec trace.bin [n]
+ *
+ * At the Ok> prompt: trace, run, then tracedump trace.bin writes the
+ * ring of the last lines run. This prints them the way tracedump n
+ * does, all of them or the last n, on a machine without basic.
+ *
+ * The file is "TBTRACE1\n", the statement names one per line (their
+ * numbers are the kind in a record), an empty line, a 32 bit count
+ * and that many records, oldest first, as struct tracerec in basic.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXKINDS 256
+
+struct tracerec {
+	unsigned int us;		// usec since trace went on (wraps after 71 min)
+	unsigned short line;	// line number
+	unsigned char kind;		// statement: index into the names
+	unsigned char task;		// task that ran it, 0 = main
+};
+
+int main(int argc, char **argv) {
+	char name[64], *kinds[MAXKINDS] = {0};
+	unsigned long long us = 0;
+	unsigned int count, prev = 0, n, show, nkinds = 0;
+	struct tracerec r;
+	FILE *fp;
+
+	if (argc < 2) {
+		fprintf(stderr,"usage: %s tracefile [n]\n",argv[0]);
+		return 1;
+	}
+	fp = fopen(argv[1],"rb");
+	if (fp == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fgets(name,sizeof(name),fp) == NULL || strcmp(name,"TBTRACE1\n") != 0) {
+		fprintf(stderr,"%s: not a basic trace\n",argv[1]);
+		return 1;
+	}
+	while (fgets(name,sizeof(name),fp) != NULL && name[0] != '\n') {
+		name[strcspn(name,"\n")] = '\0';
+		if (nkinds < MAXKINDS) kinds[nkinds++] = strdup(name);
+	}
+	if (fread(&count,sizeof(count),1,fp) != 1) {
+		fprintf(stderr,"%s: no records\n",argv[1]);
+		return 1;
+	}
+	show = (argc > 2 && atoi(argv[2]) > 0) ? (unsigned int)atoi(argv[2]) : count;
+	if (show > count) show = count;
+
+	printf("%u lines in the trace, the last %u:\n",count,show);
+	printf("        usec  task   line  statement\n");
+	for (n=0; n<count && fread(&r,sizeof(r),1,fp) == 1; n++) {
+		us += r.us - prev;		// 32 bit times wrap: add up the steps
+		prev = r.us;
+		if (n < count - show) continue;
+		printf("%12llu %5d %6d  %s\n",us,r.task,r.line,
+			r.kind < nkinds ? kinds[r.kind] : "?");
+	}
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/* tinybasic.h - run Tiny+ Basic inside a C/C++ program
+ *
+ * Build basic.c for posix with library defined (see the top of
+ * basic.c) and link it in with your own code. There is no main()
+ * and no prompt: the host makes interpreters and drives them.
+ *
+ * Each struct context is one interpreter with its own program,
+ * variables and arrays. Interpreters from tb_new share nothing, but one
+ * interpreter must only be used by one thread at a time.
+ *
+ * Calling a basic subroutine:
+ *	struct context *bs = tb_new();
+ *	tb_load(bs,"10 let a=a+1\n20 return\n");
+ *	int sub = tb_line(bs,10);	// look the line up once
+ *	tb_setvar(bs,'a',41);
+ *	tb_call(bs,sub);		// runs 10, 20 and comes back
+ *	printf("%d\n",tb_getvar(bs,'a'));	// 42
+ *	tb_free(bs);
+ *
+ * tb_share gives a new interpreter that runs the same program
+ * without copying it: the program text and line index are shared
+ * (read only) and only variables, arrays and stacks are per
+ * interpreter. If either one loads a new program it gets its own
+ * copy first. Share from an interpreter that is not running.
+ *
+ * PRINT output and error messages go to stdout.
+ */
+
+#ifndef TINYBASIC_H
+#define TINYBASIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* return values */
+#define TB_OK 0			// tb_run: finished. tb_call: got to the RETURN
+#define TB_END 1		// tb_call: END, STOP or the last line came first
+#define TB_ERROR -1		// something failed, message already printed
+
+struct context;			// one interpreter (defined in basic.c)
+
+struct context *tb_new(void);		// NULL if out of memory
+struct context *tb_share(struct context *);	// same program, own variables
+void tb_free(struct context *);
+
+int tb_load(struct context *, const char *program);	// replace the program
+int tb_run(struct context *);		// 'run': clear variables, start at the top
+
+int tb_line(struct context *, int linenumber);	// address for tb_call, TB_ERROR if none
+int tb_call(struct context *, int addr);	// GOSUB addr, return at its RETURN
+
+int tb_getvar(struct context *, char var);	// a-z
+void tb_setvar(struct context *, char var, int value);
+int tb_getarray(struct context *, int index);	// @(index), after DIM
+int tb_setarray(struct context *, int index, int value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif